@@ -0,0 +1,40 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include "freeflow.h"
+#include "transport.h"
+#include "format.h"
+
+/* Room left in front of the events for the HTTP header, so a batch can be
+ * sent with a single write.  Large enough for the longest path, host name
+ * and token the configuration allows. */
+#define BATCH_HEADER_RESERVE  4096
+#define BATCH_INITIAL_SIZE    65536
+#define BATCH_INITIAL_PACKETS 64
+
+/* Events from many packets collected into a single HEC request.  A copy
+ * of every packet in the batch is kept, so the whole batch can be
+ * requeued if it can't be delivered. */
+typedef struct hec_batch {
+    char* buffer;              /* Header reserve followed by the events */
+    int buffer_size;
+    int payload_len;           /* Bytes of events after the header reserve */
+    int events;
+    packet_buffer* packets;
+    int num_packets;
+    int packets_size;
+    long started;              /* Monotonic ms when the first event was added */
+} hec_batch;
+
+int create_batch(hec_batch* batch);
+void free_batch(hec_batch* batch);
+void reset_batch(hec_batch* batch);
+char* batch_reserve(hec_batch* batch, int len);
+int batch_add_packet(hec_batch* batch, packet_buffer* packet, int events, int payload_len);
+int batch_add_records(hec_batch* batch, packet_buffer* packet, int num_records,
+                      record_format* format);
+int packet_records(packet_buffer* packet, record_format* format, int log_queue);
+char* batch_payload(hec_batch* batch);
+int batch_requeue(hec_batch* batch, packet_transport* transport);
+long monotonic_ms();
+long monotonic_us();
+#endif
@@ -0,0 +1,149 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+#include <sys/uio.h>
+#include "config.h"
+#include "batch.h"
+#include "compress.h"
+#include "format.h"
+#include "http.h"
+#include "session.h"
+#include "splunk.h"
+#include "spool.h"
+#include "transport.h"
+
+#define RESPONSE_BUFFER_SIZE  4096    /* Bytes read from a connection at a time */
+#define CONNECT_TIMEOUT       10000    /* ms to connect and handshake */
+#define BACKOFF_MIN           250      /* ms before retrying after a first failure */
+#define BACKOFF_MAX           30000    /* ms the backoff doubles up to */
+#define ACK_PATH              "/services/collector/ack"
+#define ACK_POLL_MAX          128      /* Most ackIds asked about in one poll */
+#define ACK_BODY_SIZE         (ACK_POLL_MAX * 21 + 16)
+#define HEC_CHANNEL_SIZE      37
+#define REQUEST_SEGMENTS      3        /* Header prefix, Content-Length and body */
+
+#define EJECT_FAILURES         3       /* Failures in a row before a server is ejected */
+#define LATENCY_WEIGHT         8       /* Each response time is 1/8 of the average */
+
+#define SERVER_HEALTHY         0
+#define SERVER_EJECTED         1       /* Circuit open: sent nothing until ejected_until */
+#define SERVER_PROBING         2       /* Half open: one request at a time */
+
+#define CONNECTION_CLOSED      0
+#define CONNECTION_CONNECTING  1       /* TCP connect or SSL handshake under way */
+#define CONNECTION_PROBING     2       /* Waiting on the response to an empty request */
+#define CONNECTION_READY       3
+
+/* A batch and the HTTP request it is sent in.  The request is a list of
+ * segments: the connection's cached header prefix, the request's own
+ * Content-Length line, patched with the length of each body, and the
+ * body, in the batch or in 'encoded' when the batch is compressed.  When
+ * the connection needs a single buffer per write, the header is copied
+ * into the reserve in front of the body instead, and there is one
+ * segment.  With acknowledgement enabled, a batch HEC has accepted is
+ * held with its ackId until HEC reports it indexed. */
+typedef struct hec_request {
+    hec_batch batch;
+    char* encoded;
+    int encoded_size;
+    struct iovec iov[REQUEST_SEGMENTS];
+    int iov_count;
+    char content_length[CONTENT_LENGTH_LINE];
+    int len;
+    int written;
+    long ack_id;
+    long expires;              /* Monotonic ms to give up waiting for the ack at */
+    long sent_at;              /* Monotonic us the last byte was written at */
+    struct hec_request* next;
+} hec_request;
+
+/* What a worker has seen of one HEC server: how quickly it answers, and
+ * whether it keeps failing.  Batches go to the server with the least
+ * outstanding work, its requests in flight weighted by its latency.  Each
+ * failure doubles how long the worker waits before trying the server
+ * again, and a success resets it. */
+typedef struct server_health {
+    hec* server;
+    int state;
+    int failures;              /* In a row */
+    int backoff;               /* ms, 0 after a success */
+    int outstanding;           /* Requests in flight over all connections */
+    long latency;              /* Moving average response time in us, 0 until measured */
+    long ejected_until;        /* Monotonic ms */
+} server_health;
+
+typedef struct request_list {
+    hec_request* head;
+    hec_request* tail;
+    int count;
+} request_list;
+
+/* A connection to one HEC server.  Requests are written in the order they
+ * were assigned to it, and HEC answers them in the same order, so the
+ * oldest request is the one each response belongs to.  ackIds are only
+ * meaningful on the channel and server that issued them, so each
+ * connection keeps its own channel, which outlives reconnects, and its own
+ * requests waiting on acknowledgement. */
+typedef struct hec_connection {
+    hec_session session;
+    hec* server;
+    server_health* health;
+    int state;
+    int interest;              /* epoll events currently registered */
+    int read_wants_write;
+    int write_wants_read;
+    request_list requests;     /* Written or being written, oldest first */
+    hec_request* unsent;       /* First request not yet completely written */
+    hec_request probe;         /* Empty request sent when connecting */
+    char probe_header[BATCH_HEADER_RESERVE];
+    char header_prefix[2][BATCH_HEADER_RESERVE];  /* Built once; uncompressed and gzip */
+    int prefix_len[2];
+    http_response response;    /* Response to the oldest request, as parsed so far */
+    char channel[HEC_CHANNEL_SIZE];
+    request_list unacked;      /* Accepted by HEC, oldest first */
+    hec_request ack_poll;      /* Request asking HEC which are indexed */
+    char ack_data[BATCH_HEADER_RESERVE + ACK_BODY_SIZE];
+    int ack_polling;
+    long ack_poll_at;          /* Monotonic ms to next poll for acks at */
+    long deadline;             /* Monotonic ms to give up connecting by */
+    long resume_at;            /* Monotonic ms to reconnect or resume at */
+    int paused;
+} hec_connection;
+
+/* The HEC side of a worker: an epoll driven set of non-blocking
+ * connections, each with a window of requests in flight.  Batches wait on
+ * 'pending' until a connection has room for them. */
+typedef struct hec_client {
+    int worker_num;
+    freeflow_config* config;
+    record_format* format;
+    packet_transport* transport;
+    packet_spool* spool;       /* NULL if undelivered packets aren't spooled */
+    payload_compressor* compressor;
+    int log_queue;
+    int epoll_fd;
+    hec_connection* connections;
+    int num_connections;
+    server_health* servers;
+    int num_servers;
+    hec_request* requests;
+    int num_requests;
+    request_list idle;
+    request_list pending;
+    unsigned int seed;         /* For jitter */
+    int ack_warned;
+    int ktls_warned;
+} hec_client;
+
+int create_client(hec_client* client, int worker_num, freeflow_config* config,
+                  record_format* format, packet_transport* transport, packet_spool* spool,
+                  payload_compressor* compressor, int log_queue);
+void free_client(hec_client* client);
+int client_start(hec_client* client);
+int client_has_room(hec_client* client);
+int client_available(hec_client* client);
+void client_submit(hec_client* client, hec_batch* batch);
+void client_poll(hec_client* client, int timeout);
+int client_timeout(hec_client* client);
+int client_outstanding(hec_client* client);
+void client_abandon(hec_client* client);
+#endif
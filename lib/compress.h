@@ -0,0 +1,23 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+#include <zlib.h>
+#include "batch.h"
+
+/* A worker's gzip stream, reused for every batch.  The output goes to a
+ * buffer supplied by the caller, which leaves the same header reserve in
+ * front of the compressed payload as a batch does, so the request is
+ * still sent with one write. */
+typedef struct payload_compressor {
+    z_stream stream;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long batches;
+    unsigned long cpu_usecs;
+} payload_compressor;
+
+int create_compressor(payload_compressor* compressor, int level);
+void free_compressor(payload_compressor* compressor);
+int compress_payload(payload_compressor* compressor, char* payload, int payload_len,
+                     char** buffer, int* buffer_size);
+void reset_compression_stats(payload_compressor* compressor);
+#endif
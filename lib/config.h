@@ -9,6 +9,12 @@
 #define CONFIG_FILE_SIZE   1024
 #define IPV4_ADDR_SIZE     16
 #define HOSTNAME_SIZE      512
+#define HEC_INDEX_SIZE     256
+#define HEC_PATH_SIZE      3328
+#define SPOOL_DIR_SIZE     1024
+
+#define HEC_MODE_EVENT     0
+#define HEC_MODE_RAW       1
 
 typedef struct hec {
     char addr[HOSTNAME_SIZE];
@@ -19,10 +25,39 @@ typedef struct hec {
 typedef struct freeflow_config {
     char bind_addr[IPV4_ADDR_SIZE];
     int bind_port;
+    int sflow_port;
     int threads;
+    int receivers;
+    int receiver_steering;
     int queue_size;
+    int queue_type;
+    int queue_hugepages;
+    int receive_batch_size;
+    int receive_batch_timeout;
+    int overload_policy;
+    int stats_interval;
+    int hec_batch_size;
+    int hec_batch_events;
+    int hec_batch_linger;
+    int hec_mode;
+    int hec_gzip_level;
+    int hec_connections;
+    int hec_pipeline;
+    int hec_ack;
+    int hec_ack_window;
+    int hec_ack_interval;
+    int hec_ack_timeout;
+    char hec_host[HOSTNAME_SIZE];
+    char hec_index[HEC_INDEX_SIZE];
+    char hec_path[HEC_PATH_SIZE];
     int ssl_enabled;
+    int ssl_ktls;
+    char spool_dir[SPOOL_DIR_SIZE];
+    int spool_max_size;
+    int spool_replay_rate;
     char sourcetype[SOURCETYPE_SIZE];
+    char sflow_counter_sourcetype[SOURCETYPE_SIZE];
+    char output_fields[CONFIG_VALUE_SIZE];
     hec* hec_server;
     int num_servers;
     int hec_port;
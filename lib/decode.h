@@ -0,0 +1,42 @@
+#ifndef DECODE_H
+#define DECODE_H
+#include <stdint.h>
+#include "freeflow.h"
+#include "netflow.h"
+
+/* Room for the records of a NetFlow v5 packet, rounded up to a whole
+ * number of 8 wide vectors */
+#define DECODE_COLUMN_SIZE  32
+
+/* The records of a NetFlow v5 packet decoded into host order, one array
+ * per field, so later stages can work on a field of every record at
+ * once.  Every field is widened to 32 bits, whatever its size in the
+ * record. */
+typedef struct netflow_columns {
+    int num_records;
+    uint32_t sys_uptime;
+    uint32_t unix_secs;
+    uint32_t unix_nsecs;
+    uint32_t srcaddr[DECODE_COLUMN_SIZE];
+    uint32_t dstaddr[DECODE_COLUMN_SIZE];
+    uint32_t nexthop[DECODE_COLUMN_SIZE];
+    uint32_t input[DECODE_COLUMN_SIZE];
+    uint32_t output[DECODE_COLUMN_SIZE];
+    uint32_t packets[DECODE_COLUMN_SIZE];
+    uint32_t bytes[DECODE_COLUMN_SIZE];
+    uint32_t first[DECODE_COLUMN_SIZE];
+    uint32_t last[DECODE_COLUMN_SIZE];
+    uint32_t srcport[DECODE_COLUMN_SIZE];
+    uint32_t dstport[DECODE_COLUMN_SIZE];
+    uint32_t tcp_flags[DECODE_COLUMN_SIZE];
+    uint32_t prot[DECODE_COLUMN_SIZE];
+    uint32_t tos[DECODE_COLUMN_SIZE];
+    uint32_t src_as[DECODE_COLUMN_SIZE];
+    uint32_t dst_as[DECODE_COLUMN_SIZE];
+    uint32_t src_mask[DECODE_COLUMN_SIZE];
+    uint32_t dst_mask[DECODE_COLUMN_SIZE];
+} netflow_columns;
+
+char* select_decoder();
+void decode_netflow_records(packet_buffer* packet, int num_records, netflow_columns* columns);
+#endif
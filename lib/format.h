@@ -0,0 +1,71 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+#include <stdint.h>
+#include "config.h"
+#include "freeflow.h"
+#include "template.h"
+
+/* The longest a time can be written: a negative number of seconds with
+ * six decimal places. */
+#define TIME_MAX_SIZE  21
+
+/* The fields of a flow event when output_fields isn't set, in the order
+ * of a NetFlow v5 record */
+#define DEFAULT_OUTPUT_FIELDS  "exporter,srcaddr,dstaddr,nexthop,input,output,packets,bytes," \
+                               "duration,srcport,dstport,tcp_flags,prot,tos,src_as,dst_as,"  \
+                               "src_mask,dst_mask"
+#define OUTPUT_MAX_FIELDS  32
+
+/* Emitters a flow event's fields are written with */
+#define OUTPUT_EXPORTER   0    /* Address of the exporter */
+#define OUTPUT_IPV4       1    /* Flow field as a dotted quad */
+#define OUTPUT_UINT       2    /* Flow field as a decimal number */
+#define OUTPUT_DURATION   3    /* End time less start time */
+#define OUTPUT_DIRECTION  4    /* Whether the flow is to or from the lower port */
+#define OUTPUT_IFNAME     5    /* Name of the interface in a flow field */
+
+/* The longest sFlow interface counter event, not counting its
+ * sourcetype: the exporter, three 64 bit and sixteen 32 bit counters,
+ * and the time. */
+#define COUNTER_MAX_SIZE  320
+
+/* One step of the program output_fields is compiled to: write a field
+ * with an emitter. */
+typedef struct output_op {
+    uint8_t code;              /* OUTPUT_* emitter */
+    uint8_t field;             /* FLOW_* field it writes, if it takes one */
+} output_op;
+
+/* Constant parts of every record, and the program the fields of a flow
+ * are written with, built once per worker so formatting a record only
+ * has to copy them and run the emitters it needs.  In event mode each record is a JSON
+ * event carrying its own sourcetype and time.  In raw mode it is a line
+ * of CSV with the time as the last field, and the sourcetype is given
+ * in the request path. */
+typedef struct record_format {
+    char head[16];                    /* Opens the record */
+    int head_len;
+    char tail[SOURCETYPE_SIZE + 64];  /* Separates the fields from the time */
+    int tail_len;
+    char close[4];                    /* Ends the record after the time */
+    int close_len;
+    char counter_tail[SOURCETYPE_SIZE + 64];  /* Same, for sFlow counter events */
+    int counter_tail_len;             /* 0 if counter samples aren't sent */
+    output_op ops[OUTPUT_MAX_FIELDS]; /* Writes the fields of a flow event */
+    int num_ops;
+    int record_max;                   /* Upper bound on the size of a record */
+} record_format;
+
+void init_record_format(record_format* format, freeflow_config* config);
+int compile_output_fields(record_format* format, char* fields);
+char* format_uint(char* cursor, uint64_t value);
+char* format_ipv4(char* cursor, uint32_t addr);
+char* format_time(char* cursor, int64_t micros);
+char* format_flow(char* cursor, record_format* format, char* sender, int sender_len,
+                  export_info* info, uint64_t* flow, int64_t time);
+char* format_template_sets(char* cursor, record_format* format, packet_buffer* packet,
+                           int header_len, uint32_t domain, int protocol, export_info* info,
+                           int num_records);
+char* format_netflow_records(char* cursor, record_format* format, packet_buffer* packet,
+                             int num_records);
+#endif
@@ -1,5 +1,11 @@
+#ifndef FREEFLOW_H
+#define FREEFLOW_H
+#include <stddef.h>
+#include <stdint.h>
+
 /* Note:  The default maxmsg size on CentOS 7 is 8192, which means the
- *        packet_buffer structure must be no larger than that.  If the 
+ *        packet_buffer structure must be no larger than that when the SysV
+ *        packet queue (queue_type = sysv) is used.  If the 
  *        PACKET_BUFFER_SIZE needed to be increased higher to support something
  *        like jumbo frames, the kernel setting (/proc/sys/kernel/msgmax) would
  *        need to be increased also.  1500 bytes is sufficient for a standard 
@@ -12,7 +18,14 @@
 
 typedef struct packet_buffer {
     long mtype;
-    char packet[PACKET_BUFFER_SIZE];
     int packet_len;
+    int64_t receive_time;      /* us since the epoch */
     char sender[IPV4_ADDR_SIZE];
+    char packet[PACKET_BUFFER_SIZE];
 } packet_buffer;
+
+/* Only the metadata and the bytes actually received are passed between
+ * processes, not the whole packet area. */
+#define PACKET_MESSAGE_SIZE(p) (offsetof(packet_buffer, packet) - sizeof(long) + (p)->packet_len)
+#define PACKET_MESSAGE_MAX     (sizeof(packet_buffer) - sizeof(long))
+#endif
@@ -0,0 +1,39 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#define HTTP_LINE_SIZE  1024    /* Longest status, header or chunk size line */
+#define HTTP_BODY_SIZE  4096    /* Body bytes kept; the rest are counted and dropped */
+
+#define HTTP_STATUS_LINE   0
+#define HTTP_HEADERS       1
+#define HTTP_BODY          2    /* Content-Length bytes of body */
+#define HTTP_BODY_TO_CLOSE 3    /* No length given; the body ends when the connection closes */
+#define HTTP_CHUNK_SIZE    4
+#define HTTP_CHUNK_DATA    5
+#define HTTP_CHUNK_END     6    /* The CRLF after a chunk's data */
+#define HTTP_TRAILERS      7
+#define HTTP_DONE          8
+
+/* The state of one HTTP/1.1 response being parsed.  Bytes are fed in as
+ * they are read from the connection, in pieces of any size, so a response
+ * can be split across reads and several can arrive in one.  A line split
+ * across reads is held in 'line' until its end arrives. */
+typedef struct http_response {
+    int state;
+    char line[HTTP_LINE_SIZE];
+    int line_len;
+    int code;
+    int chunked;
+    int keep_alive;
+    long content_length;       /* -1 if not given */
+    long retry_after;          /* Seconds, -1 if not given */
+    long remaining;            /* Bytes left in the body or current chunk */
+    char body[HTTP_BODY_SIZE + 1];
+    int body_len;              /* Bytes of body kept, null terminated */
+    long body_total;           /* Bytes of body received */
+} http_response;
+
+void http_reset(http_response* response);
+int http_parse(http_response* response, char* data, int len);
+int http_finish(http_response* response);
+#endif
@@ -0,0 +1,9 @@
+#ifndef IPFIX_H
+#define IPFIX_H
+#include "freeflow.h"
+#include "format.h"
+
+int ipfix_prepare(packet_buffer* packet, int log_queue);
+char* format_ipfix_records(char* cursor, record_format* format, packet_buffer* packet,
+                           int num_records);
+#endif
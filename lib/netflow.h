@@ -1,3 +1,9 @@
+#ifndef NETFLOW_H
+#define NETFLOW_H
+#include <stdint.h>
+
+#define NETFLOW_V5_MAX_RECORDS 30
+
 typedef struct netflow_header {
     uint16_t version;
     uint16_t count;
@@ -32,3 +38,62 @@ typedef struct netflow_record {
     uint8_t  dst_mask;
     uint16_t pad2;
 } netflow_record;
+
+#define NETFLOW9_VERSION         9
+#define NETFLOW9_TEMPLATE_SET    0
+#define NETFLOW9_OPTIONS_SET     1
+#define NETFLOW9_MIN_DATA_SET    256
+
+typedef struct netflow9_header {
+    uint16_t version;
+    uint16_t count;
+    uint32_t sys_uptime;
+    uint32_t unix_secs;
+    uint32_t package_sequence;
+    uint32_t source_id;
+} netflow9_header;
+
+#define IPFIX_VERSION            10
+#define IPFIX_TEMPLATE_SET       2
+#define IPFIX_OPTIONS_SET        3
+#define IPFIX_MIN_DATA_SET       256
+#define IPFIX_ENTERPRISE_BIT     0x8000
+
+typedef struct ipfix_header {
+    uint16_t version;
+    uint16_t length;
+    uint32_t export_time;
+    uint32_t sequence;
+    uint32_t domain;
+} ipfix_header;
+
+/* An sFlow v5 datagram starts with a 32 bit version, so the two bytes
+ * where NetFlow has its version are zero.  The rest of the datagram is
+ * XDR: big endian, in 32 bit units.  Sample and record formats are those
+ * of enterprise 0, which are the same as their data format. */
+#define SFLOW_PREFIX                   0
+#define SFLOW_VERSION                  5
+#define SFLOW_ADDRESS_IPV4             1
+#define SFLOW_ADDRESS_IPV6             2
+
+#define SFLOW_FLOW_SAMPLE              1
+#define SFLOW_COUNTER_SAMPLE           2
+#define SFLOW_EXPANDED_FLOW_SAMPLE     3
+#define SFLOW_EXPANDED_COUNTER_SAMPLE  4
+
+#define SFLOW_RAW_HEADER               1
+#define SFLOW_IPV4_DATA                3
+#define SFLOW_EXTENDED_ROUTER          1002
+#define SFLOW_EXTENDED_GATEWAY         1003
+#define SFLOW_GENERIC_INTERFACE        1
+
+#define SFLOW_HEADER_ETHERNET          1
+#define SFLOW_HEADER_IPV4              11
+
+/* Every FlowSet, or IPFIX Set, whether of templates or data records,
+ * starts with its ID and its length including this header. */
+typedef struct flowset_header {
+    uint16_t id;
+    uint16_t length;
+} flowset_header;
+#endif
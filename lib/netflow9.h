@@ -0,0 +1,9 @@
+#ifndef NETFLOW9_H
+#define NETFLOW9_H
+#include "freeflow.h"
+#include "format.h"
+
+int netflow9_prepare(packet_buffer* packet, int log_queue);
+char* format_netflow9_records(char* cursor, record_format* format, packet_buffer* packet,
+                              int num_records);
+#endif
@@ -0,0 +1,73 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+#include <stdint.h>
+#include "config.h"
+#include "freeflow.h"
+#include "netflow.h"
+#include "transport.h"
+
+#define OVERLOAD_BLOCK         0    /* Wait for room, as the receiver always did */
+#define OVERLOAD_DROP_NEWEST   1
+#define OVERLOAD_DROP_OLDEST   2
+#define OVERLOAD_SAMPLE        3
+#define OVERLOAD_SUMMARIZE     4
+
+#define OVERLOAD_EXPORTERS     1024    /* Exporters counted apart; the rest share one entry */
+#define OVERLOAD_EVICT_TRIES   4       /* Oldest packets dropped to make room for one */
+#define OVERLOAD_MAX_INTERVAL  1024    /* Most a sampling interval grows to */
+#define OVERLOAD_RELAX_MS      1000    /* ms between halving sampling intervals */
+#define OVERLOAD_FLOWS         4096    /* Summary flows held, a power of two */
+#define OVERLOAD_FLUSH_MS      1000    /* ms between sending summaries */
+#define OVERLOAD_REPORT_MAX    16      /* Exporters listed in each report */
+
+/* What a receiver has had to shed of one exporter's packets.  Under the
+ * sample policy, only one in 'interval' of the exporter's packets is
+ * passed on.  The interval doubles each time one of its packets finds the
+ * transport full, and halves each second none does, so the exporters
+ * sending the most are sampled the hardest. */
+typedef struct exporter_load {
+    uint32_t addr;             /* Network order, 0 for an empty entry */
+    unsigned long shed;        /* Packets dropped since the last report */
+    unsigned long summarized;  /* Packets folded into summaries since the last report */
+    int interval;
+    int skipped;
+    int full;                  /* Found the transport full since the last relax */
+    netflow_header header;     /* Of the last packet summarized, for the summaries */
+} exporter_load;
+
+/* Records folded together under the summarize policy: every flow between
+ * the same two addresses over the same protocol, from the same exporter,
+ * becomes one record with the packets and bytes added up. */
+typedef struct summary_flow {
+    exporter_load* exporter;   /* NULL for an empty entry */
+    uint32_t srcaddr;
+    uint32_t dstaddr;
+    uint8_t prot;
+    uint8_t tcp_flags;
+    uint32_t packets;          /* Host order from here on */
+    uint32_t bytes;
+    uint32_t first;
+    uint32_t last;
+} summary_flow;
+
+/* A receiver's view of the transport when workers fall behind: what to
+ * do with a packet that finds the transport full, and how much has been
+ * shed from each exporter. */
+typedef struct overload_shedder {
+    int policy;
+    packet_transport* transport;
+    exporter_load exporters[OVERLOAD_EXPORTERS];
+    exporter_load others;
+    summary_flow* flows;
+    int num_flows;
+    long relax_at;             /* Monotonic ms */
+    long flush_at;             /* Monotonic ms */
+} overload_shedder;
+
+int create_shedder(overload_shedder* shedder, freeflow_config* config,
+                   packet_transport* transport);
+void free_shedder(overload_shedder* shedder);
+void shed_send(overload_shedder* shedder, packet_buffer* packet, uint32_t addr);
+void shed_tick(overload_shedder* shedder);
+void report_shed_stats(overload_shedder* shedder, int receiver_num, int log_queue);
+#endif
@@ -0,0 +1,19 @@
+#ifndef RECEIVER_H
+#define RECEIVER_H
+#include <time.h>
+#include "config.h"
+#include "transport.h"
+
+#define FILL_BUCKETS 4
+
+typedef struct receive_stats {
+    unsigned long batches;
+    unsigned long packets;
+    unsigned long full_batches;
+    unsigned long fill[FILL_BUCKETS];
+    time_t last_report;
+} receive_stats;
+
+int packet_receiver(int receiver_num, int socket_id, freeflow_config *config,
+                    packet_transport* transport, int log_queue);
+#endif
@@ -0,0 +1,28 @@
+#include <stdint.h>
+
+#define RING_CACHE_LINE  64
+#define RING_MIN_SIZE    65536
+#define RING_HUGE_PAGE   (2 * 1024 * 1024)
+
+/* Each index lives on its own cache line so producers and consumers
+ * don't invalidate each other's lines on every operation.  The indexes
+ * are free-running byte counters; the offset into the data area is the
+ * index masked by the (power of two) ring size. */
+typedef struct ring_buffer {
+    uint64_t prod_head __attribute__((aligned(RING_CACHE_LINE)));
+    uint64_t prod_tail __attribute__((aligned(RING_CACHE_LINE)));
+    uint64_t cons_head __attribute__((aligned(RING_CACHE_LINE)));
+    uint64_t cons_tail __attribute__((aligned(RING_CACHE_LINE)));
+    uint64_t count     __attribute__((aligned(RING_CACHE_LINE)));
+    uint64_t size      __attribute__((aligned(RING_CACHE_LINE)));
+    uint64_t mask;
+    uint64_t mapped_size;
+    int hugepages;
+    char data[] __attribute__((aligned(RING_CACHE_LINE)));
+} ring_buffer;
+
+ring_buffer* create_ring(uint64_t size, int hugepages, char* error);
+void delete_ring(ring_buffer* ring);
+int ring_enqueue(ring_buffer* ring, void* message, int message_len);
+int ring_dequeue(ring_buffer* ring, void* message, int message_len);
+int ring_length(ring_buffer* ring);
@@ -1,19 +1,37 @@
+#ifndef SESSION_H
+#define SESSION_H
+#include <sys/uio.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include "config.h"
 
+/* Returned by session_connect, session_read and session_write when the
+ * operation can't make progress until the socket is readable or writable
+ * again. */
+#define SESSION_WANT_READ   -2
+#define SESSION_WANT_WRITE  -3
+
 typedef struct hec_session {
     int  is_ssl;
+    int  connected;
+    int  ktls_send;      /* The kernel encrypts what is written to the socket */
     int  socket_id;
     SSL* ssl_session;
     hec* hec;
 } hec_session;
 
-int bind_socket(freeflow_config *config, int log_queue);
+int create_ssl_context(freeflow_config* config, char* error);
+void free_ssl_context();
+
+int bind_socket(int receiver_num, int port, freeflow_config *config, int log_queue);
 
-int initialize_session(hec_session* session, int worker_num, freeflow_config* config, int log_queue);
-int reestablish_session(hec_session* session, int worker_num, freeflow_config *config, int log_queue);
+int open_session(hec_session* session, hec* server, int worker_num, freeflow_config* config,
+                 int log_queue);
+int session_connect(hec_session* session, char* error);
+int session_resumed(hec_session* session);
+void close_session(hec_session* session);
 
 int session_write(hec_session* session, char* message, int message_len);
+int session_writev(hec_session* session, struct iovec* iov, int iov_count);
 int session_read(hec_session* session, char* message, int message_len);
-int session_status(hec_session* session, char* error_message);
+#endif
@@ -0,0 +1,13 @@
+#ifndef SFLOW_H
+#define SFLOW_H
+#include "freeflow.h"
+#include "format.h"
+
+/* Generic interface counters written for each counter sample, in the
+ * order they are in the record */
+#define SFLOW_COUNTERS  19
+
+int sflow_prepare(packet_buffer* packet, record_format* format);
+char* format_sflow_records(char* cursor, record_format* format, packet_buffer* packet,
+                           int num_records);
+#endif
@@ -1,4 +1,19 @@
-int splunk_worker(int worker_num, freeflow_config *config, int log_queue);
-int test_connectivity(hec_session* session, int worker_num, freeflow_config *config, int log_queue);
-int hec_header(hec* server, int content_length, char* header);
-int response_code(char* response);
+#ifndef SPLUNK_H
+#define SPLUNK_H
+#include "config.h"
+
+/* Every request's Content-Length line is the same size: the length is
+ * right-aligned in a fixed-width slot, padded with spaces, so it can be
+ * patched in place. */
+#define CONTENT_LENGTH_FIELD  "Content-Length: "
+#define CONTENT_LENGTH_WIDTH  10
+#define CONTENT_LENGTH_LINE   (sizeof(CONTENT_LENGTH_FIELD) - 1 + CONTENT_LENGTH_WIDTH + 4)
+
+int hec_header_prefix(hec* server, char* path, int compressed, char* channel, char* prefix);
+int hec_length_line(char* line, int content_length);
+void hec_patch_length(char* line, int content_length);
+int hec_header(hec* server, char* path, int compressed, int content_length, char* channel,
+               char* header);
+int hec_ack_id(char* body, long* ack_id);
+int hec_ack_status(char* body, long ack_id);
+#endif
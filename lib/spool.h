@@ -0,0 +1,52 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+#include "config.h"
+#include "freeflow.h"
+#include "batch.h"
+
+#define SPOOL_SEGMENT_SIZE    (8 * 1024 * 1024)   /* Bytes before a new segment is started */
+#define SPOOL_WRITE_BUFFER    65536               /* Bytes written to a segment at a time */
+#define SPOOL_INITIAL_SEGMENTS 16
+
+/* One file of the spool.  Packets are only ever appended to the newest
+ * segment, and only ever read from the oldest. */
+typedef struct spool_segment {
+    unsigned long seq;
+    long size;                 /* Bytes, including any not yet written */
+    int packets;
+} spool_segment;
+
+/* A worker's spool of packets it couldn't deliver, kept on disk in
+ * numbered segment files until HEC can take them.  Packets are appended
+ * in the order they were spooled and replayed in the same order, at no
+ * more than 'replay_rate' a second.  When the spool reaches its size
+ * limit, the oldest segment is dropped to make room. */
+typedef struct packet_spool {
+    char dir[SPOOL_DIR_SIZE];
+    int worker_num;
+    int log_queue;
+    long max_size;             /* Bytes */
+    long size;                 /* Bytes in every segment */
+    long packets;              /* Packets not yet replayed */
+    spool_segment* segments;   /* Oldest first */
+    int num_segments;
+    int segments_size;
+    unsigned long next_seq;
+    int write_fd;              /* Newest segment, or -1 once it is finished */
+    char write_buffer[SPOOL_WRITE_BUFFER];
+    int write_len;
+    char* map;                 /* Oldest segment, mapped for replay */
+    long map_len;
+    long read_offset;
+    int replay_rate;           /* Packets a second, 0 for no limit */
+    long credit;               /* Packets that may be replayed now */
+    long refilled_at;          /* Monotonic ms */
+} packet_spool;
+
+int create_spool(packet_spool* spool, int worker_num, freeflow_config* config, int log_queue);
+void free_spool(packet_spool* spool);
+int spool_write(packet_spool* spool, packet_buffer* packet);
+int spool_batch(packet_spool* spool, hec_batch* batch);
+int spool_read(packet_spool* spool, packet_buffer* packet);
+int spool_timeout(packet_spool* spool);
+#endif
@@ -0,0 +1,165 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+#include <stdint.h>
+#include "freeflow.h"
+
+#define TEMPLATE_SLOTS       1024    /* Templates held for all exporters, a power of two */
+#define TEMPLATE_PROBES      16      /* Slots searched for a key before one is replaced */
+#define TEMPLATE_MAX_FIELDS  64
+#define TEMPLATE_EXPORTERS   1024    /* Exporters whose options are kept, a power of two */
+#define TEMPLATE_INTERFACES  4096    /* Interface names kept, a power of two */
+#define TEMPLATE_HELD        64      /* Data sets a worker holds while waiting for their templates */
+#define INTERFACE_NAME_SIZE  64
+
+/* The flow fields a template is decoded into, in the order they appear
+ * in the CSV.  Addresses are decoded in host order.  Times are in ms,
+ * either of the exporter's uptime, as in NetFlow v5, or since the epoch,
+ * as the template's time_unit says. */
+#define FLOW_SRCADDR    0
+#define FLOW_DSTADDR    1
+#define FLOW_NEXTHOP    2
+#define FLOW_INPUT      3
+#define FLOW_OUTPUT     4
+#define FLOW_PACKETS    5
+#define FLOW_BYTES      6
+#define FLOW_FIRST      7
+#define FLOW_LAST       8
+#define FLOW_SRCPORT    9
+#define FLOW_DSTPORT    10
+#define FLOW_TCP_FLAGS  11
+#define FLOW_PROT       12
+#define FLOW_TOS        13
+#define FLOW_SRC_AS     14
+#define FLOW_DST_AS     15
+#define FLOW_SRC_MASK   16
+#define FLOW_DST_MASK   17
+
+/* Fields that aren't written out, but say how to read the others, or
+ * come in options records.  A string is decoded as its offset in the
+ * record in the upper bits and its length in the lower 16. */
+#define FLOW_SAMPLING      18    /* Packets per packet sampled */
+#define FLOW_SAMPLE_SPACE  19    /* Packets skipped after each FLOW_SAMPLING sampled */
+#define FLOW_IFINDEX       20
+#define FLOW_IFNAME        21    /* String */
+#define FLOW_SYSTEM_INIT   22    /* ms since the epoch the exporter's uptime starts at */
+#define FLOW_FIELDS        23
+#define FLOW_NONE          255   /* Variable length field that is only skipped */
+
+#define TEMPLATE_TIME_NONE     0    /* No start time, so the export time is used */
+#define TEMPLATE_TIME_UPTIME   1    /* ms of the exporter's uptime */
+#define TEMPLATE_TIME_MILLIS   2    /* ms since the epoch */
+#define TEMPLATE_TIME_SECONDS  3    /* Seconds since the epoch, decoded as ms */
+
+#define TEMPLATE_OP_NUMBER     0
+#define TEMPLATE_OP_STRING     1
+#define TEMPLATE_OP_VARIABLE   2    /* Length given in the record, a string or skipped */
+
+#define TEMPLATE_VARIABLE_LENGTH  65535   /* IPFIX field length for a variable length field */
+
+typedef struct template_field {
+    uint16_t type;
+    uint16_t length;
+    uint32_t enterprise;       /* IPFIX enterprise number, 0 for a standard element */
+} template_field;
+
+/* A template as an exporter sent it.  Slots live in memory shared by
+ * every worker, so a template learned by one is known to all.  The
+ * version is odd while a slot is being written, and readers retry until
+ * they copy a slot without its version changing. */
+typedef struct template_slot {
+    uint32_t version;
+    uint32_t exporter;         /* Network order, 0 for an empty slot */
+    uint32_t domain;           /* NetFlow v9 source ID or IPFIX observation domain */
+    uint16_t id;
+    uint16_t protocol;         /* NetFlow version the template came in */
+    uint16_t scope_fields;     /* Of an options template, 0 for a data template */
+    uint16_t num_fields;
+    template_field fields[TEMPLATE_MAX_FIELDS];
+} template_slot;
+
+/* What an exporter has said in its options records, about all of its
+ * flows. */
+typedef struct exporter_options {
+    uint32_t version;
+    uint32_t exporter;         /* Network order, 0 for an empty entry */
+    uint32_t domain;
+    uint16_t protocol;
+    uint32_t sampling;         /* Packets per packet sampled, 0 if not known */
+    uint64_t system_init;      /* ms since the epoch, 0 if not known */
+} exporter_options;
+
+typedef struct interface_name {
+    uint32_t version;
+    uint32_t exporter;         /* Network order, 0 for an empty entry */
+    uint32_t domain;
+    uint16_t protocol;
+    uint32_t ifindex;
+    char name[INTERFACE_NAME_SIZE];
+} interface_name;
+
+typedef struct template_cache {
+    uint32_t lock;             /* Held while anything is being written */
+    uint32_t generation;       /* Bumped whenever a template is added or changed */
+    template_slot slots[TEMPLATE_SLOTS];
+    exporter_options exporters[TEMPLATE_EXPORTERS];
+    interface_name interfaces[TEMPLATE_INTERFACES];
+} template_cache;
+
+/* One step of a compiled template: copy the 'width' bytes at 'offset' to
+ * a flow field.  Offsets are from the end of the last variable length
+ * field, or the start of the record if there is none before the op. */
+typedef struct template_op {
+    uint16_t offset;
+    uint16_t width;
+    uint8_t field;
+    uint8_t kind;
+} template_op;
+
+/* A template compiled for decoding, kept by each worker for each slot
+ * and recompiled when the slot's version changes.  Fixed length fields
+ * with no flow field to go to have no op, so decoding a record only does
+ * the copies it needs. */
+typedef struct template_program {
+    uint32_t version;          /* Of the slot compiled, 0 if none */
+    uint16_t record_len;       /* Shortest a record can be */
+    uint16_t tail_len;         /* Bytes after the last variable length field */
+    uint16_t num_ops;
+    int variable;              /* Whether records have variable length fields */
+    int options;               /* Compiled from an options template */
+    int time_unit;             /* TEMPLATE_TIME_* of the start and end times */
+    template_op ops[TEMPLATE_MAX_FIELDS];
+} template_program;
+
+/* What the fields of the data records in a packet are relative to */
+typedef struct export_info {
+    int64_t export_time;       /* us since the epoch */
+    int64_t boot_time;         /* us since the epoch the uptime starts at, -1 if not known */
+    uint32_t sampling;         /* Packets per packet sampled, 1 if not sampled */
+    uint32_t exporter;         /* Network order, for looking up interface names */
+    uint32_t domain;
+    int protocol;
+} export_info;
+
+int create_template_cache(char* error);
+void free_template_cache();
+int template_store(uint32_t exporter, uint32_t domain, uint16_t id, int protocol,
+                   template_field* fields, int num_fields, int scope_fields);
+template_program* template_lookup(uint32_t exporter, uint32_t domain, uint16_t id,
+                                  int protocol);
+uint32_t template_generation();
+int template_record_length(template_program* program, unsigned char* record,
+                           unsigned char* end);
+int template_count_records(template_program* program, unsigned char* records,
+                           unsigned char* end);
+void template_decode(template_program* program, unsigned char* record, uint64_t* flow);
+void template_apply_options(template_program* program, unsigned char* records,
+                            unsigned char* end, uint32_t exporter, uint32_t domain,
+                            int protocol);
+void template_export_info(uint32_t exporter, uint32_t domain, int protocol, export_info* info);
+int template_interface_name(uint32_t exporter, uint32_t domain, int protocol, uint32_t ifindex,
+                            char* name);
+int template_prepare_set(packet_buffer* packet, int header_len, int offset,
+                         uint32_t exporter, uint32_t domain, int protocol);
+int template_take_held(packet_buffer* packet);
+void report_template_stats(int worker_num, int log_queue);
+#endif
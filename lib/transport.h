@@ -0,0 +1,45 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+#include "config.h"
+#include "freeflow.h"
+#include "ring.h"
+
+#define TRANSPORT_RING  0
+#define TRANSPORT_SYSV  1
+
+/* Most descriptors a caller can wait on alongside the transport */
+#define TRANSPORT_WAIT_FDS  4
+
+typedef struct packet_transport packet_transport;
+
+/* Operations every packet transport implements.  'try_send' and 'receive'
+ * never block; they return -1 when the transport is full or empty. */
+typedef struct transport_ops {
+    char* name;
+    int  (*send)(packet_transport* transport, packet_buffer* packet);
+    int  (*try_send)(packet_transport* transport, packet_buffer* packet);
+    int  (*receive)(packet_transport* transport, packet_buffer* packet);
+    int  (*length)(packet_transport* transport);
+    void (*destroy)(packet_transport* transport);
+} transport_ops;
+
+/* Processes waiting for packets sleep on 'wakeup_fd', an eventfd shared by
+ * every process forked after the transport is created.  Senders only
+ * signal it while 'waiters', a counter in shared memory, is non-zero, so
+ * the busy path costs no extra system calls. */
+struct packet_transport {
+    const transport_ops* ops;
+    int queue_id;
+    ring_buffer* ring;
+    int wakeup_fd;
+    int* waiters;
+};
+
+int create_transport(packet_transport* transport, freeflow_config* config, char* error);
+void delete_transport(packet_transport* transport);
+int transport_send(packet_transport* transport, packet_buffer* packet);
+int transport_try_send(packet_transport* transport, packet_buffer* packet);
+int transport_receive(packet_transport* transport, packet_buffer* packet);
+int transport_length(packet_transport* transport);
+int transport_wait(packet_transport* transport, int* wake_fds, int num_fds, int timeout);
+#endif
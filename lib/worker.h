@@ -1,3 +1,8 @@
+#ifndef WORKER_H
+#define WORKER_H
 #include "config.h"
+#include "transport.h"
 
-int splunk_worker(int worker_num, freeflow_config *config, int log_queue);
+int splunk_worker(int worker_num, freeflow_config *config, packet_transport* transport,
+                  int log_queue);
+#endif
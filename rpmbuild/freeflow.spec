@@ -6,7 +6,8 @@ Summary:        Freeflow netflow collection for Splunk
 License:        GPLv3+
 URL:            https://github.com/Christopher-Costa/C-Freeflow
 Source0:        freeflow-1.0.tar.gz
-BuildRequires:  openssl-devel
+BuildRequires:  openssl-devel >= 1.1.0
+BuildRequires:  zlib-devel
 
 Requires(post): info
 Requires(preun): info
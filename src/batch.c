@@ -0,0 +1,288 @@
+#include <stdlib.h>      /* Provides: malloc, realloc, free */
+#include <string.h>      /* Provides: memcpy */
+#include <time.h>        /* Provides: clock_gettime */
+#include <arpa/inet.h>   /* Provides: ntohs */
+#include "batch.h"
+#include "netflow.h"
+#include "netflow9.h"
+#include "ipfix.h"
+#include "sflow.h"
+
+/*
+ * Function: monotonic_ms
+ *
+ * Return the current time of the monotonic clock in milliseconds.
+ *
+ * Inputs:   None
+ *
+ * Returns:  <monotonic time in ms>
+ */
+long monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Function: monotonic_us
+ *
+ * Return the current time of the monotonic clock in microseconds.
+ *
+ * Inputs:   None
+ *
+ * Returns:  <monotonic time in us>
+ */
+long monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Function: create_batch
+ *
+ * Allocate the buffers of an empty batch.  They grow as needed when
+ * events are added.
+ *
+ * Inputs:   hec_batch*  batch   Batch object to initialize
+ *
+ * Returns:  0    Success
+ *           -1   Couldn't allocate the buffers
+ */
+int create_batch(hec_batch* batch) {
+    batch->buffer_size = BATCH_HEADER_RESERVE + BATCH_INITIAL_SIZE;
+    batch->buffer = malloc(batch->buffer_size);
+    batch->packets_size = BATCH_INITIAL_PACKETS;
+    batch->packets = malloc(sizeof(packet_buffer) * batch->packets_size);
+    reset_batch(batch);
+
+    if (!batch->buffer || !batch->packets) {
+        free_batch(batch);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function: free_batch
+ *
+ * Release the buffers held by a batch.
+ *
+ * Inputs:   hec_batch*  batch   Batch to free
+ *
+ * Returns:  None
+ */
+void free_batch(hec_batch* batch) {
+    free(batch->buffer);
+    free(batch->packets);
+    batch->buffer = NULL;
+    batch->packets = NULL;
+}
+
+/*
+ * Function: reset_batch
+ *
+ * Empty a batch, keeping its buffers for the next one.
+ *
+ * Inputs:   hec_batch*  batch   Batch to empty
+ *
+ * Returns:  None
+ */
+void reset_batch(hec_batch* batch) {
+    batch->payload_len = 0;
+    batch->events = 0;
+    batch->num_packets = 0;
+    batch->started = 0;
+}
+
+/*
+ * Function: batch_reserve
+ *
+ * Make sure there is room for at least 'len' more bytes of events at the
+ * end of the batch, growing the buffer if needed.  The space isn't part of
+ * the batch until it is committed with batch_add_packet.
+ *
+ * Inputs:   hec_batch*  batch   Batch to add to
+ *           int         len     Number of bytes needed
+ *
+ * Returns:  <position to write the events to>   Success
+ *           NULL                                Couldn't grow the buffer
+ */
+char* batch_reserve(hec_batch* batch, int len) {
+    int needed = BATCH_HEADER_RESERVE + batch->payload_len + len;
+
+    if (needed > batch->buffer_size) {
+        int size = batch->buffer_size;
+        while (size < needed) {
+            size *= 2;
+        }
+
+        char* buffer = realloc(batch->buffer, size);
+        if (!buffer) {
+            return NULL;
+        }
+        batch->buffer = buffer;
+        batch->buffer_size = size;
+    }
+    return batch->buffer + BATCH_HEADER_RESERVE + batch->payload_len;
+}
+
+/*
+ * Function: batch_add_packet
+ *
+ * Commit the events a packet was formatted into, in space obtained from
+ * batch_reserve, and keep a copy of the packet in case the batch has to
+ * be requeued.
+ *
+ * Inputs:   hec_batch*      batch         Batch to add to
+ *           packet_buffer*  packet        Packet the events came from
+ *           int             events        Number of events formatted
+ *           int             payload_len   Number of bytes formatted
+ *
+ * Returns:  0    Success
+ *           -1   Couldn't grow the packet list
+ */
+int batch_add_packet(hec_batch* batch, packet_buffer* packet, int events, int payload_len) {
+    if (batch->num_packets == batch->packets_size) {
+        packet_buffer* packets = realloc(batch->packets,
+                                         sizeof(packet_buffer) * batch->packets_size * 2);
+        if (!packets) {
+            return -1;
+        }
+        batch->packets = packets;
+        batch->packets_size *= 2;
+    }
+
+    /* Packets being re-added after a partial requeue are already in place */
+    if (packet != &batch->packets[batch->num_packets]) {
+        memcpy(&batch->packets[batch->num_packets], packet,
+               offsetof(packet_buffer, packet) + packet->packet_len);
+    }
+    batch->num_packets++;
+
+    if (batch->events == 0) {
+        batch->started = monotonic_ms();
+    }
+    batch->payload_len += payload_len;
+    batch->events += events;
+    return 0;
+}
+
+/*
+ * Function: batch_add_records
+ *
+ * Format the records of a validated packet into HEC events, and add them
+ * to the batch.
+ *
+ * Inputs:   hec_batch*      batch         Batch to add the events to
+ *           packet_buffer*  packet        Packet containing netflow record(s)
+ *           int             num_records   Number of records in the packet
+ *           record_format*  format        Constant record fragments
+ *
+ * Returns:  0    Success
+ *           -1   Couldn't grow the batch
+ */
+int batch_add_records(hec_batch* batch, packet_buffer* packet, int num_records,
+                      record_format* format) {
+    char* events = batch_reserve(batch, format->record_max * num_records);
+    if (!events) {
+        return -1;
+    }
+
+    netflow_header* h = (netflow_header*)packet->packet;
+    char* end;
+    switch (ntohs(h->version)) {
+        case NETFLOW9_VERSION:
+            end = format_netflow9_records(events, format, packet, num_records);
+            break;
+        case IPFIX_VERSION:
+            end = format_ipfix_records(events, format, packet, num_records);
+            break;
+        case SFLOW_PREFIX:
+            end = format_sflow_records(events, format, packet, num_records);
+            break;
+        default:
+            end = format_netflow_records(events, format, packet, num_records);
+    }
+    return batch_add_packet(batch, packet, num_records, end - events);
+}
+
+/*
+ * Function: packet_records
+ *
+ * Count the records of a packet that has already been validated, to
+ * parse it back into a batch.
+ *
+ * Inputs:   packet_buffer*  packet      Packet containing netflow record(s)
+ *           record_format*  format      Constant record fragments
+ *           int             log_queue   Id of IPC queue for logging
+ *
+ * Returns:  <# of records in the packet>
+ */
+int packet_records(packet_buffer* packet, record_format* format, int log_queue) {
+    netflow_header* h = (netflow_header*)packet->packet;
+
+    int num_records;
+
+    switch (ntohs(h->version)) {
+        case NETFLOW9_VERSION:
+            num_records = netflow9_prepare(packet, log_queue);
+            break;
+        case IPFIX_VERSION:
+            num_records = ipfix_prepare(packet, log_queue);
+            break;
+        case SFLOW_PREFIX:
+            num_records = sflow_prepare(packet, format);
+            break;
+        default:
+            num_records = ntohs(h->count);
+    }
+    return num_records < 0 ? 0 : num_records;
+}
+
+/*
+ * Function: batch_payload
+ *
+ * Return the start of the events in a batch.  The header reserve lies
+ * immediately in front of it.
+ *
+ * Inputs:   hec_batch*  batch   Batch to look at
+ *
+ * Returns:  <start of the events>
+ */
+char* batch_payload(hec_batch* batch) {
+    return batch->buffer + BATCH_HEADER_RESERVE;
+}
+
+/*
+ * Function: batch_requeue
+ *
+ * Hand the packets in a batch back to the transport, so they can be
+ * delivered later, possibly by another worker.  The caller is itself a
+ * consumer of the transport, so it never waits for room: packets that
+ * don't fit are moved to the front of the packet list and left there.
+ * The events are discarded either way, so the caller must parse any
+ * packets left behind back into the batch.
+ *
+ * Inputs:   hec_batch*         batch       Batch to requeue
+ *           packet_transport*  transport   Transport to requeue the packets on
+ *
+ * Returns:  <# of packets left in the batch>
+ */
+int batch_requeue(hec_batch* batch, packet_transport* transport) {
+    int kept = 0;
+    int i;
+
+    for (i = 0; i < batch->num_packets; i++) {
+        packet_buffer* packet = &batch->packets[i];
+        if (transport_try_send(transport, packet) < 0) {
+            if (kept != i) {
+                memcpy(&batch->packets[kept], packet,
+                       offsetof(packet_buffer, packet) + packet->packet_len);
+            }
+            kept++;
+        }
+    }
+    reset_batch(batch);
+    return kept;
+}
@@ -0,0 +1,1475 @@
+#include <stdio.h>       /* Provides: sprintf */
+#include <stdlib.h>      /* Provides: calloc, free, rand_r */
+#include <string.h>      /* Provides: memcpy, memset, strerror */
+#include <errno.h>       /* Provides: errno */
+#include <unistd.h>      /* Provides: close, getpid */
+#include <sys/epoll.h>   /* Provides: epoll_create1, epoll_ctl, epoll_wait */
+#include <openssl/rand.h> /* Provides: RAND_bytes */
+#include "freeflow.h"
+#include "client.h"
+#include "logger.h"
+#include "splunk.h"
+#include "http.h"
+
+#define CLIENT_MAX_EVENTS    64
+#define CLIENT_MAX_SEGMENTS  64      /* Segments gathered into one write */
+
+static void list_push(request_list* list, hec_request* request);
+static hec_request* list_pop(request_list* list);
+static void set_interest(hec_client* client, hec_connection* connection, int events);
+static void update_interest(hec_client* client, hec_connection* connection);
+static void open_connection(hec_client* client, hec_connection* connection);
+static void advance_connection(hec_client* client, hec_connection* connection);
+static void fail_connection(hec_client* client, hec_connection* connection, char* reason,
+                            int backoff);
+static void encode_request(hec_client* client, hec_connection* connection,
+                           hec_request* request);
+static void single_segment(hec_request* request, char* data, int len);
+static void dispatch_requests(hec_client* client);
+static void count_outstanding(hec_client* client);
+static void record_success(hec_client* client, hec_connection* connection,
+                           hec_request* request);
+static void record_failure(hec_client* client, server_health* health);
+static long backoff_delay(hec_client* client, server_health* health);
+static void flush_connection(hec_client* client, hec_connection* connection);
+static int gather_unsent(hec_connection* connection, struct iovec* iov, int max_segments);
+static void read_responses(hec_client* client, hec_connection* connection);
+static int finish_response(hec_client* client, hec_connection* connection);
+static int complete_request(hec_client* client, hec_connection* connection,
+                            hec_request* request, http_response* response);
+static void hold_request(hec_client* client, hec_connection* connection,
+                         hec_request* request, char* body);
+static void poll_acks(hec_client* client, hec_connection* connection);
+static void release_acked(hec_client* client, hec_connection* connection, char* body);
+static void requeue_request(hec_client* client, hec_request* request);
+static void handle_event(hec_client* client, struct epoll_event* event);
+static void run_timers(hec_client* client);
+static int create_channel(char* channel);
+
+/*
+ * Function: list_push
+ *
+ * Add a request to the end of a list.
+ *
+ * Inputs:   request_list*  list      List to add to
+ *           hec_request*   request   Request to add
+ *
+ * Returns:  None
+ */
+static void list_push(request_list* list, hec_request* request) {
+    request->next = NULL;
+    if (list->tail) {
+        list->tail->next = request;
+    }
+    else {
+        list->head = request;
+    }
+    list->tail = request;
+    list->count++;
+}
+
+/*
+ * Function: list_pop
+ *
+ * Remove the request at the front of a list.
+ *
+ * Inputs:   request_list*  list      List to remove from
+ *
+ * Returns:  <first request>   Success
+ *           NULL              The list is empty
+ */
+static hec_request* list_pop(request_list* list) {
+    hec_request* request = list->head;
+    if (request) {
+        list->head = request->next;
+        if (!list->head) {
+            list->tail = NULL;
+        }
+        list->count--;
+    }
+    return request;
+}
+
+/*
+ * Function: set_interest
+ *
+ * Change the events epoll reports for a connection, if they differ from
+ * the ones registered.
+ *
+ * Inputs:   hec_client*      client       Client the connection belongs to
+ *           hec_connection*  connection   Connection to change
+ *           int              events       epoll events to wait for
+ *
+ * Returns:  None
+ */
+static void set_interest(hec_client* client, hec_connection* connection, int events) {
+    struct epoll_event event;
+
+    if (events != connection->interest) {
+        event.events = events;
+        event.data.ptr = connection;
+        epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, connection->session.socket_id, &event);
+        connection->interest = events;
+    }
+}
+
+/*
+ * Function: update_interest
+ *
+ * Wait for responses on a connected connection, and for room in the
+ * socket buffer while there is something left to write.
+ *
+ * Inputs:   hec_client*      client       Client the connection belongs to
+ *           hec_connection*  connection   Connection to update
+ *
+ * Returns:  None
+ */
+static void update_interest(hec_client* client, hec_connection* connection) {
+    int events = EPOLLIN;
+
+    if ((connection->unsent && !connection->write_wants_read) || connection->read_wants_write) {
+        events |= EPOLLOUT;
+    }
+    set_interest(client, connection, events);
+}
+
+/*
+ * Function: open_connection
+ *
+ * Start connecting to the connection's HEC server.  If the connection
+ * can't even be started, try again once the server's backoff has passed.
+ *
+ * Inputs:   hec_client*      client       Client the connection belongs to
+ *           hec_connection*  connection   Connection to open
+ *
+ * Returns:  None
+ */
+static void open_connection(hec_client* client, hec_connection* connection) {
+    struct epoll_event event;
+
+    if (open_session(&connection->session, connection->server, client->worker_num,
+                     client->config, client->log_queue) < 0) {
+        record_failure(client, connection->health);
+        connection->resume_at = monotonic_ms() + backoff_delay(client, connection->health);
+        return;
+    }
+
+    connection->state = CONNECTION_CONNECTING;
+    connection->deadline = monotonic_ms() + CONNECT_TIMEOUT;
+    connection->interest = EPOLLOUT;
+    event.events = EPOLLOUT;
+    event.data.ptr = connection;
+    epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, connection->session.socket_id, &event);
+}
+
+/*
+ * Function: advance_connection
+ *
+ * Continue connecting once the socket is ready.  When the connection is
+ * established, an empty request is sent on it.  Its response validates
+ * the token, and keeps HEC from closing the connection before there is
+ * anything to send.
+ *
+ * Inputs:   hec_client*      client       Client the connection belongs to
+ *           hec_connection*  connection   Connection being established
+ *
+ * Returns:  None
+ */
+static void advance_connection(hec_client* client, hec_connection* connection) {
+    char error_message[LOG_MESSAGE_SIZE];
+
+    int result = session_connect(&connection->session, error_message);
+    if (result == SESSION_WANT_READ) {
+        set_interest(client, connection, EPOLLIN);
+        return;
+    }
+    if (result == SESSION_WANT_WRITE) {
+        set_interest(client, connection, EPOLLOUT);
+        return;
+    }
+    if (result < 0) {
+        fail_connection(client, connection, error_message, 1);
+        return;
+    }
+
+    connection->state = CONNECTION_PROBING;
+    int len = connection->prefix_len[0];
+    memcpy(connection->probe_header, connection->header_prefix[0], len);
+    len += hec_length_line(connection->probe_header + len, 0);
+    single_segment(&connection->probe, connection->probe_header, len);
+    list_push(&connection->requests, &connection->probe);
+    connection->unsent = &connection->probe;
+    flush_connection(client, connection);
+}
+
+/*
+ * Function: fail_connection
+ *
+ * Close a connection that can't be used any more, and requeue every
+ * request that was sent on it without a response.  The connection is
+ * reopened straight away, or once the server's backoff has passed.  A
+ * failure with a reason counts against the health of the server.
+ * Requests waiting on acknowledgement are kept, as their channel outlives
+ * the connection.
+ *
+ * Inputs:   hec_client*      client       Client the connection belongs to
+ *           hec_connection*  connection   Connection that failed
+ *           char*            reason       Reason to log, or NULL for none
+ *           int              backoff      1 to back off before reconnecting
+ *
+ * Returns:  None
+ */
+static void fail_connection(hec_client* client, hec_connection* connection, char* reason,
+                            int backoff) {
+    char log_message[LOG_MESSAGE_SIZE];
+    hec_request* request;
+
+    if (reason) {
+        sprintf(log_message, "Worker #%d HEC socket error: %.200s.", client->worker_num, reason);
+        log_warning(log_message, client->log_queue);
+        record_failure(client, connection->health);
+    }
+
+    epoll_ctl(client->epoll_fd, EPOLL_CTL_DEL, connection->session.socket_id, NULL);
+    close_session(&connection->session);
+    connection->state = CONNECTION_CLOSED;
+    connection->interest = 0;
+    connection->read_wants_write = 0;
+    connection->write_wants_read = 0;
+    connection->unsent = NULL;
+    connection->ack_polling = 0;
+    http_reset(&connection->response);
+    connection->paused = 0;
+    connection->resume_at = monotonic_ms();
+    if (backoff) {
+        connection->resume_at += backoff_delay(client, connection->health);
+    }
+
+    while ((request = list_pop(&connection->requests))) {
+        if (request != &connection->probe && request != &connection->ack_poll) {
+            requeue_request(client, request);
+        }
+    }
+}
+
+/*
+ * Function: encode_request
+ *
+ * Build the HTTP request for a batch, to be sent on the given connection.
+ * The batch is compressed if gzip is enabled, or sent as is if that
+ * fails.  The body is never copied: the request points at the cached
+ * header prefix, the Content-Length line and the body where they lie.
+ * Only when OpenSSL encrypts the connection is the header copied into the
+ * space reserved in front of the body, to make the request one buffer.
+ *
+ * Inputs:   hec_client*      client       Client sending the request
+ *           hec_connection*  connection   Connection it will be sent on
+ *           hec_request*     request      Request to encode
+ *
+ * Returns:  None
+ */
+static void encode_request(hec_client* client, hec_connection* connection,
+                           hec_request* request) {
+    char log_message[LOG_MESSAGE_SIZE];
+
+    char* body = batch_payload(&request->batch);
+    int body_len = request->batch.payload_len;
+    int compressed = 0;
+
+    if (client->compressor) {
+        int compressed_len = compress_payload(client->compressor, body, body_len,
+                                              &request->encoded, &request->encoded_size);
+        if (compressed_len >= 0) {
+            body = request->encoded + BATCH_HEADER_RESERVE;
+            body_len = compressed_len;
+            compressed = 1;
+        }
+        else {
+            sprintf(log_message, "Worker #%d unable to compress batch.  Sending uncompressed.",
+                                 client->worker_num);
+            log_warning(log_message, client->log_queue);
+        }
+    }
+
+    char* prefix = connection->header_prefix[compressed];
+    int prefix_len = connection->prefix_len[compressed];
+    int length_len = CONTENT_LENGTH_LINE;
+    hec_patch_length(request->content_length, body_len);
+
+    if (connection->session.is_ssl && !connection->session.ktls_send) {
+        char* data = body - length_len - prefix_len;
+        memcpy(data, prefix, prefix_len);
+        memcpy(data + prefix_len, request->content_length, length_len);
+        single_segment(request, data, prefix_len + length_len + body_len);
+    }
+    else {
+        request->iov[0].iov_base = prefix;
+        request->iov[0].iov_len = prefix_len;
+        request->iov[1].iov_base = request->content_length;
+        request->iov[1].iov_len = length_len;
+        request->iov[2].iov_base = body;
+        request->iov[2].iov_len = body_len;
+        request->iov_count = 3;
+        request->len = prefix_len + length_len + body_len;
+        request->written = 0;
+    }
+
+    if (client->config->debug) {
+        sprintf(log_message, "HTTP message of length %d with %d events assembled to send to HEC.",
+                             request->len, request->batch.events);
+        log_debug(log_message, client->log_queue);
+    }
+}
+
+/*
+ * Function: count_outstanding
+ *
+ * Count the requests in flight to each server, over all the connections
+ * to it.
+ *
+ * Inputs:   hec_client*  client   Client to count the requests of
+ *
+ * Returns:  None
+ */
+static void count_outstanding(hec_client* client) {
+    int i;
+
+    for (i = 0; i < client->num_servers; i++) {
+        client->servers[i].outstanding = 0;
+    }
+    for (i = 0; i < client->num_connections; i++) {
+        client->connections[i].health->outstanding += client->connections[i].requests.count;
+    }
+}
+
+/*
+ * Function: record_success
+ *
+ * Note a server's answer to a batch: fold its response time into the
+ * server's average, reset its backoff, and return a server being probed
+ * to service.
+ *
+ * Inputs:   hec_client*      client       Client the request belongs to
+ *           hec_connection*  connection   Connection the response came on
+ *           hec_request*     request      Request that was answered
+ *
+ * Returns:  None
+ */
+static void record_success(hec_client* client, hec_connection* connection,
+                           hec_request* request) {
+    char log_message[LOG_MESSAGE_SIZE];
+    server_health* health = connection->health;
+
+    long sample = monotonic_us() - request->sent_at;
+    if (sample < 1) {
+        sample = 1;
+    }
+    if (health->latency == 0) {
+        health->latency = sample;
+    }
+    else {
+        health->latency += (sample - health->latency) / LATENCY_WEIGHT;
+    }
+
+    health->failures = 0;
+    health->backoff = 0;
+    if (health->state == SERVER_PROBING) {
+        health->state = SERVER_HEALTHY;
+        sprintf(log_message, "Worker #%d returning HEC %.200s:%d to service.", client->worker_num,
+                             health->server->addr, health->server->port);
+        log_info(log_message, client->log_queue);
+    }
+}
+
+/*
+ * Function: record_failure
+ *
+ * Count a failure against a server, and double how long to back off from
+ * it.  After too many failures in a row, or any while it is being probed,
+ * the server is ejected for its backoff, unless every other server is
+ * ejected too.
+ *
+ * Inputs:   hec_client*     client   Client the server is used by
+ *           server_health*  health   Health of the server that failed
+ *
+ * Returns:  None
+ */
+static void record_failure(hec_client* client, server_health* health) {
+    char log_message[LOG_MESSAGE_SIZE];
+    int i;
+
+    health->failures++;
+    if (health->backoff == 0) {
+        health->backoff = BACKOFF_MIN;
+    }
+    else if (health->backoff < BACKOFF_MAX) {
+        health->backoff = (health->backoff * 2 < BACKOFF_MAX) ? health->backoff * 2 : BACKOFF_MAX;
+    }
+
+    if (health->state == SERVER_EJECTED ||
+        (health->state == SERVER_HEALTHY && health->failures < EJECT_FAILURES)) {
+        return;
+    }
+
+    for (i = 0; i < client->num_servers; i++) {
+        if (&client->servers[i] != health && client->servers[i].state != SERVER_EJECTED) {
+            break;
+        }
+    }
+    if (i == client->num_servers) {
+        return;
+    }
+
+    health->state = SERVER_EJECTED;
+    long delay = backoff_delay(client, health);
+    health->ejected_until = monotonic_ms() + delay;
+    sprintf(log_message, "Worker #%d ejecting HEC %.150s:%d for %ld ms after %d failures.",
+                         client->worker_num, health->server->addr, health->server->port,
+                         delay, health->failures);
+    log_warning(log_message, client->log_queue);
+}
+
+/*
+ * Function: backoff_delay
+ *
+ * Pick how long to leave a server alone for: somewhere between half and
+ * all of its current backoff.  The random part keeps connections, and the
+ * workers behind them, from all coming back to the server at once.
+ *
+ * Inputs:   hec_client*     client   Client the server is used by
+ *           server_health*  health   Health of the server
+ *
+ * Returns:  ms to wait
+ */
+static long backoff_delay(hec_client* client, server_health* health) {
+    int backoff = health->backoff ? health->backoff : BACKOFF_MIN;
+
+    return backoff / 2 + rand_r(&client->seed) % (backoff / 2 + 1);
+}
+
+/*
+ * Function: single_segment
+ *
+ * Make a request of a single buffer.
+ *
+ * Inputs:   hec_request*  request   Request to set up
+ *           char*         data      The whole HTTP request
+ *           int           len       Length of the request
+ *
+ * Returns:  None
+ */
+static void single_segment(hec_request* request, char* data, int len) {
+    request->iov[0].iov_base = data;
+    request->iov[0].iov_len = len;
+    request->iov_count = 1;
+    request->len = len;
+    request->written = 0;
+}
+
+/*
+ * Function: dispatch_requests
+ *
+ * Assign pending requests to ready connections with room in their
+ * window, and start writing them.  Each goes to the server with the least
+ * outstanding work: the requests already in flight to it, plus this one,
+ * times its average response time.  Servers not measured yet are tried
+ * first.  Ejected servers get nothing, and servers being probed get one
+ * request at a time.  Among connections to the same server, the one with
+ * the fewest requests in flight is used.
+ *
+ * Inputs:   hec_client*  client   Client to dispatch requests for
+ *
+ * Returns:  None
+ */
+static void dispatch_requests(hec_client* client) {
+    while (client->pending.count > 0) {
+        hec_connection* target = NULL;
+        long target_cost = 0;
+        int i;
+
+        count_outstanding(client);
+        for (i = 0; i < client->num_connections; i++) {
+            hec_connection* connection = &client->connections[i];
+            server_health* health = connection->health;
+            if (connection->state != CONNECTION_READY || connection->paused ||
+                connection->requests.count >= client->config->hec_pipeline) {
+                continue;
+            }
+            if (health->state == SERVER_EJECTED ||
+                (health->state == SERVER_PROBING && health->outstanding > 0)) {
+                continue;
+            }
+
+            long cost = (health->outstanding + 1) * health->latency;
+            if (!target || cost < target_cost ||
+                (cost == target_cost && connection->requests.count < target->requests.count)) {
+                target = connection;
+                target_cost = cost;
+            }
+        }
+        if (!target) {
+            return;
+        }
+
+        hec_request* request = list_pop(&client->pending);
+        encode_request(client, target, request);
+        list_push(&target->requests, request);
+        if (!target->unsent) {
+            target->unsent = request;
+        }
+        flush_connection(client, target);
+    }
+}
+
+/*
+ * Function: flush_connection
+ *
+ * Write as much of the unsent requests on a connection as the socket will
+ * take without blocking.  The segments of every unsent request are
+ * gathered into each write, so a window of pipelined requests can go out
+ * in a single call.
+ *
+ * Inputs:   hec_client*      client       Client the connection belongs to
+ *           hec_connection*  connection   Connection to write to
+ *
+ * Returns:  None
+ */
+static void flush_connection(hec_client* client, hec_connection* connection) {
+    char log_message[LOG_MESSAGE_SIZE];
+    struct iovec iov[CLIENT_MAX_SEGMENTS];
+
+    connection->write_wants_read = 0;
+    while (connection->unsent) {
+        int count = gather_unsent(connection, iov, CLIENT_MAX_SEGMENTS);
+        int bytes = session_writev(&connection->session, iov, count);
+        if (bytes == SESSION_WANT_WRITE) {
+            break;
+        }
+        if (bytes == SESSION_WANT_READ) {
+            connection->write_wants_read = 1;
+            break;
+        }
+        if (bytes <= 0) {
+            fail_connection(client, connection, (bytes == 0) ? "Not connected" : strerror(errno),
+                            1);
+            return;
+        }
+
+        while (bytes > 0) {
+            hec_request* request = connection->unsent;
+            int left = request->len - request->written;
+            if (bytes < left) {
+                request->written += bytes;
+                break;
+            }
+
+            bytes -= left;
+            request->written = request->len;
+            request->sent_at = monotonic_us();
+            connection->unsent = request->next;
+            if (client->config->debug && request != &connection->probe &&
+                request != &connection->ack_poll) {
+                sprintf(log_message,"Worker #%d sent %d events to HEC [%.200s]."
+                                   , client->worker_num, request->batch.events,
+                                   connection->server->addr);
+                log_debug(log_message, client->log_queue);
+            }
+        }
+    }
+    update_interest(client, connection);
+}
+
+/*
+ * Function: gather_unsent
+ *
+ * List the segments of a connection's unsent requests that are still to
+ * be written, in order, skipping whatever part of the first was already
+ * written.
+ *
+ * Inputs:   hec_connection*  connection     Connection to write to
+ *           struct iovec*    iov            Set to the segments to write
+ *           int              max_segments   Most segments to list
+ *
+ * Returns:  <number of segments>
+ */
+static int gather_unsent(hec_connection* connection, struct iovec* iov, int max_segments) {
+    hec_request* request = connection->unsent;
+    int count = 0;
+    int skip = request->written;
+    int i;
+
+    while (request && count + request->iov_count <= max_segments) {
+        for (i = 0; i < request->iov_count; i++) {
+            if (skip >= request->iov[i].iov_len) {
+                skip -= request->iov[i].iov_len;
+                continue;
+            }
+            iov[count].iov_base = (char*)request->iov[i].iov_base + skip;
+            iov[count].iov_len = request->iov[i].iov_len - skip;
+            skip = 0;
+            count++;
+        }
+        request = request->next;
+    }
+    return count;
+}
+
+/*
+ * Function: read_responses
+ *
+ * Read whatever HEC has sent on a connection, and complete the oldest
+ * request in flight for every whole response found.  A response may
+ * arrive across several reads, and several may arrive in one.  Only the
+ * bytes already waiting on the socket are read.
+ *
+ * Inputs:   hec_client*      client       Client the connection belongs to
+ *           hec_connection*  connection   Connection to read from
+ *
+ * Returns:  None
+ */
+static void read_responses(hec_client* client, hec_connection* connection) {
+    char buffer[RESPONSE_BUFFER_SIZE];
+
+    connection->read_wants_write = 0;
+    while (1) {
+        int bytes = session_read(&connection->session, buffer, RESPONSE_BUFFER_SIZE);
+        if (bytes == SESSION_WANT_READ) {
+            break;
+        }
+        if (bytes == SESSION_WANT_WRITE) {
+            connection->read_wants_write = 1;
+            break;
+        }
+        if (bytes == 0 && http_finish(&connection->response)) {
+            /* The response ran to the close of the connection */
+            finish_response(client, connection);
+            return;
+        }
+        if (bytes <= 0) {
+            /* HEC closes connections that have been idle for a while.  If
+             * nothing was in flight, reconnect straight away. */
+            if (bytes == 0 && connection->requests.count == 0) {
+                fail_connection(client, connection, NULL, 0);
+            }
+            else {
+                fail_connection(client, connection,
+                                (bytes == 0) ? "Connection closed by HEC" : strerror(errno), 1);
+            }
+            return;
+        }
+
+        int used = 0;
+        while (used < bytes) {
+            int parsed = http_parse(&connection->response, buffer + used, bytes - used);
+            if (parsed < 0) {
+                fail_connection(client, connection, "Malformed response", 1);
+                return;
+            }
+            used += parsed;
+
+            if (connection->response.state == HTTP_DONE &&
+                finish_response(client, connection) < 0) {
+                return;
+            }
+        }
+
+        /* SSL may hold decrypted bytes back, so only a plain socket can
+         * be assumed drained by a short read */
+        if (!connection->session.is_ssl && bytes < RESPONSE_BUFFER_SIZE) {
+            break;
+        }
+    }
+    update_interest(client, connection);
+}
+
+/*
+ * Function: finish_response
+ *
+ * Match a complete response to the oldest request in flight, and act on
+ * it.  If HEC is closing the connection after the response, nothing else
+ * sent on it will be answered, so it is closed and reopened.
+ *
+ * Inputs:   hec_client*      client       Client the connection belongs to
+ *           hec_connection*  connection   Connection the response came on
+ *
+ * Returns:  0    The connection is still open
+ *           -1   The connection was closed
+ */
+static int finish_response(hec_client* client, hec_connection* connection) {
+    hec_request* request = connection->requests.head;
+    int code = connection->response.code;
+    int keep_alive = connection->response.keep_alive;
+
+    if (!request || request == connection->unsent) {
+        fail_connection(client, connection, "Unexpected response", 1);
+        return -1;
+    }
+
+    list_pop(&connection->requests);
+
+    /* Keep new requests off a connection that is about to be closed */
+    if (!keep_alive) {
+        connection->paused = 1;
+    }
+    if (complete_request(client, connection, request, &connection->response) < 0) {
+        return -1;
+    }
+    if (!keep_alive) {
+        fail_connection(client, connection, NULL, code != 200 || request == &connection->probe);
+        return -1;
+    }
+    http_reset(&connection->response);
+    return 0;
+}
+
+/*
+ * Function: complete_request
+ *
+ * Act on the response to a request.  A delivered batch is released for
+ * reuse, or held until it is acknowledged if acknowledgement is enabled.
+ * A batch HEC rejects as malformed or too large would be rejected again,
+ * so it is dropped.  If Splunk returns any other error, the batch is
+ * requeued for future delivery, and no more requests are sent on the
+ * connection until the server's backoff has passed, or for as long as
+ * the server asked with Retry-After if that is longer.
+ *
+ * Inputs:   hec_client*      client       Client the request belongs to
+ *           hec_connection*  connection   Connection the response came on
+ *           hec_request*     request      Request that was answered
+ *           http_response*   response     Response to the request
+ *
+ * Returns:  0    The connection is still open
+ *           -1   The connection was closed
+ */
+static int complete_request(hec_client* client, hec_connection* connection,
+                            hec_request* request, http_response* response) {
+    char log_message[LOG_MESSAGE_SIZE];
+    int code = response->code;
+
+    if (request == &connection->probe) {
+        if (code == 403) {
+            sprintf(log_message, "Worker #%d unable to authenticate with Splunk.",
+                                 client->worker_num);
+            log_error(log_message, client->log_queue);
+            record_failure(client, connection->health);
+            fail_connection(client, connection, NULL, 1);
+            return -1;
+        }
+
+        connection->state = CONNECTION_READY;
+        sprintf(log_message, "Worker #%d connected to HEC %.200s:%d%s", client->worker_num,
+                             connection->server->addr, connection->server->port,
+                             session_resumed(&connection->session) ? " (SSL session resumed)" : "");
+        log_info(log_message, client->log_queue);
+
+        if (client->config->ssl_ktls && connection->session.is_ssl &&
+            !connection->session.ktls_send && !client->ktls_warned) {
+            sprintf(log_message, "Worker #%d kernel TLS unavailable.  Encrypting in OpenSSL.",
+                                 client->worker_num);
+            log_warning(log_message, client->log_queue);
+            client->ktls_warned = 1;
+        }
+    }
+    else if (request == &connection->ack_poll) {
+        connection->ack_polling = 0;
+        connection->ack_poll_at = monotonic_ms() + client->config->hec_ack_interval;
+        if (code == 200) {
+            release_acked(client, connection, response->body);
+        }
+        else {
+            sprintf(log_message, "Worker #%d unable to poll HEC for acknowledgements [%d].",
+                                 client->worker_num, code);
+            log_warning(log_message, client->log_queue);
+        }
+    }
+    else if (code == 400 || code == 413) {
+        sprintf(log_message, "Worker #%d HEC rejected a batch of %d events [%d]: %.100s  "
+                             "Dropping it.", client->worker_num, request->batch.events, code,
+                             response->body);
+        log_error(log_message, client->log_queue);
+        reset_batch(&request->batch);
+        list_push(&client->idle, request);
+    }
+    else if (code != 200) {
+        sprintf(log_message, "Worker #%d received error writing to HEC [%d]."
+                           , client->worker_num, code);
+        log_warning(log_message, client->log_queue);
+
+        record_failure(client, connection->health);
+        requeue_request(client, request);
+
+        long delay = backoff_delay(client, connection->health);
+        if (response->retry_after * 1000 > delay) {
+            delay = (response->retry_after * 1000 < BACKOFF_MAX) ? response->retry_after * 1000
+                                                                 : BACKOFF_MAX;
+        }
+        connection->paused = 1;
+        connection->resume_at = monotonic_ms() + delay;
+    }
+    else if (client->config->hec_ack) {
+        record_success(client, connection, request);
+        hold_request(client, connection, request, response->body);
+    }
+    else {
+        record_success(client, connection, request);
+        reset_batch(&request->batch);
+        list_push(&client->idle, request);
+    }
+
+    dispatch_requests(client);
+    return (connection->state == CONNECTION_CLOSED) ? -1 : 0;
+}
+
+/*
+ * Function: hold_request
+ *
+ * Keep a batch HEC has accepted until HEC reports it indexed, under the
+ * ackId it was given.  If HEC gave it no ackId, acknowledgement isn't
+ * enabled for the token, and the batch is released as delivered.
+ *
+ * Inputs:   hec_client*      client       Client the request belongs to
+ *           hec_connection*  connection   Connection the request was sent on
+ *           hec_request*     request      Request HEC accepted
+ *           char*            body         Body of HEC's response
+ *
+ * Returns:  None
+ */
+static void hold_request(hec_client* client, hec_connection* connection,
+                         hec_request* request, char* body) {
+    char log_message[LOG_MESSAGE_SIZE];
+    long now = monotonic_ms();
+
+    if (hec_ack_id(body, &request->ack_id) < 0) {
+        if (!client->ack_warned) {
+            sprintf(log_message, "Worker #%d received no ackId from HEC.  Indexer "
+                                 "acknowledgement may not be enabled for the token.",
+                                 client->worker_num);
+            log_warning(log_message, client->log_queue);
+            client->ack_warned = 1;
+        }
+        reset_batch(&request->batch);
+        list_push(&client->idle, request);
+        return;
+    }
+
+    if (connection->unacked.count == 0 && !connection->ack_polling) {
+        connection->ack_poll_at = now + client->config->hec_ack_interval;
+    }
+    request->expires = now + client->config->hec_ack_timeout * 1000L;
+    list_push(&connection->unacked, request);
+}
+
+/*
+ * Function: poll_acks
+ *
+ * Ask HEC which of the batches waiting on a connection's channel have
+ * been indexed, oldest first.  The poll is queued behind any requests
+ * already on the connection, and answered in turn.
+ *
+ * Inputs:   hec_client*      client       Client the connection belongs to
+ *           hec_connection*  connection   Connection to poll on
+ *
+ * Returns:  None
+ */
+static void poll_acks(hec_client* client, hec_connection* connection) {
+    char body[ACK_BODY_SIZE];
+    hec_request* request = connection->unacked.head;
+    int count = 0;
+
+    int len = sprintf(body, "{\"acks\":[");
+    while (request && count < ACK_POLL_MAX) {
+        len += sprintf(body + len, "%s%ld", count ? "," : "", request->ack_id);
+        request = request->next;
+        count++;
+    }
+    len += sprintf(body + len, "]}");
+
+    int header_len = hec_header(connection->server, ACK_PATH, 0, len, connection->channel,
+                                connection->ack_data);
+    memcpy(connection->ack_data + header_len, body, len);
+    single_segment(&connection->ack_poll, connection->ack_data, header_len + len);
+    connection->ack_polling = 1;
+
+    list_push(&connection->requests, &connection->ack_poll);
+    if (!connection->unsent) {
+        connection->unsent = &connection->ack_poll;
+    }
+    flush_connection(client, connection);
+}
+
+/*
+ * Function: release_acked
+ *
+ * Release every batch HEC reports indexed in its answer to a poll.  The
+ * rest keep waiting, in order.
+ *
+ * Inputs:   hec_client*      client       Client the connection belongs to
+ *           hec_connection*  connection   Connection the poll was sent on
+ *           char*            body         Body of HEC's response
+ *
+ * Returns:  None
+ */
+static void release_acked(hec_client* client, hec_connection* connection, char* body) {
+    char log_message[LOG_MESSAGE_SIZE];
+    request_list waiting = connection->unacked;
+    hec_request* request;
+    int released = 0;
+
+    memset(&connection->unacked, 0, sizeof(request_list));
+    while ((request = list_pop(&waiting))) {
+        if (hec_ack_status(body, request->ack_id)) {
+            reset_batch(&request->batch);
+            list_push(&client->idle, request);
+            released++;
+        }
+        else {
+            list_push(&connection->unacked, request);
+        }
+    }
+
+    if (client->config->debug) {
+        sprintf(log_message, "Worker #%d received %d acknowledgements, %d batches still waiting.",
+                             client->worker_num, released, connection->unacked.count);
+        log_debug(log_message, client->log_queue);
+    }
+}
+
+/*
+ * Function: requeue_request
+ *
+ * Requeue every packet in a batch that couldn't be delivered, or spool it
+ * to disk if there is a spool, to be replayed once HEC can take it.
+ * Packets that can't be requeued or spooled stay with this worker, and
+ * are parsed back into the batch to be sent again.
+ *
+ * Inputs:   hec_client*   client    Client the request belongs to
+ *           hec_request*  request   Request to requeue
+ *
+ * Returns:  None
+ */
+static void requeue_request(hec_client* client, hec_request* request) {
+    char log_message[LOG_MESSAGE_SIZE];
+    hec_batch* batch = &request->batch;
+
+    sprintf(log_message, "Worker #%d %s %d undelivered packets.", client->worker_num,
+                         client->spool ? "spooling" : "requeuing", batch->num_packets);
+    log_info(log_message, client->log_queue);
+
+    int kept = client->spool ? spool_batch(client->spool, batch)
+                             : batch_requeue(batch, client->transport);
+    int i;
+    for (i = 0; i < kept; i++) {
+        batch_add_records(batch, &batch->packets[i],
+                          packet_records(&batch->packets[i], client->format, client->log_queue),
+                          client->format);
+    }
+
+    if (kept > 0) {
+        sprintf(log_message, "Worker #%d %s.  Keeping %d packets to retry.", client->worker_num,
+                             client->spool ? "unable to spool packets" : "packet queue full", kept);
+        log_warning(log_message, client->log_queue);
+        list_push(&client->pending, request);
+    }
+    else {
+        list_push(&client->idle, request);
+    }
+}
+
+/*
+ * Function: handle_event
+ *
+ * Make whatever progress a connection's socket allows, after epoll
+ * reports it ready.
+ *
+ * Inputs:   hec_client*          client   Client the connection belongs to
+ *           struct epoll_event*  event    Event reported for the connection
+ *
+ * Returns:  None
+ */
+static void handle_event(hec_client* client, struct epoll_event* event) {
+    hec_connection* connection = event->data.ptr;
+
+    if (connection->state == CONNECTION_CLOSED) {
+        return;
+    }
+    if (connection->state == CONNECTION_CONNECTING) {
+        advance_connection(client, connection);
+        return;
+    }
+
+    if ((event->events & (EPOLLIN | EPOLLERR | EPOLLHUP)) ||
+        (connection->read_wants_write && (event->events & EPOLLOUT))) {
+        read_responses(client, connection);
+    }
+    if (connection->state != CONNECTION_CLOSED && connection->unsent &&
+        ((event->events & EPOLLOUT) || connection->write_wants_read)) {
+        flush_connection(client, connection);
+    }
+}
+
+/*
+ * Function: run_timers
+ *
+ * Probe ejected servers, reconnect closed connections, give up on
+ * connections that take too long to establish, return paused connections
+ * to service, poll for acknowledgements and requeue batches that were
+ * never acknowledged, once their time comes.  Then hand any pending
+ * requests to connections with room for them.
+ *
+ * Inputs:   hec_client*  client   Client to run the timers of
+ *
+ * Returns:  None
+ */
+static void run_timers(hec_client* client) {
+    char log_message[LOG_MESSAGE_SIZE];
+    long now = monotonic_ms();
+    int i;
+
+    for (i = 0; i < client->num_servers; i++) {
+        server_health* health = &client->servers[i];
+        if (health->state == SERVER_EJECTED && now >= health->ejected_until) {
+            health->state = SERVER_PROBING;
+            sprintf(log_message, "Worker #%d probing HEC %.200s:%d.", client->worker_num,
+                                 health->server->addr, health->server->port);
+            log_info(log_message, client->log_queue);
+        }
+    }
+
+    for (i = 0; i < client->num_connections; i++) {
+        hec_connection* connection = &client->connections[i];
+
+        if (connection->state == CONNECTION_CLOSED && now >= connection->resume_at) {
+            if (client->config->debug) {
+                sprintf(log_message, "Worker #%d attempting to reestablish connection to HEC.",
+                                     client->worker_num);
+                log_debug(log_message, client->log_queue);
+            }
+            open_connection(client, connection);
+        }
+        else if ((connection->state == CONNECTION_CONNECTING ||
+                  connection->state == CONNECTION_PROBING) && now >= connection->deadline) {
+            fail_connection(client, connection, "Timed out connecting", 1);
+        }
+        else if (connection->paused && now >= connection->resume_at) {
+            connection->paused = 0;
+            sprintf(log_message, "Worker #%d reentering service.", client->worker_num);
+            log_info(log_message, client->log_queue);
+        }
+
+        while (connection->unacked.head && now >= connection->unacked.head->expires) {
+            hec_request* request = list_pop(&connection->unacked);
+            sprintf(log_message, "Worker #%d timed out waiting for HEC to acknowledge ackId %ld.",
+                                 client->worker_num, request->ack_id);
+            log_warning(log_message, client->log_queue);
+            requeue_request(client, request);
+        }
+        if (connection->state == CONNECTION_READY && connection->unacked.count > 0 &&
+            !connection->ack_polling && now >= connection->ack_poll_at) {
+            poll_acks(client, connection);
+        }
+    }
+    dispatch_requests(client);
+}
+
+/*
+ * Function: create_channel
+ *
+ * Make up a random GUID to identify a connection's requests to HEC, which
+ * HEC issues and looks up ackIds by.
+ *
+ * Inputs:   char*  channel   Buffer of HEC_CHANNEL_SIZE for the GUID
+ *
+ * Returns:  0    Success
+ *           -1   No random bytes were available
+ */
+static int create_channel(char* channel) {
+    unsigned char id[16];
+
+    if (RAND_bytes(id, sizeof(id)) != 1) {
+        return -1;
+    }
+
+    /* Mark it as a version 4 (random) GUID */
+    id[6] = (id[6] & 0x0f) | 0x40;
+    id[8] = (id[8] & 0x3f) | 0x80;
+    sprintf(channel, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                     id[0], id[1], id[2], id[3], id[4], id[5], id[6], id[7],
+                     id[8], id[9], id[10], id[11], id[12], id[13], id[14], id[15]);
+    return 0;
+}
+
+/*
+ * Function: create_client
+ *
+ * Allocate the connections and requests of a worker's HEC client.  No
+ * connections are made until client_start is called.
+ *
+ * Inputs:   hec_client*         client       Client object to initialize
+ *           int                 worker_num   Id of the worker process
+ *           freeflow_config*    config       Pointer to configuration object
+ *           record_format*      format       Constant record fragments
+ *           packet_transport*   transport    Transport to requeue packets on
+ *           packet_spool*       spool        Spool for undelivered packets, or
+ *                                            NULL to requeue them instead
+ *           payload_compressor* compressor   Compressor for the payloads, or
+ *                                            NULL to send them uncompressed
+ *           int                 log_queue    Id of IPC queue for logging
+ *
+ * Returns:  0    Success
+ *           -1   Couldn't allocate the client
+ */
+int create_client(hec_client* client, int worker_num, freeflow_config* config,
+                  record_format* format, packet_transport* transport, packet_spool* spool,
+                  payload_compressor* compressor, int log_queue) {
+    int i, j;
+
+    memset(client, 0, sizeof(hec_client));
+    client->worker_num = worker_num;
+    client->config = config;
+    client->format = format;
+    client->transport = transport;
+    client->spool = spool;
+    client->compressor = compressor;
+    client->log_queue = log_queue;
+    client->seed = getpid() ^ monotonic_us();
+    client->num_servers = config->num_servers;
+    client->num_connections = config->hec_connections;
+    if (client->num_connections < client->num_servers) {
+        /* Every server must be reachable for traffic to be balanced */
+        client->num_connections = client->num_servers;
+    }
+    client->num_requests = client->num_connections * config->hec_pipeline;
+    if (config->hec_ack) {
+        /* Room for batches to wait on acknowledgement while more are sent */
+        client->num_requests += config->hec_ack_window;
+    }
+
+    client->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    client->connections = calloc(client->num_connections, sizeof(hec_connection));
+    client->requests = calloc(client->num_requests, sizeof(hec_request));
+    client->servers = calloc(client->num_servers, sizeof(server_health));
+    if (client->epoll_fd < 0 || !client->connections || !client->requests || !client->servers) {
+        free_client(client);
+        return -1;
+    }
+
+    for (i = 0; i < client->num_servers; i++) {
+        client->servers[i].server = &config->hec_server[i];
+        client->servers[i].state = SERVER_HEALTHY;
+    }
+
+    /* A worker's connections are spread over the servers, starting from
+     * a different one for each worker. */
+    for (i = 0; i < client->num_connections; i++) {
+        hec_connection* connection = &client->connections[i];
+        connection->session.socket_id = -1;
+        connection->health = &client->servers[(worker_num * client->num_connections + i) %
+                                               client->num_servers];
+        connection->server = connection->health->server;
+        connection->state = CONNECTION_CLOSED;
+        http_reset(&connection->response);
+        if (config->hec_ack && create_channel(connection->channel) < 0) {
+            free_client(client);
+            return -1;
+        }
+
+        /* Everything in the header but Content-Length is the same for
+         * every request on the connection */
+        for (j = 0; j < 2; j++) {
+            connection->prefix_len[j] = hec_header_prefix(connection->server, config->hec_path, j,
+                                                          config->hec_ack ? connection->channel
+                                                                          : NULL,
+                                                          connection->header_prefix[j]);
+        }
+    }
+
+    for (i = 0; i < client->num_requests; i++) {
+        if (create_batch(&client->requests[i].batch) < 0) {
+            free_client(client);
+            return -1;
+        }
+        hec_length_line(client->requests[i].content_length, 0);
+        list_push(&client->idle, &client->requests[i]);
+    }
+    return 0;
+}
+
+/*
+ * Function: free_client
+ *
+ * Close the connections of a client, and release its memory.
+ *
+ * Inputs:   hec_client*  client   Client to free
+ *
+ * Returns:  None
+ */
+void free_client(hec_client* client) {
+    int i;
+
+    if (client->connections) {
+        for (i = 0; i < client->num_connections; i++) {
+            close_session(&client->connections[i].session);
+        }
+        free(client->connections);
+        client->connections = NULL;
+    }
+
+    if (client->requests) {
+        for (i = 0; i < client->num_requests; i++) {
+            free_batch(&client->requests[i].batch);
+            free(client->requests[i].encoded);
+        }
+        free(client->requests);
+        client->requests = NULL;
+    }
+
+    free(client->servers);
+    client->servers = NULL;
+
+    if (client->epoll_fd >= 0) {
+        close(client->epoll_fd);
+        client->epoll_fd = -1;
+    }
+}
+
+/*
+ * Function: client_start
+ *
+ * Open every connection of a client, and wait until each is established
+ * and HEC has accepted the token, or has failed to.  Servers that can't
+ * be reached are left to be retried, as long as one can.
+ *
+ * Inputs:   hec_client*  client   Client to start
+ *
+ * Returns:  0    At least one connection is ready
+ *           -1   Every connection failed
+ */
+int client_start(hec_client* client) {
+    int i;
+
+    for (i = 0; i < client->num_connections; i++) {
+        open_connection(client, &client->connections[i]);
+    }
+
+    while (1) {
+        int connecting = 0;
+        for (i = 0; i < client->num_connections; i++) {
+            int state = client->connections[i].state;
+            if (state == CONNECTION_CONNECTING || state == CONNECTION_PROBING) {
+                connecting = 1;
+            }
+        }
+        if (!connecting) {
+            break;
+        }
+        client_poll(client, -1);
+    }
+
+    for (i = 0; i < client->num_connections; i++) {
+        if (client->connections[i].state == CONNECTION_READY) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Function: client_has_room
+ *
+ * Check whether the client can take another batch.
+ *
+ * Inputs:   hec_client*  client   Client to check
+ *
+ * Returns:  1    A batch can be submitted
+ *           0    Every request is in use
+ */
+int client_has_room(hec_client* client) {
+    return client->idle.count > 0;
+}
+
+/*
+ * Function: client_available
+ *
+ * Check whether any connection could take a request now, or whether HEC
+ * is out of reach for the time being: every connection closed, paused
+ * after an error, or to an ejected server.
+ *
+ * Inputs:   hec_client*  client   Client to check
+ *
+ * Returns:  1    A connection can be sent on
+ *           0    None can
+ */
+int client_available(hec_client* client) {
+    int i;
+
+    for (i = 0; i < client->num_connections; i++) {
+        hec_connection* connection = &client->connections[i];
+        if (connection->state == CONNECTION_READY && !connection->paused &&
+            connection->health->state != SERVER_EJECTED) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: client_submit
+ *
+ * Hand a batch to the client to be sent, and start sending it if a
+ * connection has room.  The batch is swapped with the empty one of an
+ * idle request, so the caller gets back an empty batch to fill without
+ * copying any events.  The client must have room.
+ *
+ * Inputs:   hec_client*  client   Client to send the batch with
+ *           hec_batch*   batch    Batch to send
+ *
+ * Returns:  None
+ */
+void client_submit(hec_client* client, hec_batch* batch) {
+    hec_request* request = list_pop(&client->idle);
+
+    hec_batch empty = request->batch;
+    request->batch = *batch;
+    *batch = empty;
+
+    list_push(&client->pending, request);
+    dispatch_requests(client);
+}
+
+/*
+ * Function: client_poll
+ *
+ * Wait up to 'timeout' ms for any of the client's connections to become
+ * ready, and make whatever progress is possible on them.  The wait ends
+ * early when a timer is due.
+ *
+ * Inputs:   hec_client*  client    Client to poll
+ *           int          timeout   Maximum wait in ms, 0 to not wait, or -1
+ *                                  to wait until something happens
+ *
+ * Returns:  None
+ */
+void client_poll(hec_client* client, int timeout) {
+    struct epoll_event events[CLIENT_MAX_EVENTS];
+    int next = client_timeout(client);
+    int i;
+
+    if (next >= 0 && (timeout < 0 || next < timeout)) {
+        timeout = next;
+    }
+
+    int ready = epoll_wait(client->epoll_fd, events, CLIENT_MAX_EVENTS, timeout);
+    for (i = 0; i < ready; i++) {
+        handle_event(client, &events[i]);
+    }
+    run_timers(client);
+}
+
+/*
+ * Function: client_timeout
+ *
+ * Find how long until the client's next timer is due.
+ *
+ * Inputs:   hec_client*  client   Client to check
+ *
+ * Returns:  <ms until the next timer>   A timer is running
+ *           -1                          No timers are running
+ */
+int client_timeout(hec_client* client) {
+    long now = monotonic_ms();
+    long next = -1;
+    int i;
+
+    for (i = 0; i < client->num_servers; i++) {
+        if (client->servers[i].state == SERVER_EJECTED) {
+            long due = client->servers[i].ejected_until;
+            due = (due > now) ? due - now : 0;
+            if (next < 0 || due < next) {
+                next = due;
+            }
+        }
+    }
+
+    for (i = 0; i < client->num_connections; i++) {
+        hec_connection* connection = &client->connections[i];
+        long due = -1;
+
+        if (connection->state == CONNECTION_CLOSED || connection->paused) {
+            due = connection->resume_at;
+        }
+        else if (connection->state != CONNECTION_READY) {
+            due = connection->deadline;
+        }
+
+        if (connection->unacked.count > 0) {
+            if (due < 0 || connection->unacked.head->expires < due) {
+                due = connection->unacked.head->expires;
+            }
+            if (connection->state == CONNECTION_READY && !connection->ack_polling &&
+                connection->ack_poll_at < due) {
+                due = connection->ack_poll_at;
+            }
+        }
+        if (due < 0) {
+            continue;
+        }
+
+        due = (due > now) ? due - now : 0;
+        if (next < 0 || due < next) {
+            next = due;
+        }
+    }
+    return (int)next;
+}
+
+/*
+ * Function: client_outstanding
+ *
+ * Count the batches submitted to a client that haven't been delivered.
+ *
+ * Inputs:   hec_client*  client   Client to check
+ *
+ * Returns:  <# of undelivered batches>
+ */
+int client_outstanding(hec_client* client) {
+    return client->num_requests - client->idle.count;
+}
+
+/*
+ * Function: client_abandon
+ *
+ * Give up on every batch that hasn't been delivered, or hasn't been
+ * acknowledged, when the worker is shutting down.  Their packets are
+ * spooled for the next run if there is a spool, or requeued for any
+ * other process still running.
+ *
+ * Inputs:   hec_client*  client   Client to abandon the batches of
+ *
+ * Returns:  None
+ */
+void client_abandon(hec_client* client) {
+    char log_message[LOG_MESSAGE_SIZE];
+    hec_request* request;
+    int i;
+
+    for (i = 0; i < client->num_connections; i++) {
+        if (client->connections[i].state != CONNECTION_CLOSED) {
+            fail_connection(client, &client->connections[i], NULL, 0);
+        }
+        while ((request = list_pop(&client->connections[i].unacked))) {
+            list_push(&client->pending, request);
+        }
+    }
+
+    while ((request = list_pop(&client->pending))) {
+        int kept = client->spool ? spool_batch(client->spool, &request->batch)
+                                 : batch_requeue(&request->batch, client->transport);
+        if (kept > 0) {
+            sprintf(log_message, "Worker #%d %s.  Dropping %d packets.", client->worker_num,
+                                 client->spool ? "unable to spool packets" : "packet queue full",
+                                 kept);
+            log_warning(log_message, client->log_queue);
+        }
+        list_push(&client->idle, request);
+    }
+}
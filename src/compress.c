@@ -0,0 +1,125 @@
+#include <stdlib.h>      /* Provides: realloc */
+#include <string.h>      /* Provides: memset */
+#include <time.h>        /* Provides: clock_gettime */
+#include "compress.h"
+
+#define GZIP_WINDOW_BITS  (15 + 16)
+#define GZIP_MEM_LEVEL    8
+
+static long thread_cpu_usecs();
+
+/*
+ * Function: thread_cpu_usecs
+ *
+ * Return the CPU time used by the calling thread so far, in microseconds.
+ *
+ * Inputs:   None
+ *
+ * Returns:  <CPU time in microseconds>
+ */
+static long thread_cpu_usecs() {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Function: create_compressor
+ *
+ * Initialize a gzip stream at the given compression level.
+ *
+ * Inputs:   payload_compressor*  compressor   Compressor to initialize
+ *           int                  level        zlib compression level, 1-9
+ *
+ * Returns:  0    Success
+ *           -1   Couldn't initialize the stream
+ */
+int create_compressor(payload_compressor* compressor, int level) {
+    memset(compressor, 0, sizeof(payload_compressor));
+
+    if (deflateInit2(&compressor->stream, level, Z_DEFLATED, GZIP_WINDOW_BITS,
+                     GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function: free_compressor
+ *
+ * Release the gzip stream of a compressor.
+ *
+ * Inputs:   payload_compressor*  compressor   Compressor to free
+ *
+ * Returns:  None
+ */
+void free_compressor(payload_compressor* compressor) {
+    deflateEnd(&compressor->stream);
+}
+
+/*
+ * Function: compress_payload
+ *
+ * Compress a payload into a complete gzip member in the output buffer,
+ * after the header reserve.  The buffer is allocated or grown as needed,
+ * so it can start out NULL.  The stream is reset rather than
+ * reinitialized, so its allocations are reused from one batch to the next.
+ *
+ * Inputs:   payload_compressor*  compressor    Compressor to use
+ *           char*                payload       Bytes to compress
+ *           int                  payload_len   Number of bytes to compress
+ *           char**               buffer        Output buffer
+ *           int*                 buffer_size   Size of the output buffer
+ *
+ * Returns:  <length of the compressed payload>   Success
+ *           -1                                   Failure
+ */
+int compress_payload(payload_compressor* compressor, char* payload, int payload_len,
+                     char** buffer, int* buffer_size) {
+    long started = thread_cpu_usecs();
+    z_stream* stream = &compressor->stream;
+
+    int needed = BATCH_HEADER_RESERVE + deflateBound(stream, payload_len);
+    if (needed > *buffer_size) {
+        char* grown = realloc(*buffer, needed);
+        if (!grown) {
+            return -1;
+        }
+        *buffer = grown;
+        *buffer_size = needed;
+    }
+
+    deflateReset(stream);
+    stream->next_in = (Bytef*)payload;
+    stream->avail_in = payload_len;
+    stream->next_out = (Bytef*)*buffer + BATCH_HEADER_RESERVE;
+    stream->avail_out = *buffer_size - BATCH_HEADER_RESERVE;
+
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+
+    int compressed_len = stream->total_out;
+
+    compressor->bytes_in += payload_len;
+    compressor->bytes_out += compressed_len;
+    compressor->batches++;
+    compressor->cpu_usecs += thread_cpu_usecs() - started;
+    return compressed_len;
+}
+
+/*
+ * Function: reset_compression_stats
+ *
+ * Clear the compression statistics after they have been reported.
+ *
+ * Inputs:   payload_compressor*  compressor   Compressor to reset
+ *
+ * Returns:  None
+ */
+void reset_compression_stats(payload_compressor* compressor) {
+    compressor->bytes_in = 0;
+    compressor->bytes_out = 0;
+    compressor->batches = 0;
+    compressor->cpu_usecs = 0;
+}
@@ -5,6 +5,19 @@
 #include <ctype.h>     /* Provides: isprint */
 #include <arpa/inet.h> /* Provides: AF_INET */
 #include "config.h"
+#include "overload.h"
+#include "transport.h"
+#include "format.h"
+
+/* Keywords accepted for queue_type, in the order of the TRANSPORT_ values */
+static char* queue_types[] = { "ring", "sysv", NULL };
+
+/* Keywords accepted for hec_mode, in the order of the HEC_MODE_ values */
+static char* hec_modes[] = { "event", "raw", NULL };
+
+/* Keywords accepted for overload_policy, in the order of the OVERLOAD_ values */
+static char* overload_policies[] = { "block", "drop_newest", "drop_oldest", "sample",
+                                     "summarize", NULL };
 
 static int token_count(char* str, char delim);
 static int is_ip_address(char *addr);
@@ -16,11 +29,14 @@ static void setting_empty(char* setting_desc);
 
 static void initialize_hec_servers(freeflow_config* config, char *value);
 static void initialize_configuration(freeflow_config* config);
+static char* url_encode(char* cursor, char* value);
+static void build_hec_path(freeflow_config* config);
 static void verify_configuration(freeflow_config* config);
 
 static void handle_addr_setting(char *setting, char *value, char *setting_desc);
 static void handle_int_setting(int *setting, char* value, char* setting_desc, int min, int max);
 static void handle_port_setting(int *setting, char* value, char* setting_desc);
+static void handle_choice_setting(int *setting, char* value, char* setting_desc, char** choices);
 static void handle_hec_servers(freeflow_config* config, char* servers);
 static void handle_hec_tokens(freeflow_config* config, char* tokens);
 
@@ -237,6 +253,32 @@ static void handle_port_setting(int *setting, char* value, char* setting_desc) {
     handle_int_setting(setting, value, setting_desc, 1, 65535);
 }
 
+/*
+ * Function: handle_choice_setting
+ *
+ * Used to validate and set a configuration setting which must be one of a
+ * fixed list of keywords.  The setting is stored as the position of the
+ * keyword in the list.  Update the configuration object (passed by
+ * reference) or generate an error.
+ *
+ * Inputs:   int*   setting         Pointer to configuration object being set
+ *           char*  value           Value being set
+ *           char*  setting_desc    String description of setting
+ *           char** choices         NULL terminated list of allowed keywords
+ *
+ * Returns:  None
+ */
+static void handle_choice_setting(int *setting, char* value, char* setting_desc, char** choices) {
+    int i;
+    for (i = 0; choices[i] != NULL; i++) {
+        if (!strcmp(value, choices[i])) {
+            *setting = i;
+            return;
+        }
+    }
+    setting_error(setting_desc, value);
+}
+
 /*
  * Function: initialize_hec_servers
  *
@@ -337,11 +379,39 @@ static void handle_hec_tokens(freeflow_config* config, char* tokens) {
 static void initialize_configuration(freeflow_config* config) {
     memset(&config->bind_addr, 0, sizeof(config->bind_addr));
     config->bind_port = -1;
+    config->sflow_port = 0;
     config->threads = -1;
+    config->receivers = 1;
+    config->receiver_steering = 0;
     config->queue_size = -1;
+    config->queue_type = TRANSPORT_RING;
+    config->queue_hugepages = 0;
+    config->receive_batch_size = 32;
+    config->receive_batch_timeout = 0;
+    config->overload_policy = OVERLOAD_DROP_NEWEST;
+    config->stats_interval = 60;
+    config->hec_batch_size = 262144;
+    config->hec_batch_events = 1000;
+    config->hec_batch_linger = 10;
+    config->hec_mode = HEC_MODE_EVENT;
+    config->hec_gzip_level = 0;
+    config->hec_connections = 1;
+    config->hec_pipeline = 1;
+    config->hec_ack = 0;
+    config->hec_ack_window = 32;
+    config->hec_ack_interval = 1000;
+    config->hec_ack_timeout = 300;
+    memset(&config->hec_host, 0, sizeof(config->hec_host));
+    memset(&config->hec_index, 0, sizeof(config->hec_index));
     config->num_servers = -1;
     config->ssl_enabled = 0;
+    config->ssl_ktls = 0;
+    memset(&config->spool_dir, 0, sizeof(config->spool_dir));
+    config->spool_max_size = 1024;
+    config->spool_replay_rate = 1000;
     memset(&config->sourcetype, 0, sizeof(config->sourcetype));
+    memset(&config->sflow_counter_sourcetype, 0, sizeof(config->sflow_counter_sourcetype));
+    strcpy(config->output_fields, DEFAULT_OUTPUT_FIELDS);
     memset(&config->log_file, 0, sizeof(config->log_file));
 }
 
@@ -364,6 +434,22 @@ static void verify_configuration(freeflow_config* config) {
     if (config->ssl_enabled < 0)         setting_empty("ssl_enabled");
     if (!strcmp(config->sourcetype, "")) setting_empty("sourcetype");
     if (!strcmp(config->log_file, ""))   setting_empty("log_file");
+
+    if (config->sflow_port == config->bind_port) {
+        setting_error("sflow_port, the same as bind_port", "");
+    }
+
+    /* In raw mode the sourcetype is given once for the whole request */
+    if (strcmp(config->sflow_counter_sourcetype, "") && config->hec_mode == HEC_MODE_RAW) {
+        setting_error("sflow_counter_sourcetype with hec_mode = raw",
+                      config->sflow_counter_sourcetype);
+    }
+
+    record_format format;
+    if (compile_output_fields(&format, config->output_fields) < 0) {
+        setting_error("output_fields", config->output_fields);
+    }
+
     if (config->num_servers < 0) {
         setting_empty("hec_server and hec_token");
     }
@@ -381,6 +467,65 @@ static void verify_configuration(freeflow_config* config) {
     }
 }
 
+/*
+ * Function: url_encode
+ *
+ * Write a string percent-encoded for use in a URL query, leaving only
+ * the unreserved characters as they are.
+ *
+ * Inputs:   char* cursor    Position in the output string to write to
+ *           char* value     String to encode
+ *
+ * Returns:  <position after the last character written>
+ */
+static char* url_encode(char* cursor, char* value) {
+    static const char hex[] = "0123456789ABCDEF";
+
+    for (; *value; value++) {
+        unsigned char c = *value;
+        if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+            *cursor++ = c;
+        }
+        else {
+            *cursor++ = '%';
+            *cursor++ = hex[c >> 4];
+            *cursor++ = hex[c & 0xf];
+        }
+    }
+    *cursor = '\0';
+    return cursor;
+}
+
+/*
+ * Function: build_hec_path
+ *
+ * Build the path events are posted to, once the configuration has been
+ * read.  In raw mode the events carry no metadata of their own, so the
+ * sourcetype, and the host and index if set, go in the query string.
+ *
+ * Inputs:   freeflow_config* config    Pointer to configuration object
+ *
+ * Returns:  None
+ */
+static void build_hec_path(freeflow_config* config) {
+    if (config->hec_mode == HEC_MODE_EVENT) {
+        strcpy(config->hec_path, "/services/collector");
+        return;
+    }
+
+    char* cursor = config->hec_path;
+    cursor += sprintf(cursor, "/services/collector/raw?sourcetype=");
+    cursor = url_encode(cursor, config->sourcetype);
+    if (strcmp(config->hec_host, "")) {
+        cursor += sprintf(cursor, "&host=");
+        cursor = url_encode(cursor, config->hec_host);
+    }
+    if (strcmp(config->hec_index, "")) {
+        cursor += sprintf(cursor, "&index=");
+        cursor = url_encode(cursor, config->hec_index);
+    }
+}
+
 /*
  * Function: read_configuration
  *
@@ -421,15 +566,99 @@ void read_configuration(freeflow_config* config) {
             else if (!strcmp(key, "bind_port")) {
                 handle_port_setting(&config->bind_port, value, key);
             }
+            else if (!strcmp(key, "sflow_port")) {
+                handle_int_setting(&config->sflow_port, value, key, 0, 65535);
+            }
             else if (!strcmp(key, "threads")) {
                 handle_int_setting(&config->threads, value, key, 1, 64);
             }
+            else if (!strcmp(key, "receivers")) {
+                handle_int_setting(&config->receivers, value, key, 1, 64);
+            }
+            else if (!strcmp(key, "receiver_steering")) {
+                handle_int_setting(&config->receiver_steering, value, key, 0, 1);
+            }
             else if (!strcmp(key, "queue_size")) {
                 handle_int_setting(&config->queue_size, value, key, 1, 0);
             }
+            else if (!strcmp(key, "queue_type")) {
+                handle_choice_setting(&config->queue_type, value, key, queue_types);
+            }
+            else if (!strcmp(key, "queue_hugepages")) {
+                handle_int_setting(&config->queue_hugepages, value, key, 0, 1);
+            }
+            else if (!strcmp(key, "receive_batch_size")) {
+                handle_int_setting(&config->receive_batch_size, value, key, 1, 1024);
+            }
+            else if (!strcmp(key, "receive_batch_timeout")) {
+                handle_int_setting(&config->receive_batch_timeout, value, key, 0, 1000);
+            }
+            else if (!strcmp(key, "overload_policy")) {
+                handle_choice_setting(&config->overload_policy, value, key, overload_policies);
+            }
+            else if (!strcmp(key, "stats_interval")) {
+                handle_int_setting(&config->stats_interval, value, key, 0, 86400);
+            }
+            else if (!strcmp(key, "hec_batch_size")) {
+                handle_int_setting(&config->hec_batch_size, value, key, 1024, 67108864);
+            }
+            else if (!strcmp(key, "hec_batch_events")) {
+                handle_int_setting(&config->hec_batch_events, value, key, 1, 1000000);
+            }
+            else if (!strcmp(key, "hec_batch_linger")) {
+                handle_int_setting(&config->hec_batch_linger, value, key, 0, 10000);
+            }
+            else if (!strcmp(key, "hec_mode")) {
+                handle_choice_setting(&config->hec_mode, value, key, hec_modes);
+            }
+            else if (!strcmp(key, "hec_gzip_level")) {
+                handle_int_setting(&config->hec_gzip_level, value, key, 0, 9);
+            }
+            else if (!strcmp(key, "hec_connections")) {
+                handle_int_setting(&config->hec_connections, value, key, 1, 64);
+            }
+            else if (!strcmp(key, "hec_pipeline")) {
+                handle_int_setting(&config->hec_pipeline, value, key, 1, 64);
+            }
+            else if (!strcmp(key, "hec_ack")) {
+                handle_int_setting(&config->hec_ack, value, key, 0, 1);
+            }
+            else if (!strcmp(key, "hec_ack_window")) {
+                handle_int_setting(&config->hec_ack_window, value, key, 1, 128);
+            }
+            else if (!strcmp(key, "hec_ack_interval")) {
+                handle_int_setting(&config->hec_ack_interval, value, key, 10, 60000);
+            }
+            else if (!strcmp(key, "hec_ack_timeout")) {
+                handle_int_setting(&config->hec_ack_timeout, value, key, 1, 86400);
+            }
+            else if (!strcmp(key, "hec_host")) {
+                if (strlen(value) >= HOSTNAME_SIZE) {
+                    setting_error(key, value);
+                }
+                strcpy(config->hec_host, value);
+            }
+            else if (!strcmp(key, "hec_index")) {
+                if (strlen(value) >= HEC_INDEX_SIZE) {
+                    setting_error(key, value);
+                }
+                strcpy(config->hec_index, value);
+            }
             else if (!strcmp(key, "sourcetype")) {
+                if (strlen(value) >= SOURCETYPE_SIZE) {
+                    setting_error(key, value);
+                }
                 strcpy(config->sourcetype, value);
             }
+            else if (!strcmp(key, "sflow_counter_sourcetype")) {
+                if (strlen(value) >= SOURCETYPE_SIZE) {
+                    setting_error(key, value);
+                }
+                strcpy(config->sflow_counter_sourcetype, value);
+            }
+            else if (!strcmp(key, "output_fields")) {
+                strcpy(config->output_fields, value);
+            }
             else if (!strcmp(key, "hec_server")) {
                 handle_hec_servers(config, value);
             }
@@ -442,9 +671,25 @@ void read_configuration(freeflow_config* config) {
             else if (!strcmp(key, "ssl_enabled")) {
                 handle_int_setting(&config->ssl_enabled, value, key, 0, 1);
             }
+            else if (!strcmp(key, "ssl_ktls")) {
+                handle_int_setting(&config->ssl_ktls, value, key, 0, 1);
+            }
+            else if (!strcmp(key, "spool_dir")) {
+                if (strlen(value) >= SPOOL_DIR_SIZE) {
+                    setting_error(key, value);
+                }
+                strcpy(config->spool_dir, value);
+            }
+            else if (!strcmp(key, "spool_max_size")) {
+                handle_int_setting(&config->spool_max_size, value, key, 16, 1048576);
+            }
+            else if (!strcmp(key, "spool_replay_rate")) {
+                handle_int_setting(&config->spool_replay_rate, value, key, 0, 10000000);
+            }
         }
     }
     verify_configuration(config);
+    build_hec_path(config);
     fclose(c);
 }
 
@@ -0,0 +1,224 @@
+#include <string.h>      /* Provides: memcpy */
+#include <arpa/inet.h>   /* Provides: ntohl */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>   /* Provides: _mm_shuffle_epi8, _mm256_mask_i32gather_epi32 */
+#define DECODE_X86
+#endif
+#include "decode.h"
+
+/* Every field of a NetFlow v5 record is a 32 bit word, or packed into
+ * one with its neighbours, so a record is decoded by reversing the bytes
+ * of each of its 12 words and splitting the packed ones. */
+#define RECORD_WORDS  12
+
+typedef void (*record_decoder)(unsigned char* records, int num_records,
+                               netflow_columns* columns);
+
+static void store_record(uint32_t* words, int i, netflow_columns* columns);
+static void decode_scalar(unsigned char* records, int num_records, netflow_columns* columns);
+#ifdef DECODE_X86
+static void decode_ssse3(unsigned char* records, int num_records, netflow_columns* columns);
+static void decode_avx2(unsigned char* records, int num_records, netflow_columns* columns);
+#endif
+
+/* Chosen once, in the main process, for the CPU it runs on */
+static record_decoder decoder = decode_scalar;
+
+/*
+ * Function: store_record
+ *
+ * Split the words of a record, already in host order, into its fields.
+ *
+ * Inputs:   uint32_t*         words     RECORD_WORDS words of the record
+ *           int               i         Index of the record in the packet
+ *           netflow_columns*  columns   Columns to store the fields in
+ *
+ * Returns:  None
+ */
+static void store_record(uint32_t* words, int i, netflow_columns* columns) {
+    columns->srcaddr[i]   = words[0];
+    columns->dstaddr[i]   = words[1];
+    columns->nexthop[i]   = words[2];
+    columns->input[i]     = words[3] >> 16;
+    columns->output[i]    = words[3] & 0xffff;
+    columns->packets[i]   = words[4];
+    columns->bytes[i]     = words[5];
+    columns->first[i]     = words[6];
+    columns->last[i]      = words[7];
+    columns->srcport[i]   = words[8] >> 16;
+    columns->dstport[i]   = words[8] & 0xffff;
+    columns->tcp_flags[i] = (words[9] >> 16) & 0xff;
+    columns->prot[i]      = (words[9] >> 8) & 0xff;
+    columns->tos[i]       = words[9] & 0xff;
+    columns->src_as[i]    = words[10] >> 16;
+    columns->dst_as[i]    = words[10] & 0xffff;
+    columns->src_mask[i]  = words[11] >> 24;
+    columns->dst_mask[i]  = (words[11] >> 16) & 0xff;
+}
+
+/*
+ * Function: decode_scalar
+ *
+ * Decode records one word at a time, on any CPU.
+ *
+ * Inputs:   unsigned char*    records       First record of the packet
+ *           int               num_records   Number of records
+ *           netflow_columns*  columns       Columns to store the fields in
+ *
+ * Returns:  None
+ */
+static void decode_scalar(unsigned char* records, int num_records, netflow_columns* columns) {
+    uint32_t words[RECORD_WORDS];
+    int i, j;
+
+    for (i = 0; i < num_records; i++) {
+        memcpy(words, records + i * sizeof(netflow_record), sizeof(words));
+        for (j = 0; j < RECORD_WORDS; j++) {
+            words[j] = ntohl(words[j]);
+        }
+        store_record(words, i, columns);
+    }
+}
+
+#ifdef DECODE_X86
+/*
+ * Function: decode_ssse3
+ *
+ * Decode records with a byte shuffle that reverses four words at once,
+ * so each record takes three shuffles.
+ *
+ * Inputs:   unsigned char*    records       First record of the packet
+ *           int               num_records   Number of records
+ *           netflow_columns*  columns       Columns to store the fields in
+ *
+ * Returns:  None
+ */
+__attribute__((target("ssse3")))
+static void decode_ssse3(unsigned char* records, int num_records, netflow_columns* columns) {
+    const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    uint32_t words[RECORD_WORDS];
+    int i, j;
+
+    for (i = 0; i < num_records; i++) {
+        unsigned char* record = records + i * sizeof(netflow_record);
+        for (j = 0; j < RECORD_WORDS / 4; j++) {
+            __m128i v = _mm_loadu_si128((__m128i*)(record + j * 16));
+            _mm_storeu_si128((__m128i*)(words + j * 4), _mm_shuffle_epi8(v, swap));
+        }
+        store_record(words, i, columns);
+    }
+}
+
+/*
+ * Function: decode_avx2
+ *
+ * Decode eight records at a time, straight into the columns.  Each word
+ * of the eight records is gathered into one vector, its bytes reversed
+ * with a shuffle, and split into its fields with shifts and masks.  The
+ * gather for the last few records is masked, so nothing past the last
+ * record is read.  The columns have room for whole vectors.
+ *
+ * Inputs:   unsigned char*    records       First record of the packet
+ *           int               num_records   Number of records
+ *           netflow_columns*  columns       Columns to store the fields in
+ *
+ * Returns:  None
+ */
+__attribute__((target("avx2")))
+static void decode_avx2(unsigned char* records, int num_records, netflow_columns* columns) {
+    const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i stride = _mm256_setr_epi32(0, 12, 24, 36, 48, 60, 72, 84);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i low16 = _mm256_set1_epi32(0xffff);
+    const __m256i low8 = _mm256_set1_epi32(0xff);
+    __m256i w[RECORD_WORDS];
+    int i, j;
+
+#define STORE(column, value) _mm256_storeu_si256((__m256i*)(columns->column + i), (value))
+
+    for (i = 0; i < num_records; i += 8) {
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(num_records - i), lanes);
+        int* base = (int*)(records + i * sizeof(netflow_record));
+
+        for (j = 0; j < RECORD_WORDS; j++) {
+            w[j] = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), base + j, stride, mask, 4);
+            w[j] = _mm256_shuffle_epi8(w[j], swap);
+        }
+
+        STORE(srcaddr,   w[0]);
+        STORE(dstaddr,   w[1]);
+        STORE(nexthop,   w[2]);
+        STORE(input,     _mm256_srli_epi32(w[3], 16));
+        STORE(output,    _mm256_and_si256(w[3], low16));
+        STORE(packets,   w[4]);
+        STORE(bytes,     w[5]);
+        STORE(first,     w[6]);
+        STORE(last,      w[7]);
+        STORE(srcport,   _mm256_srli_epi32(w[8], 16));
+        STORE(dstport,   _mm256_and_si256(w[8], low16));
+        STORE(tcp_flags, _mm256_and_si256(_mm256_srli_epi32(w[9], 16), low8));
+        STORE(prot,      _mm256_and_si256(_mm256_srli_epi32(w[9], 8), low8));
+        STORE(tos,       _mm256_and_si256(w[9], low8));
+        STORE(src_as,    _mm256_srli_epi32(w[10], 16));
+        STORE(dst_as,    _mm256_and_si256(w[10], low16));
+        STORE(src_mask,  _mm256_srli_epi32(w[11], 24));
+        STORE(dst_mask,  _mm256_and_si256(_mm256_srli_epi32(w[11], 16), low8));
+    }
+
+#undef STORE
+}
+#endif
+
+/*
+ * Function: select_decoder
+ *
+ * Pick the fastest way of decoding records the CPU supports.  Called in
+ * the main process before the workers are forked, so they all inherit
+ * the choice.
+ *
+ * Inputs:   None
+ *
+ * Returns:  <name of the decoder chosen>
+ */
+char* select_decoder() {
+#ifdef DECODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        decoder = decode_avx2;
+        return "AVX2";
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        decoder = decode_ssse3;
+        return "SSSE3";
+    }
+#endif
+    decoder = decode_scalar;
+    return "scalar";
+}
+
+/*
+ * Function: decode_netflow_records
+ *
+ * Decode the header and records of a validated NetFlow v5 packet into
+ * host order columns.
+ *
+ * Inputs:   packet_buffer*    packet        Packet containing the records
+ *           int               num_records   Number of records in the packet
+ *           netflow_columns*  columns       Columns to store the fields in
+ *
+ * Returns:  None
+ */
+void decode_netflow_records(packet_buffer* packet, int num_records, netflow_columns* columns) {
+    netflow_header* h = (netflow_header*)packet->packet;
+
+    if (num_records > NETFLOW_V5_MAX_RECORDS) {
+        num_records = NETFLOW_V5_MAX_RECORDS;
+    }
+    columns->num_records = num_records;
+    columns->sys_uptime = ntohl(h->sys_uptime);
+    columns->unix_secs = ntohl(h->unix_secs);
+    columns->unix_nsecs = ntohl(h->unix_nsecs);
+
+    decoder((unsigned char*)packet->packet + sizeof(netflow_header), num_records, columns);
+}
@@ -0,0 +1,518 @@
+#include <stdio.h>       /* Provides: sprintf */
+#include <string.h>      /* Provides: memcpy, strlen, strcspn, strncmp */
+#include <arpa/inet.h>   /* Provides: inet_addr, ntohs, ntohl, htonl */
+#include "format.h"
+#include "netflow.h"
+#include "decode.h"
+
+/* Two character decimal representations of 0 through 99, so numbers can
+ * be emitted two digits per division. */
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/* A field output_fields can name, the emitter that writes it, and the
+ * most characters it can take.  Fields of 32 bits or less are allowed
+ * ten digits: v5 sign extends its 16 bit fields, and sFlow carries 8 bit
+ * ones in 32 bit words. */
+typedef struct output_field {
+    char* name;
+    uint8_t code;
+    uint8_t field;
+    int width;
+} output_field;
+
+static const output_field output_field_table[] = {
+    { "exporter",    OUTPUT_EXPORTER,  0,              IPV4_ADDR_SIZE - 1 },
+    { "srcaddr",     OUTPUT_IPV4,      FLOW_SRCADDR,   IPV4_ADDR_SIZE - 1 },
+    { "dstaddr",     OUTPUT_IPV4,      FLOW_DSTADDR,   IPV4_ADDR_SIZE - 1 },
+    { "nexthop",     OUTPUT_IPV4,      FLOW_NEXTHOP,   IPV4_ADDR_SIZE - 1 },
+    { "input",       OUTPUT_UINT,      FLOW_INPUT,     10 },
+    { "output",      OUTPUT_UINT,      FLOW_OUTPUT,    10 },
+    { "packets",     OUTPUT_UINT,      FLOW_PACKETS,   20 },
+    { "bytes",       OUTPUT_UINT,      FLOW_BYTES,     20 },
+    { "duration",    OUTPUT_DURATION,  0,              20 },
+    { "srcport",     OUTPUT_UINT,      FLOW_SRCPORT,   10 },
+    { "dstport",     OUTPUT_UINT,      FLOW_DSTPORT,   10 },
+    { "tcp_flags",   OUTPUT_UINT,      FLOW_TCP_FLAGS, 10 },
+    { "prot",        OUTPUT_UINT,      FLOW_PROT,      10 },
+    { "tos",         OUTPUT_UINT,      FLOW_TOS,       10 },
+    { "src_as",      OUTPUT_UINT,      FLOW_SRC_AS,    10 },
+    { "dst_as",      OUTPUT_UINT,      FLOW_DST_AS,    10 },
+    { "src_mask",    OUTPUT_UINT,      FLOW_SRC_MASK,  10 },
+    { "dst_mask",    OUTPUT_UINT,      FLOW_DST_MASK,  10 },
+    { "direction",   OUTPUT_DIRECTION, 0,              8 },
+    { "input_name",  OUTPUT_IFNAME,    FLOW_INPUT,     INTERFACE_NAME_SIZE - 1 },
+    { "output_name", OUTPUT_IFNAME,    FLOW_OUTPUT,    INTERFACE_NAME_SIZE - 1 },
+    { NULL,          0,                0,              0 }
+};
+
+static char* format_octet(char* cursor, unsigned int octet);
+static char* format_micros(char* cursor, uint32_t micros);
+static char* format_template_records(char* cursor, record_format* format,
+                                     packet_buffer* packet, template_program* program,
+                                     unsigned char* records, unsigned char* end,
+                                     export_info* info, int* num_records);
+
+/*
+ * Function: init_record_format
+ *
+ * Build the constant fragments shared by every record a worker formats,
+ * for the configured HEC mode, and compile the output fields.
+ *
+ * Inputs:   record_format*    format   Record format object to initialize
+ *           freeflow_config*  config   Pointer to configuration object
+ *
+ * Returns:  None
+ */
+void init_record_format(record_format* format, freeflow_config* config) {
+    if (config->hec_mode == HEC_MODE_RAW) {
+        strcpy(format->head, "");
+        strcpy(format->tail, ",");
+        strcpy(format->close, "\n");
+    }
+    else {
+        strcpy(format->head, "{\"event\": \"");
+        sprintf(format->tail, "\", \"sourcetype\": \"%s\", \"time\": \"", config->sourcetype);
+        strcpy(format->close, "\"}");
+    }
+
+    format->head_len = strlen(format->head);
+    format->tail_len = strlen(format->tail);
+    format->close_len = strlen(format->close);
+
+    /* The field list was checked when the configuration was read */
+    format->record_max =   format->head_len + format->tail_len + TIME_MAX_SIZE
+                         + format->close_len
+                         + compile_output_fields(format, config->output_fields);
+
+    /* sFlow counter samples are only sent in event mode, where each event
+     * can have a sourcetype of its own */
+    strcpy(format->counter_tail, "");
+    if (config->hec_mode == HEC_MODE_EVENT && strcmp(config->sflow_counter_sourcetype, "")) {
+        sprintf(format->counter_tail, "\", \"sourcetype\": \"%s\", \"time\": \"",
+                                      config->sflow_counter_sourcetype);
+        int sourcetype_len = strlen(config->sflow_counter_sourcetype);
+        if (COUNTER_MAX_SIZE + sourcetype_len > format->record_max) {
+            format->record_max = COUNTER_MAX_SIZE + sourcetype_len;
+        }
+    }
+    format->counter_tail_len = strlen(format->counter_tail);
+}
+
+/*
+ * Function: compile_output_fields
+ *
+ * Compile a comma separated list of output fields into the program flow
+ * events are written with, one op per field in the order listed.
+ *
+ * Inputs:   record_format*  format   Record format to hold the program
+ *           char*           fields   List of output fields
+ *
+ * Returns:  <most characters the fields can take, with their separators>   Success
+ *           -1    A field isn't known, or there are more than OUTPUT_MAX_FIELDS
+ */
+int compile_output_fields(record_format* format, char* fields) {
+    char* name = fields;
+    int width = 0;
+
+    format->num_ops = 0;
+    while (1) {
+        int name_len = strcspn(name, ",");
+        const output_field* field = output_field_table;
+
+        while (field->name && (strncmp(field->name, name, name_len) ||
+                               field->name[name_len] != '\0')) {
+            field++;
+        }
+        if (!field->name || format->num_ops == OUTPUT_MAX_FIELDS) {
+            return -1;
+        }
+
+        format->ops[format->num_ops].code = field->code;
+        format->ops[format->num_ops].field = field->field;
+        format->num_ops++;
+        width += field->width + 1;
+
+        if (name[name_len] == '\0') {
+            return width;
+        }
+        name += name_len + 1;
+    }
+}
+
+/*
+ * Function: format_uint
+ *
+ * Write the decimal representation of an unsigned integer, two digits at
+ * a time from the digit pair table.
+ *
+ * Inputs:   char*     cursor   Position in the output buffer to write to
+ *           uint64_t  value    Value to write
+ *
+ * Returns:  <position after the last character written>
+ */
+char* format_uint(char* cursor, uint64_t value) {
+    char digits[20];
+    char* start = digits + sizeof(digits);
+
+    while (value >= 100) {
+        unsigned int pair = (value % 100) * 2;
+        value /= 100;
+        start -= 2;
+        start[0] = digit_pairs[pair];
+        start[1] = digit_pairs[pair + 1];
+    }
+    if (value >= 10) {
+        start -= 2;
+        start[0] = digit_pairs[value * 2];
+        start[1] = digit_pairs[value * 2 + 1];
+    }
+    else {
+        *--start = '0' + value;
+    }
+
+    int len = digits + sizeof(digits) - start;
+    memcpy(cursor, start, len);
+    return cursor + len;
+}
+
+/*
+ * Function: format_octet
+ *
+ * Write the decimal representation of a single address octet.
+ *
+ * Inputs:   char*         cursor   Position in the output buffer to write to
+ *           unsigned int  octet    Octet to write
+ *
+ * Returns:  <position after the last character written>
+ */
+static char* format_octet(char* cursor, unsigned int octet) {
+    if (octet >= 100) {
+        *cursor++ = '0' + octet / 100;
+        octet %= 100;
+        *cursor++ = digit_pairs[octet * 2];
+    }
+    else if (octet >= 10) {
+        *cursor++ = digit_pairs[octet * 2];
+    }
+    *cursor++ = digit_pairs[octet * 2 + 1];
+    return cursor;
+}
+
+/*
+ * Function: format_ipv4
+ *
+ * Write an IPv4 address in dotted quad notation, the same as inet_ntoa.
+ *
+ * Inputs:   char*     cursor   Position in the output buffer to write to
+ *           uint32_t  addr     Address, in network byte order
+ *
+ * Returns:  <position after the last character written>
+ */
+char* format_ipv4(char* cursor, uint32_t addr) {
+    unsigned char* octets = (unsigned char*)&addr;
+
+    cursor = format_octet(cursor, octets[0]);
+    *cursor++ = '.';
+    cursor = format_octet(cursor, octets[1]);
+    *cursor++ = '.';
+    cursor = format_octet(cursor, octets[2]);
+    *cursor++ = '.';
+    return format_octet(cursor, octets[3]);
+}
+
+/*
+ * Function: format_micros
+ *
+ * Write a number of microseconds as exactly six digits.
+ *
+ * Inputs:   char*     cursor   Position in the output buffer to write to
+ *           uint32_t  micros   Microseconds, less than 1000000
+ *
+ * Returns:  <position after the last character written>
+ */
+static char* format_micros(char* cursor, uint32_t micros) {
+    int i;
+    for (i = 4; i >= 0; i -= 2) {
+        unsigned int pair = (micros % 100) * 2;
+        micros /= 100;
+        cursor[i] = digit_pairs[pair];
+        cursor[i + 1] = digit_pairs[pair + 1];
+    }
+    return cursor + 6;
+}
+
+/*
+ * Function: format_time
+ *
+ * Write a timestamp given in microseconds as seconds with six decimal
+ * places.
+ *
+ * Inputs:   char*    cursor   Position in the output buffer to write to
+ *           int64_t  micros   Timestamp to write, in microseconds
+ *
+ * Returns:  <position after the last character written>
+ */
+char* format_time(char* cursor, int64_t micros) {
+    uint64_t magnitude = micros;
+    if (micros < 0) {
+        *cursor++ = '-';
+        magnitude = -(uint64_t)micros;
+    }
+
+    cursor = format_uint(cursor, magnitude / 1000000);
+    *cursor++ = '.';
+    return format_micros(cursor, magnitude % 1000000);
+}
+
+/*
+ * Function: format_flow
+ *
+ * Write a HEC event for a decoded flow, running the program compiled
+ * from output_fields to write its fields.  Fields are printed as the
+ * unsigned values they are.  A flow's direction is a request if it is
+ * to a lower port than it is from, or a response if it is from the
+ * lower port, and is left empty if the ports are the same.  Interface
+ * names are only known for exporters that send them in options records,
+ * and are left empty without 'info'.
+ *
+ * Inputs:   char*           cursor       Position in the output buffer to write to
+ *           record_format*  format       Constant record fragments
+ *           char*           sender       Address of the exporter
+ *           int             sender_len   Length of the address
+ *           export_info*    info         Exporter the flow came from, or NULL
+ *           uint64_t*       flow         FLOW_FIELDS decoded values
+ *           int64_t         time         Time of the flow, in microseconds
+ *
+ * Returns:  <position after the last character written>
+ */
+char* format_flow(char* cursor, record_format* format, char* sender, int sender_len,
+                  export_info* info, uint64_t* flow, int64_t time) {
+    output_op* op = format->ops;
+    output_op* end = op + format->num_ops;
+
+    memcpy(cursor, format->head, format->head_len);
+    cursor += format->head_len;
+
+    for (; op < end; op++) {
+        switch (op->code) {
+            case OUTPUT_EXPORTER:
+                memcpy(cursor, sender, sender_len);
+                cursor += sender_len;
+                break;
+            case OUTPUT_IPV4:
+                cursor = format_ipv4(cursor, htonl(flow[op->field]));
+                break;
+            case OUTPUT_UINT:
+                cursor = format_uint(cursor, flow[op->field]);
+                break;
+            case OUTPUT_DURATION:
+                cursor = format_uint(cursor, (uint64_t)((int64_t)flow[FLOW_LAST] -
+                                                        (int64_t)flow[FLOW_FIRST]));
+                break;
+            case OUTPUT_DIRECTION:
+                if (flow[FLOW_SRCPORT] > flow[FLOW_DSTPORT]) {
+                    memcpy(cursor, "request", 7);
+                    cursor += 7;
+                }
+                else if (flow[FLOW_SRCPORT] < flow[FLOW_DSTPORT]) {
+                    memcpy(cursor, "response", 8);
+                    cursor += 8;
+                }
+                break;
+            case OUTPUT_IFNAME:
+                if (info) {
+                    cursor += template_interface_name(info->exporter, info->domain,
+                                                      info->protocol, flow[op->field], cursor);
+                }
+                break;
+        }
+        *cursor++ = ',';
+    }
+
+    /* The tail takes the place of the last field's separator */
+    memcpy(cursor - 1, format->tail, format->tail_len);
+    cursor += format->tail_len - 1;
+    cursor = format_time(cursor, time);
+    memcpy(cursor, format->close, format->close_len);
+    return cursor + format->close_len;
+}
+
+/*
+ * Function: format_template_records
+ *
+ * Write a HEC event for each record of a data set, decoding each with the
+ * program compiled from its template, until the set or 'num_records' runs
+ * out.  Packet and byte counts are scaled up by the rate the flow was
+ * sampled at.  A flow's time is its start time, or the export time if its
+ * template has none, or it is an uptime and when that started isn't known.
+ * The output buffer must have room for 'record_max' bytes per record.
+ *
+ * Inputs:   char*              cursor        Position in the output buffer to write to
+ *           record_format*     format        Constant record fragments
+ *           packet_buffer*     packet        Packet containing the set
+ *           template_program*  program       Program compiled from the set's template
+ *           unsigned char*     records       First record of the set
+ *           unsigned char*     end           End of the set
+ *           export_info*       info          What the records are relative to
+ *           int*               num_records   Records left to write, reduced by those written
+ *
+ * Returns:  <position after the last character written>
+ */
+static char* format_template_records(char* cursor, record_format* format,
+                                     packet_buffer* packet, template_program* program,
+                                     unsigned char* records, unsigned char* end,
+                                     export_info* info, int* num_records) {
+    int sender_len = strlen(packet->sender);
+    uint64_t flow[FLOW_FIELDS];
+    int length;
+
+    if (program->options || program->record_len == 0) {
+        return cursor;
+    }
+
+    while (*num_records > 0 && end - records >= program->record_len &&
+           (length = template_record_length(program, records, end)) > 0) {
+        template_decode(program, records, flow);
+        records += length;
+        (*num_records)--;
+
+        uint64_t sampling = flow[FLOW_SAMPLING];
+        if (sampling && flow[FLOW_SAMPLE_SPACE]) {
+            sampling = (sampling + flow[FLOW_SAMPLE_SPACE]) / sampling;
+        }
+        if (!sampling) {
+            sampling = info->sampling;
+        }
+        if (sampling > 1) {
+            flow[FLOW_PACKETS] *= sampling;
+            flow[FLOW_BYTES] *= sampling;
+        }
+
+        int64_t time = info->export_time;
+        if (program->time_unit == TEMPLATE_TIME_UPTIME && info->boot_time >= 0) {
+            time = info->boot_time + (int64_t)flow[FLOW_FIRST] * 1000;
+        }
+        else if (program->time_unit == TEMPLATE_TIME_MILLIS ||
+                 program->time_unit == TEMPLATE_TIME_SECONDS) {
+            time = (int64_t)flow[FLOW_FIRST] * 1000;
+        }
+        cursor = format_flow(cursor, format, packet->sender, sender_len, info, flow, time);
+    }
+    return cursor;
+}
+
+/*
+ * Function: format_template_sets
+ *
+ * Write a HEC event for each record of the data sets in a prepared
+ * NetFlow v9 or IPFIX packet.  Options sets are skipped.  The output
+ * buffer must have room for 'record_max' bytes per record.
+ *
+ * Inputs:   char*           cursor        Position in the output buffer to write to
+ *           record_format*  format        Constant record fragments
+ *           packet_buffer*  packet        Packet containing the records
+ *           int             header_len    Length of the packet's header
+ *           uint32_t        domain        Source ID or observation domain of the packet
+ *           int             protocol      NetFlow version of the packet
+ *           export_info*    info          What the records are relative to
+ *           int             num_records   Number of records in the packet
+ *
+ * Returns:  <position after the last character written>
+ */
+char* format_template_sets(char* cursor, record_format* format, packet_buffer* packet,
+                           int header_len, uint32_t domain, int protocol, export_info* info,
+                           int num_records) {
+    uint32_t exporter = inet_addr(packet->sender);
+    int offset = header_len;
+
+    while (num_records > 0 && offset + (int)sizeof(flowset_header) <= packet->packet_len) {
+        flowset_header* set = (flowset_header*)(packet->packet + offset);
+        int id = ntohs(set->id);
+        int length = ntohs(set->length);
+        if (length < (int)sizeof(flowset_header) || offset + length > packet->packet_len) {
+            break;
+        }
+
+        template_program* program = NULL;
+        if (id >= NETFLOW9_MIN_DATA_SET) {
+            program = template_lookup(exporter, domain, id, protocol);
+        }
+        if (program) {
+            cursor = format_template_records(cursor, format, packet, program,
+                                             (unsigned char*)set + sizeof(flowset_header),
+                                             (unsigned char*)set + length, info, &num_records);
+        }
+        offset += length;
+    }
+    return cursor;
+}
+
+/*
+ * Function: format_netflow_records
+ *
+ * Write a HEC event for each record in a NetFlow v5 packet.  The packet
+ * must already have been validated.  Its records are decoded into host
+ * order columns in one pass first, and each is formatted from there like
+ * any other flow.  The output buffer must have room for 'record_max'
+ * bytes per record.
+ *
+ * Inputs:   char*           cursor        Position in the output buffer to write to
+ *           record_format*  format        Constant record fragments
+ *           packet_buffer*  packet        Packet containing the records
+ *           int             num_records   Number of records in the packet
+ *
+ * Returns:  <position after the last character written>
+ */
+char* format_netflow_records(char* cursor, record_format* format, packet_buffer* packet,
+                             int num_records) {
+    netflow_columns c;
+    uint64_t flow[FLOW_FIELDS];
+    int sender_len = strlen(packet->sender);
+
+    decode_netflow_records(packet, num_records, &c);
+
+    /* Export time, less the exporter's uptime, is when the exporter booted.
+     * Each record's start time is an uptime in ms, so adding it to the boot
+     * time in microseconds gives the time of the flow. */
+    int64_t boot_time =   (int64_t)c.unix_secs * 1000000
+                        + ((int64_t)c.unix_nsecs + 500) / 1000
+                        - (int64_t)c.sys_uptime * 1000;
+
+    /* 16 bit fields have always been printed through a signed short, so
+     * values of 32768 and up appear sign extended to 32 bits. */
+    int i;
+    for (i = 0; i < c.num_records; i++) {
+        flow[FLOW_SRCADDR]   = c.srcaddr[i];
+        flow[FLOW_DSTADDR]   = c.dstaddr[i];
+        flow[FLOW_NEXTHOP]   = c.nexthop[i];
+        flow[FLOW_INPUT]     = (uint32_t)(int16_t)c.input[i];
+        flow[FLOW_OUTPUT]    = (uint32_t)(int16_t)c.output[i];
+        flow[FLOW_PACKETS]   = c.packets[i];
+        flow[FLOW_BYTES]     = c.bytes[i];
+        flow[FLOW_FIRST]     = c.first[i];
+        flow[FLOW_LAST]      = c.last[i];
+        flow[FLOW_SRCPORT]   = (uint32_t)(int16_t)c.srcport[i];
+        flow[FLOW_DSTPORT]   = (uint32_t)(int16_t)c.dstport[i];
+        flow[FLOW_TCP_FLAGS] = c.tcp_flags[i];
+        flow[FLOW_PROT]      = c.prot[i];
+        flow[FLOW_TOS]       = c.tos[i];
+        flow[FLOW_SRC_AS]    = (uint32_t)(int16_t)c.src_as[i];
+        flow[FLOW_DST_AS]    = (uint32_t)(int16_t)c.dst_as[i];
+        flow[FLOW_SRC_MASK]  = c.src_mask[i];
+        flow[FLOW_DST_MASK]  = c.dst_mask[i];
+
+        cursor = format_flow(cursor, format, packet->sender, sender_len, NULL, flow,
+                             boot_time + (int64_t)c.first[i] * 1000);
+    }
+    return cursor;
+}
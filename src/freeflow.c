@@ -6,20 +6,25 @@
 #include <signal.h>      /* Provides: signal */
 #include <unistd.h>      /* Provides: close */
 #include <sys/wait.h>    /* Provides: waitpid */
-#include <sys/msg.h>     /* Provides: msgsnd */
 #include "freeflow.h"
 #include "netflow.h"
 #include "session.h"
 #include "queue.h"
+#include "transport.h"
+#include "template.h"
+#include "decode.h"
 #include "worker.h"
+#include "receiver.h"
 #include "logger.h"
 
 static int keep_listening = 1;
 
 static void handle_signal(int sig);
-static int receive_packets(int log_queue, freeflow_config *config);
-static void handle_signal(int sig);
-static void clean_up_processes(freeflow_config* config, pid_t workers[], pid_t logger_pid, int log_queue);
+static int receiver_count(freeflow_config* config);
+static void wait_for_signal();
+static pid_t fork_child();
+static void clean_up_processes(freeflow_config* config, pid_t receivers[], pid_t workers[],
+                               pid_t logger_pid, int log_queue);
 
 /*
  * Function: handle_signal
@@ -37,98 +42,111 @@ static void handle_signal(int sig) {
 }
 
 /*
- * Function: receive_packets
+ * Function: receiver_count
  *
- * Bind a receive UDP socket and continue pulling packets off the wire until
- * the program is terminated.  Packets are placed into an IPC message queue
- * for one of the worker processes to handle.
+ * Return the number of receiver processes: those sharing the NetFlow
+ * port, and one more for the sFlow port if it is set.
  *
- * Inputs:  int             log_queue    The signal being passed.
- *          freeflow_config *config      Pointer to the configuration object. 
- * 
- * Return:  0   Success
- *          -1  Couldn't bind to socket
- *          -2  Couldn't create IPC packet queue
+ * Inputs:  freeflow_config *config      Pointer to the configuration object
+ *
+ * Return:  <# of receiver processes>
  */
-static int receive_packets(int log_queue, freeflow_config *config) {
-    char log_message[LOG_MESSAGE_SIZE];
-    char error_message[LOG_MESSAGE_SIZE];
-    char packet[PACKET_BUFFER_SIZE];
+static int receiver_count(freeflow_config* config) {
+    return config->receivers + (config->sflow_port > 0);
+}
 
-    int socket_id;
-    if ((socket_id = bind_socket(config, log_queue)) < 0) {
-        sprintf(log_message, "bind_socket returned error: %d.", socket_id);
-        log_error(log_message, log_queue);
-        return -1;
-    }
-        
-    int packet_queue = create_queue(config->config_file, PACKET_QUEUE, error_message, 0);
-    if (packet_queue < 0) {
-        sprintf(log_message, "Unable to create IPC queue for packets: %s.", error_message);        
-        log_error(log_message, log_queue);
-        return -2;
-    }
-    else if (config->debug) {
-        sprintf(log_message, "Created IPC queue [%d] for packets.", packet_queue);        
-        log_debug(log_message, log_queue);
+/*
+ * Function: wait_for_signal
+ *
+ * Suspend the main process until SIGINT or SIGTERM toggles the
+ * 'keep_listening' variable.  The signals are blocked outside of
+ * sigsuspend so one arriving between the check and the wait isn't lost.
+ *
+ * Inputs:  None
+ *
+ * Return:  None
+ */
+static void wait_for_signal() {
+    sigset_t block_mask, wait_mask;
+
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGTERM);
+    sigaddset(&block_mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &block_mask, &wait_mask);
+
+    while (keep_listening) {
+        sigsuspend(&wait_mask);
     }
+    sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+}
 
-    struct sockaddr_in sender;
-    socklen_t socket_len = sizeof(sender);
+/*
+ * Function: fork_child
+ *
+ * Fork a child process with the default SIGTERM and SIGINT dispositions,
+ * rather than the main process's handler.  A child signalled to stop
+ * before it has installed its own handlers then simply exits, instead of
+ * setting a flag nothing in it reads.
+ *
+ * Inputs:  None
+ *
+ * Return:  <child PID>   In the main process
+ *          0             In the child process
+ *          -1            Couldn't fork
+ */
+static pid_t fork_child() {
+    sigset_t block_mask, old_mask;
 
-    packet_buffer message;
-    message.mtype = 2;
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGTERM);
+    sigaddset(&block_mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &block_mask, &old_mask);
 
-    /* Continue receiving packets until signalled to stop */
-    while(keep_listening) {
-        int bytes_recv;
-        bytes_recv = recvfrom(socket_id, packet, PACKET_BUFFER_SIZE, 0, (struct sockaddr*)&sender, &socket_len);
-        if (bytes_recv > 0) {
-            if (config->debug) {
-                char s[IPV4_ADDR_SIZE];
-                strcpy(s, inet_ntoa(sender.sin_addr));
-                sprintf(log_message, "Netflow packet received from %s.", s);
-                log_debug(log_message, log_queue);
-            }
-            message.packet_len = bytes_recv;
-            strcpy(message.sender, inet_ntoa(sender.sin_addr));
-            memcpy(message.packet, packet, bytes_recv);
-            if (msgsnd(packet_queue, &message, sizeof(packet_buffer), 0)) {
-                strcpy(log_message, "Unable to queue packet for processing.");
-                log_warning(log_message, log_queue);
-            }
-            else if (config->debug) {
-                sprintf(log_message, "Packet sent to packet queue [%d].", packet_queue);
-                log_debug(log_message, log_queue);
-            }
-        }
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
     }
 
-    close(socket_id);
-    delete_queue(packet_queue);
-    return 0;
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return pid;
 }
 
 /*
  * Function: clean_up_processes
  *
- * Iterate through all working and logging processes, terminate them and 
- * wait for them to exit gracefully.
+ * Iterate through all receiving, working and logging processes, terminate
+ * them and wait for them to exit gracefully.  Receivers are stopped first
+ * so no new packets are queued while the workers shut down.
  *
  * Inputs:  freeflow_config *config      Pointer to the configuration object. 
+ *          pid_t           receivers[]  Array of receiver process PIDs
  *          pid_t           workers[]    Array of worker process PIDs
  *          pit_t           logger_pid   PID of the loggere process
  *          int             log_queue    Id of the IPC logging queue
  * 
  * Return:  None
  */
-static void clean_up_processes(freeflow_config* config, pid_t workers[], 
+static void clean_up_processes(freeflow_config* config, pid_t receivers[], pid_t workers[],
                                pid_t logger_pid, int log_queue) {
 
     char log_message[LOG_MESSAGE_SIZE];
 
     int i, status;
+    for (i = 0; i < receiver_count(config); ++i) {
+        if (receivers[i] <= 0) {
+            continue;
+        }
+        sprintf(log_message, "Terminating receiver #%d [PID %d].", i, receivers[i]);
+        log_info(log_message, log_queue);
+        kill(receivers[i], SIGTERM);
+        waitpid(receivers[i], &status, 0);
+    }
+
     for (i = 0; i < config->threads; ++i) {
+        if (workers[i] <= 0) {
+            continue;
+        }
         sprintf(log_message, "Terminating Splunk worker #%d [PID %d].", i, workers[i]);
         log_info(log_message, log_queue);
         kill(workers[i], SIGTERM);
@@ -146,11 +164,16 @@ static void clean_up_processes(freeflow_config* config, pid_t workers[],
  *
  * Initialize the program by reading and processing the command line arguments 
  * and the program configuration file.  Fork additional processes to handle 
- * logging and packet processing/transmission to Splunk.  The main process 
- * will handle send and receive functions for the Netflow UDP socket.
+ * logging, packet processing/transmission to Splunk and receiving packets
+ * from the Netflow UDP socket(s).  The main process binds one socket per
+ * receiver so they share the port, then waits to be signalled to stop.
  * 
  * Return:  0   Success
  * Return:  -1  Unable to create IPC log queue
+ * Return:  -2  Unable to create packet queue
+ * Return:  -3  Unable to bind a receive socket
+ * Return:  -4  Unable to create SSL context
+ * Return:  -5  Unable to create template cache
  */
 int main(int argc, char** argv) {
     signal(SIGTERM, handle_signal);
@@ -176,21 +199,111 @@ int main(int argc, char** argv) {
     }
 
     pid_t logger_pid;
-    if ((logger_pid = fork()) == 0) {
+    if ((logger_pid = fork_child()) == 0) {
         start_logger(config.log_file, log_queue);
         exit(0);
     }
 
     int workers[config.threads];
+    int num_receivers = receiver_count(&config);
+    int receivers[num_receivers];
+    int sockets[num_receivers];
+    memset(workers, 0, sizeof(workers));
+    memset(receivers, 0, sizeof(receivers));
+
+    packet_transport transport;
+    if (create_transport(&transport, &config, error_message) < 0) {
+        sprintf(log_message, "Unable to create packet queue: %s.", error_message);        
+        log_error(log_message, log_queue);
+        clean_up_processes(&config, receivers, workers, logger_pid, log_queue);
+        return -2;
+    }
+    else if (config.debug) {
+        sprintf(log_message, "Created packet queue using %s transport.", transport.ops->name);        
+        log_debug(log_message, log_queue);
+    }
+
+    if (transport.ring && config.queue_hugepages && !transport.ring->hugepages) {
+        log_warning("Unable to map hugepages for the packet queue, using normal pages.", log_queue);
+    }
+
+    /* Created once, so every worker's connections share it */
+    if (config.ssl_enabled) {
+        if (create_ssl_context(&config, error_message) < 0) {
+            sprintf(log_message, "Unable to create SSL context: %.200s.", error_message);
+            log_error(log_message, log_queue);
+            clean_up_processes(&config, receivers, workers, logger_pid, log_queue);
+            delete_transport(&transport);
+            return -4;
+        }
+        else if (config.debug) {
+            log_debug("Created SSL context for TLS 1.2 and later.", log_queue);
+        }
+    }
+
+    /* Chosen once, so every worker decodes NetFlow v5 the same way */
+    char* decoder = select_decoder();
+    if (config.debug) {
+        sprintf(log_message, "Decoding NetFlow v5 records with %s instructions.", decoder);
+        log_debug(log_message, log_queue);
+    }
+
+    /* Mapped once, so a template learned by one worker is known to all */
+    if (create_template_cache(error_message) < 0) {
+        sprintf(log_message, "Unable to create template cache: %.200s.", error_message);
+        log_error(log_message, log_queue);
+        clean_up_processes(&config, receivers, workers, logger_pid, log_queue);
+        delete_transport(&transport);
+        free_ssl_context();
+        return -5;
+    }
+
     for (i = 0; i < config.threads; ++i) {
-        if ((workers[i] = fork()) == 0) {
-            splunk_worker(i, &config, log_queue);
+        if ((workers[i] = fork_child()) == 0) {
+            splunk_worker(i, &config, &transport, log_queue);
             exit(0);
         }
     }
 
-    receive_packets(log_queue, &config);
-    clean_up_processes(&config, workers, logger_pid, log_queue);
+    /* Bind every receive socket before any receiver starts, so that each
+     * socket's position in the SO_REUSEPORT group matches its receiver
+     * number when steering by exporter address.  The sFlow receiver, if
+     * any, comes last, on a port of its own. */
+    for (i = 0; i < num_receivers; ++i) {
+        int port = (i < config.receivers) ? config.bind_port : config.sflow_port;
+        if ((sockets[i] = bind_socket(i, port, &config, log_queue)) < 0) {
+            sprintf(log_message, "bind_socket returned error: %d.", sockets[i]);
+            log_error(log_message, log_queue);
+            clean_up_processes(&config, receivers, workers, logger_pid, log_queue);
+            delete_transport(&transport);
+            free_ssl_context();
+            free_template_cache();
+            return -3;
+        }
+    }
+
+    int j;
+    for (i = 0; i < num_receivers; ++i) {
+        if ((receivers[i] = fork_child()) == 0) {
+            for (j = 0; j < num_receivers; ++j) {
+                if (j != i) {
+                    close(sockets[j]);
+                }
+            }
+            packet_receiver(i, sockets[i], &config, &transport, log_queue);
+            exit(0);
+        }
+    }
+
+    for (i = 0; i < num_receivers; ++i) {
+        close(sockets[i]);
+    }
+
+    wait_for_signal();
+    clean_up_processes(&config, receivers, workers, logger_pid, log_queue);
+    delete_transport(&transport);
+    free_ssl_context();
+    free_template_cache();
 
     return 0;
 }
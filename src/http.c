@@ -0,0 +1,348 @@
+#include <stdio.h>       /* Provides: sscanf */
+#include <stdlib.h>      /* Provides: strtol */
+#include <string.h>      /* Provides: memchr, memcpy, strchr, strlen */
+#include <strings.h>     /* Provides: strcasecmp, strncasecmp */
+#include "http.h"
+
+static int read_line(http_response* response, char* data, int len, int* complete);
+static int read_body(http_response* response, char* data, int len);
+static int parse_line(http_response* response);
+static int parse_header(http_response* response);
+static void end_headers(http_response* response);
+static int has_token(char* value, char* token);
+
+/*
+ * Function: http_reset
+ *
+ * Prepare to parse the next response on a connection.
+ *
+ * Inputs:   http_response*  response   Response to reset
+ *
+ * Returns:  None
+ */
+void http_reset(http_response* response) {
+    response->state = HTTP_STATUS_LINE;
+    response->line_len = 0;
+    response->code = 0;
+    response->chunked = 0;
+    response->keep_alive = 1;
+    response->content_length = -1;
+    response->retry_after = -1;
+    response->remaining = 0;
+    response->body[0] = '\0';
+    response->body_len = 0;
+    response->body_total = 0;
+}
+
+/*
+ * Function: http_parse
+ *
+ * Parse bytes read from a connection, up to the end of the current
+ * response.  Bytes past the end belong to the next response, and are
+ * left for the caller to parse once it has dealt with this one.
+ *
+ * Inputs:   http_response*  response   Response being parsed
+ *           char*           data       Bytes read from the connection
+ *           int             len        Number of bytes read
+ *
+ * Returns:  <bytes used>   The response is complete if its state is
+ *                          HTTP_DONE, or more bytes are needed otherwise
+ *           -1             Malformed response
+ */
+int http_parse(http_response* response, char* data, int len) {
+    int used = 0;
+
+    while (used < len && response->state != HTTP_DONE) {
+        int bytes;
+
+        if (response->state == HTTP_BODY || response->state == HTTP_BODY_TO_CLOSE ||
+            response->state == HTTP_CHUNK_DATA) {
+            bytes = read_body(response, data + used, len - used);
+        }
+        else {
+            int complete = 0;
+            bytes = read_line(response, data + used, len - used, &complete);
+            if (bytes < 0 || (complete && parse_line(response) < 0)) {
+                return -1;
+            }
+        }
+        used += bytes;
+    }
+    return used;
+}
+
+/*
+ * Function: http_finish
+ *
+ * Complete a response whose body runs until the connection is closed,
+ * once it has been.
+ *
+ * Inputs:   http_response*  response   Response being parsed
+ *
+ * Returns:  1    The response is complete
+ *           0    The response was cut short
+ */
+int http_finish(http_response* response) {
+    if (response->state == HTTP_BODY_TO_CLOSE) {
+        response->state = HTTP_DONE;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Function: read_line
+ *
+ * Add bytes to the line being read, up to the end of the line.  The line
+ * is stored without its CRLF, and null terminated once complete.
+ *
+ * Inputs:   http_response*  response   Response being parsed
+ *           char*           data       Bytes to read from
+ *           int             len        Number of bytes available
+ *           int*            complete   Set to 1 if the line was completed
+ *
+ * Returns:  <bytes used>
+ *           -1              The line is too long
+ */
+static int read_line(http_response* response, char* data, int len, int* complete) {
+    char* end = memchr(data, '\n', len);
+    int bytes = end ? end - data : len;
+
+    if (response->line_len + bytes >= HTTP_LINE_SIZE) {
+        return -1;
+    }
+    memcpy(response->line + response->line_len, data, bytes);
+    response->line_len += bytes;
+
+    if (!end) {
+        return bytes;
+    }
+
+    if (response->line_len > 0 && response->line[response->line_len - 1] == '\r') {
+        response->line_len--;
+    }
+    response->line[response->line_len] = '\0';
+    *complete = 1;
+    return bytes + 1;
+}
+
+/*
+ * Function: read_body
+ *
+ * Take bytes of the body, or of the current chunk of it.  The start of
+ * the body is kept, for the caller to look at once the response is
+ * complete.
+ *
+ * Inputs:   http_response*  response   Response being parsed
+ *           char*           data       Bytes to read from
+ *           int             len        Number of bytes available
+ *
+ * Returns:  <bytes used>
+ */
+static int read_body(http_response* response, char* data, int len) {
+    int bytes = len;
+
+    if (response->state != HTTP_BODY_TO_CLOSE && bytes > response->remaining) {
+        bytes = response->remaining;
+    }
+
+    int keep = HTTP_BODY_SIZE - response->body_len;
+    if (keep > bytes) {
+        keep = bytes;
+    }
+    memcpy(response->body + response->body_len, data, keep);
+    response->body_len += keep;
+    response->body[response->body_len] = '\0';
+    response->body_total += bytes;
+
+    if (response->state != HTTP_BODY_TO_CLOSE) {
+        response->remaining -= bytes;
+        if (response->remaining == 0) {
+            response->state = (response->state == HTTP_BODY) ? HTTP_DONE : HTTP_CHUNK_END;
+        }
+    }
+    return bytes;
+}
+
+/*
+ * Function: parse_line
+ *
+ * Act on a complete line, according to where it falls in the response.
+ *
+ * Inputs:   http_response*  response   Response being parsed
+ *
+ * Returns:  0    Success
+ *           -1   Malformed line
+ */
+static int parse_line(http_response* response) {
+    char* line = response->line;
+    int major, minor;
+
+    response->line_len = 0;
+    switch (response->state) {
+        case HTTP_STATUS_LINE:
+            /* A stray empty line ahead of a response is allowed */
+            if (line[0] == '\0') {
+                return 0;
+            }
+            if (sscanf(line, "HTTP/%d.%d %3d", &major, &minor, &response->code) != 3 ||
+                response->code < 100) {
+                return -1;
+            }
+            response->keep_alive = (major > 1 || (major == 1 && minor >= 1));
+            response->state = HTTP_HEADERS;
+            return 0;
+
+        case HTTP_HEADERS:
+            if (line[0] == '\0') {
+                end_headers(response);
+                return 0;
+            }
+            return parse_header(response);
+
+        case HTTP_CHUNK_SIZE: {
+            char* end;
+            long size = strtol(line, &end, 16);
+            if (end == line || size < 0 || (*end && *end != ';' && *end != ' ' && *end != '\t')) {
+                return -1;
+            }
+            response->remaining = size;
+            response->state = size ? HTTP_CHUNK_DATA : HTTP_TRAILERS;
+            return 0;
+        }
+
+        case HTTP_CHUNK_END:
+            if (line[0] != '\0') {
+                return -1;
+            }
+            response->state = HTTP_CHUNK_SIZE;
+            return 0;
+
+        case HTTP_TRAILERS:
+            if (line[0] == '\0') {
+                response->state = HTTP_DONE;
+            }
+            return 0;
+    }
+    return -1;
+}
+
+/*
+ * Function: parse_header
+ *
+ * Pick out the headers that determine how the body is delimited, whether
+ * the connection stays open after the response, and how long the server
+ * asks to be left alone for.
+ *
+ * Inputs:   http_response*  response   Response being parsed
+ *
+ * Returns:  0    Success
+ *           -1   Malformed header
+ */
+static int parse_header(http_response* response) {
+    char* name = response->line;
+    char* value = strchr(name, ':');
+
+    if (!value || value == name) {
+        return -1;
+    }
+    *value++ = '\0';
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+    int len = strlen(value);
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+        value[--len] = '\0';
+    }
+
+    if (!strcasecmp(name, "Content-Length")) {
+        char* end;
+        long length = strtol(value, &end, 10);
+        if (end == value || *end || length < 0) {
+            return -1;
+        }
+        response->content_length = length;
+    }
+    else if (!strcasecmp(name, "Transfer-Encoding")) {
+        response->chunked = has_token(value, "chunked");
+    }
+    else if (!strcasecmp(name, "Retry-After")) {
+        /* Only the delay in seconds is used, not the HTTP date form */
+        char* end;
+        response->retry_after = strtol(value, &end, 10);
+        if (end == value || *end || response->retry_after < 0) {
+            response->retry_after = -1;
+        }
+    }
+    else if (!strcasecmp(name, "Connection")) {
+        if (has_token(value, "close")) {
+            response->keep_alive = 0;
+        }
+        else if (has_token(value, "keep-alive")) {
+            response->keep_alive = 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: end_headers
+ *
+ * Work out how the body is delimited once all the headers are in.
+ * Chunked encoding takes precedence over Content-Length.  A body with
+ * neither runs until the connection is closed.  Interim 1xx responses
+ * have no body, and are followed by the real response.
+ *
+ * Inputs:   http_response*  response   Response being parsed
+ *
+ * Returns:  None
+ */
+static void end_headers(http_response* response) {
+    if (response->code < 200) {
+        http_reset(response);
+    }
+    else if (response->code == 204 || response->code == 304) {
+        response->state = HTTP_DONE;
+    }
+    else if (response->chunked) {
+        response->state = HTTP_CHUNK_SIZE;
+    }
+    else if (response->content_length >= 0) {
+        response->remaining = response->content_length;
+        response->state = response->remaining ? HTTP_BODY : HTTP_DONE;
+    }
+    else {
+        response->keep_alive = 0;
+        response->state = HTTP_BODY_TO_CLOSE;
+    }
+}
+
+/*
+ * Function: has_token
+ *
+ * Check a comma separated header value for a token, ignoring case.
+ *
+ * Inputs:   char*  value   Header value
+ *           char*  token   Token to look for
+ *
+ * Returns:  1    The token is in the value
+ *           0    It isn't
+ */
+static int has_token(char* value, char* token) {
+    int len = strlen(token);
+
+    while (*value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+        if (!strncasecmp(value, token, len) &&
+            (value[len] == '\0' || value[len] == ',' || value[len] == ' ' ||
+             value[len] == '\t' || value[len] == ';')) {
+            return 1;
+        }
+        while (*value && *value != ',') {
+            value++;
+        }
+    }
+    return 0;
+}
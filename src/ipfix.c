@@ -0,0 +1,178 @@
+#include <stdio.h>       /* Provides: sprintf */
+#include <arpa/inet.h>   /* Provides: inet_addr, ntohs, ntohl */
+#include "ipfix.h"
+#include "netflow.h"
+#include "template.h"
+#include "logger.h"
+
+static int learn_templates(packet_buffer* packet, uint32_t exporter, uint32_t domain,
+                           unsigned char* set, int length, int options, int log_queue);
+
+/*
+ * Function: learn_templates
+ *
+ * Store the templates, or options templates, of an IPFIX template set in
+ * the template cache.  A template with no fields withdraws the template.
+ * Enterprise elements carry their enterprise number after their length.
+ *
+ * Inputs:   packet_buffer*  packet      Packet the set came in
+ *           uint32_t        exporter    Exporter address, in network order
+ *           uint32_t        domain      Observation domain of the packet
+ *           unsigned char*  set         Start of the set
+ *           int             length      Length of the set
+ *           int             options     Whether these are options templates
+ *           int             log_queue   Id of IPC queue for logging
+ *
+ * Returns:  0    Success
+ *           -1   The set is malformed
+ */
+static int learn_templates(packet_buffer* packet, uint32_t exporter, uint32_t domain,
+                           unsigned char* set, int length, int options, int log_queue) {
+    char log_message[LOG_MESSAGE_SIZE];
+    template_field fields[TEMPLATE_MAX_FIELDS];
+    int header_len = options ? 6 : 4;
+    int offset = sizeof(flowset_header);
+
+    /* A set may be padded out to a 32 bit boundary */
+    while (offset + header_len <= length) {
+        uint16_t* words = (uint16_t*)(set + offset);
+        int id = ntohs(words[0]);
+        int num_fields = ntohs(words[1]);
+        int scope_fields = options ? ntohs(words[2]) : 0;
+        if (id < IPFIX_MIN_DATA_SET) {
+            break;
+        }
+        offset += header_len;
+
+        int i;
+        for (i = 0; i < num_fields; i++) {
+            if (offset + 4 > length) {
+                return -1;
+            }
+            words = (uint16_t*)(set + offset);
+            uint16_t type = ntohs(words[0]);
+            uint16_t field_len = ntohs(words[1]);
+            uint32_t enterprise = 0;
+            offset += 4;
+
+            if (type & IPFIX_ENTERPRISE_BIT) {
+                if (offset + 4 > length) {
+                    return -1;
+                }
+                enterprise = ntohl(*(uint32_t*)(set + offset));
+                type &= ~IPFIX_ENTERPRISE_BIT;
+                offset += 4;
+            }
+            if (i < TEMPLATE_MAX_FIELDS) {
+                fields[i].type = type;
+                fields[i].length = field_len;
+                fields[i].enterprise = enterprise;
+            }
+        }
+
+        int result = template_store(exporter, domain, id, IPFIX_VERSION, fields, num_fields,
+                                    scope_fields);
+        if (result < 0) {
+            sprintf(log_message, "IPFIX template %d from %s has %d fields, more than "
+                                 "the %d supported.", id, packet->sender, num_fields,
+                                 TEMPLATE_MAX_FIELDS);
+            log_warning(log_message, log_queue);
+        }
+        else if (result > 0 && num_fields == 0) {
+            sprintf(log_message, "IPFIX template %d from %s (domain %u) withdrawn.", id,
+                                 packet->sender, domain);
+            log_info(log_message, log_queue);
+        }
+        else if (result > 0) {
+            sprintf(log_message, "Learned IPFIX %stemplate %d from %s (domain %u) "
+                                 "with %d fields.", options ? "options " : "", id,
+                                 packet->sender, domain, num_fields);
+            log_info(log_message, log_queue);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: ipfix_prepare
+ *
+ * Check that an IPFIX message is sane, learn the templates it carries,
+ * and count the data records that can be decoded.  Data sets whose
+ * template isn't known yet are moved out of the message and held until
+ * it is, so the message is left with only what can be decoded now, and
+ * preparing it again gives the same count.  Options records are taken
+ * in as they come.
+ *
+ * Inputs:   packet_buffer*  packet      Packet to prepare
+ *           int             log_queue   Id of IPC queue for logging
+ *
+ * Returns:  <# of data records in the packet>   Success
+ *           -1                                  Invalid packet
+ */
+int ipfix_prepare(packet_buffer* packet, int log_queue) {
+    ipfix_header* h = (ipfix_header*)packet->packet;
+    if (packet->packet_len < (int)sizeof(ipfix_header)) {
+        return -1;
+    }
+
+    uint32_t exporter = inet_addr(packet->sender);
+    uint32_t domain = ntohl(h->domain);
+    int num_records = 0;
+    int offset = sizeof(ipfix_header);
+
+    while (offset + (int)sizeof(flowset_header) <= packet->packet_len) {
+        flowset_header* set = (flowset_header*)(packet->packet + offset);
+        int id = ntohs(set->id);
+        int length = ntohs(set->length);
+
+        if (length < (int)sizeof(flowset_header) || offset + length > packet->packet_len) {
+            return -1;
+        }
+
+        if (id == IPFIX_TEMPLATE_SET || id == IPFIX_OPTIONS_SET) {
+            if (learn_templates(packet, exporter, domain, (unsigned char*)set, length,
+                                id == IPFIX_OPTIONS_SET, log_queue) < 0) {
+                return -1;
+            }
+        }
+        else if (id >= IPFIX_MIN_DATA_SET) {
+            int set_records = template_prepare_set(packet, sizeof(ipfix_header), offset,
+                                                   exporter, domain, IPFIX_VERSION);
+            if (set_records < 0) {
+                continue;
+            }
+            num_records += set_records;
+        }
+        offset += length;
+    }
+    return num_records;
+}
+
+/*
+ * Function: format_ipfix_records
+ *
+ * Write a HEC event for each data record in a prepared IPFIX message.
+ * Start and end times given as uptimes are relative to the exporter's
+ * systemInitTimeMilliseconds, if it has sent that in its options.  The
+ * output buffer must have room for 'record_max' bytes per record.
+ *
+ * Inputs:   char*           cursor        Position in the output buffer to write to
+ *           record_format*  format        Constant record fragments
+ *           packet_buffer*  packet        Packet containing the records
+ *           int             num_records   Number of records in the packet
+ *
+ * Returns:  <position after the last character written>
+ */
+char* format_ipfix_records(char* cursor, record_format* format, packet_buffer* packet,
+                           int num_records) {
+    ipfix_header* h = (ipfix_header*)packet->packet;
+    uint32_t domain = ntohl(h->domain);
+    export_info info;
+
+    info.export_time = (int64_t)ntohl(h->export_time) * 1000000;
+    info.boot_time = -1;
+    template_export_info(inet_addr(packet->sender), domain, IPFIX_VERSION, &info);
+
+    return format_template_sets(cursor, format, packet, sizeof(ipfix_header), domain,
+                                IPFIX_VERSION, &info, num_records);
+}
@@ -9,7 +9,11 @@
 #include "logger.h"
 #include "queue.h"
 
+#define LOG_MESSAGE  1
+#define LOG_WAKEUP   2
+
 static int keep_logging = 1;
+static int logger_queue = -1;
 
 static void handle_sigterm(int sig);
 static void handle_sigint(int sig);
@@ -22,14 +26,19 @@ static void write_log(FILE* fd, logbuf* log);
  * Function: handle_sigterm
  *
  * Toggle the keep_logging variable to instruct  the main logging routine to 
- * stop cleanly after emptying the logging queue.
+ * stop cleanly after emptying the logging queue.  An empty wakeup message
+ * is also placed on the queue, so a logger blocked waiting on an empty
+ * queue notices.  If the queue is full, the logger isn't blocked anyway.
  *
  * Inputs:   int sig    Signal being caught (SIGTERM)
  *
  * Returns:  None
  */
 static void handle_sigterm(int sig) {
+    long wakeup = LOG_WAKEUP;
+
     keep_logging = 0;
+    msgsnd(logger_queue, &wakeup, 0, IPC_NOWAIT);
 }
 
 /*
@@ -83,7 +92,7 @@ static void set_current_time(char* current_time) {
 static void logger(char* message, char* severity, int queue_id) {
     logbuf log_message;
 
-    log_message.mtype = 1;
+    log_message.mtype = LOG_MESSAGE;
     strcpy(log_message.message, message);
     strcpy(log_message.severity, severity);
 
@@ -183,6 +192,7 @@ static void write_log(FILE* fd, logbuf* log) {
  * Returns:  None
  */
 void start_logger(char* log_file, int queue_id) {
+    logger_queue = queue_id;
     signal(SIGTERM, handle_sigterm);
     signal(SIGINT, handle_sigint);
 
@@ -193,26 +203,25 @@ void start_logger(char* log_file, int queue_id) {
         exit(0);
     }
 
-    char log_message[LOG_MESSAGE_SIZE];
-    sprintf(log_message, "Logging process [PID %d] started.", getpid());
-    log_info(log_message, queue_id);
-
     logbuf l;
 
+    /* Write the startup message directly rather than through the queue,
+     * which may already be full of messages waiting for this process. */
+    sprintf(l.message, "Logging process [PID %d] started.", getpid());
+    strcpy(l.severity, "INFO");
+    write_log(fd, &l);
+
     /* Don't stop reading from the queue until instructed to stop, and
      * the queue is empty */
     while(keep_logging || queue_length(queue_id)) {
 
-        /* If there are no messages in the queue, don't wait for one to
-         * arrive.  This is to give an opportunity for the loop to be 
-         * broken by a SIGTERM.  If the queue was empty, sleep for 0.01s
-         * to prevent the CPU from saturating. */  
-        int bytes = msgrcv(queue_id, &l, sizeof(logbuf), 1, IPC_NOWAIT);
-        if (bytes <= 0) {
-            usleep(10000);
+        /* Block until a message arrives.  A SIGTERM either interrupts the
+         * wait, or leaves a wakeup message behind to end it. */
+        int bytes = msgrcv(queue_id, &l, sizeof(logbuf), 0, 0);
+        if (bytes <= 0 || l.mtype != LOG_MESSAGE) {
             continue;
         }
-           
+
         write_log(fd, &l);
     }
 
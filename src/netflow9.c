@@ -0,0 +1,168 @@
+#include <stdio.h>       /* Provides: sprintf */
+#include <arpa/inet.h>   /* Provides: inet_addr, ntohs, ntohl */
+#include "netflow9.h"
+#include "netflow.h"
+#include "template.h"
+#include "logger.h"
+
+static int learn_templates(packet_buffer* packet, uint32_t exporter, uint32_t domain,
+                           unsigned char* set, int length, int options, int log_queue);
+
+/*
+ * Function: learn_templates
+ *
+ * Store the templates, or options templates, of a template FlowSet in
+ * the template cache.
+ *
+ * Inputs:   packet_buffer*  packet      Packet the FlowSet came in
+ *           uint32_t        exporter    Exporter address, in network order
+ *           uint32_t        domain      Source ID of the packet
+ *           unsigned char*  set         Start of the FlowSet
+ *           int             length      Length of the FlowSet
+ *           int             options     Whether these are options templates
+ *           int             log_queue   Id of IPC queue for logging
+ *
+ * Returns:  0    Success
+ *           -1   The FlowSet is malformed
+ */
+static int learn_templates(packet_buffer* packet, uint32_t exporter, uint32_t domain,
+                           unsigned char* set, int length, int options, int log_queue) {
+    char log_message[LOG_MESSAGE_SIZE];
+    template_field fields[TEMPLATE_MAX_FIELDS];
+    int header_len = options ? 6 : 4;
+    int offset = sizeof(flowset_header);
+
+    /* A FlowSet may be padded out to a 32 bit boundary */
+    while (offset + header_len <= length) {
+        uint16_t* words = (uint16_t*)(set + offset);
+        int id = ntohs(words[0]);
+        int num_fields;
+        int scope_fields = 0;
+
+        if (options) {
+            scope_fields = ntohs(words[1]) / 4;
+            num_fields = scope_fields + ntohs(words[2]) / 4;
+        }
+        else {
+            num_fields = ntohs(words[1]);
+        }
+        if (id < NETFLOW9_MIN_DATA_SET) {
+            break;
+        }
+
+        offset += header_len;
+        if (offset + num_fields * 4 > length) {
+            return -1;
+        }
+
+        int i;
+        int kept = num_fields < TEMPLATE_MAX_FIELDS ? num_fields : TEMPLATE_MAX_FIELDS;
+        for (i = 0; i < kept; i++) {
+            words = (uint16_t*)(set + offset + i * 4);
+            fields[i].type = ntohs(words[0]);
+            fields[i].length = ntohs(words[1]);
+            fields[i].enterprise = 0;
+        }
+        offset += num_fields * 4;
+
+        int result = template_store(exporter, domain, id, NETFLOW9_VERSION, fields, num_fields,
+                                    scope_fields);
+        if (result < 0) {
+            sprintf(log_message, "NetFlow v9 template %d from %s has %d fields, more than "
+                                 "the %d supported.", id, packet->sender, num_fields,
+                                 TEMPLATE_MAX_FIELDS);
+            log_warning(log_message, log_queue);
+        }
+        else if (result > 0) {
+            sprintf(log_message, "Learned NetFlow v9 %stemplate %d from %s (source ID %u) "
+                                 "with %d fields.", options ? "options " : "", id,
+                                 packet->sender, domain, num_fields);
+            log_info(log_message, log_queue);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: netflow9_prepare
+ *
+ * Check that a NetFlow v9 packet is sane, learn the templates it carries,
+ * and count the data records that can be decoded.  Data FlowSets whose
+ * template isn't known yet are moved out of the packet and held until it
+ * is, so the packet is left with only what can be decoded now, and
+ * preparing it again gives the same count.  Options records are taken
+ * in as they come.
+ *
+ * Inputs:   packet_buffer*  packet      Packet to prepare
+ *           int             log_queue   Id of IPC queue for logging
+ *
+ * Returns:  <# of data records in the packet>   Success
+ *           -1                                  Invalid packet
+ */
+int netflow9_prepare(packet_buffer* packet, int log_queue) {
+    netflow9_header* h = (netflow9_header*)packet->packet;
+    if (packet->packet_len < (int)sizeof(netflow9_header)) {
+        return -1;
+    }
+
+    uint32_t exporter = inet_addr(packet->sender);
+    uint32_t domain = ntohl(h->source_id);
+    int num_records = 0;
+    int offset = sizeof(netflow9_header);
+
+    while (offset + (int)sizeof(flowset_header) <= packet->packet_len) {
+        flowset_header* set = (flowset_header*)(packet->packet + offset);
+        int id = ntohs(set->id);
+        int length = ntohs(set->length);
+
+        if (length < (int)sizeof(flowset_header) || offset + length > packet->packet_len) {
+            return -1;
+        }
+
+        if (id == NETFLOW9_TEMPLATE_SET || id == NETFLOW9_OPTIONS_SET) {
+            if (learn_templates(packet, exporter, domain, (unsigned char*)set, length,
+                                id == NETFLOW9_OPTIONS_SET, log_queue) < 0) {
+                return -1;
+            }
+        }
+        else if (id >= NETFLOW9_MIN_DATA_SET) {
+            int set_records = template_prepare_set(packet, sizeof(netflow9_header), offset,
+                                                   exporter, domain, NETFLOW9_VERSION);
+            if (set_records < 0) {
+                continue;
+            }
+            num_records += set_records;
+        }
+        offset += length;
+    }
+    return num_records;
+}
+
+/*
+ * Function: format_netflow9_records
+ *
+ * Write a HEC event for each data record in a prepared NetFlow v9 packet.
+ * Start and end times are uptimes, so are relative to the exporter's
+ * boot time, which is the export time less its uptime.  The output
+ * buffer must have room for 'record_max' bytes per record.
+ *
+ * Inputs:   char*           cursor        Position in the output buffer to write to
+ *           record_format*  format        Constant record fragments
+ *           packet_buffer*  packet        Packet containing the records
+ *           int             num_records   Number of records in the packet
+ *
+ * Returns:  <position after the last character written>
+ */
+char* format_netflow9_records(char* cursor, record_format* format, packet_buffer* packet,
+                              int num_records) {
+    netflow9_header* h = (netflow9_header*)packet->packet;
+    uint32_t domain = ntohl(h->source_id);
+    export_info info;
+
+    info.export_time = (int64_t)ntohl(h->unix_secs) * 1000000;
+    info.boot_time = info.export_time - (int64_t)ntohl(h->sys_uptime) * 1000;
+    template_export_info(inet_addr(packet->sender), domain, NETFLOW9_VERSION, &info);
+
+    return format_template_sets(cursor, format, packet, sizeof(netflow9_header), domain,
+                                NETFLOW9_VERSION, &info, num_records);
+}
@@ -0,0 +1,495 @@
+#include <stdio.h>       /* Provides: sprintf */
+#include <stdlib.h>      /* Provides: calloc, free, qsort */
+#include <string.h>      /* Provides: memcpy, memset, strcpy */
+#include <arpa/inet.h>   /* Provides: ntohs, ntohl, htons, htonl, inet_addr, inet_ntop */
+#include "overload.h"
+#include "batch.h"
+#include "logger.h"
+
+static exporter_load* find_exporter(overload_shedder* shedder, uint32_t addr);
+static void send_evicting(overload_shedder* shedder, packet_buffer* packet,
+                          exporter_load* exporter);
+static void send_sampled(overload_shedder* shedder, packet_buffer* packet,
+                         exporter_load* exporter);
+static void summarize_packet(overload_shedder* shedder, packet_buffer* packet,
+                             exporter_load* exporter);
+static void fold_record(overload_shedder* shedder, exporter_load* exporter,
+                        netflow_record* record);
+static int compare_flows(const void* a, const void* b);
+static void flush_summaries(overload_shedder* shedder);
+
+/*
+ * Function: find_exporter
+ *
+ * Look up the load entry of an exporter, adding one if it is new.  Once
+ * the table is full, new exporters share a single entry.
+ *
+ * Inputs:   overload_shedder*  shedder   Shedder to look in
+ *           uint32_t           addr      Address of the exporter, network order
+ *
+ * Returns:  <load entry of the exporter>
+ */
+static exporter_load* find_exporter(overload_shedder* shedder, uint32_t addr) {
+    if (addr == 0) {
+        return &shedder->others;
+    }
+
+    uint32_t slot = (addr * 2654435761u) & (OVERLOAD_EXPORTERS - 1);
+    int probes;
+
+    for (probes = 0; probes < OVERLOAD_EXPORTERS; probes++) {
+        exporter_load* exporter = &shedder->exporters[slot];
+        if (exporter->addr == addr) {
+            return exporter;
+        }
+        if (exporter->addr == 0) {
+            exporter->addr = addr;
+            exporter->interval = 1;
+            return exporter;
+        }
+        slot = (slot + 1) & (OVERLOAD_EXPORTERS - 1);
+    }
+    return &shedder->others;
+}
+
+/*
+ * Function: send_evicting
+ *
+ * Make room for a packet by dropping the oldest packets in the transport,
+ * counting each against the exporter it came from.  If no room can be
+ * made, the new packet is dropped instead.
+ *
+ * Inputs:   overload_shedder*  shedder    Shedder handling the packet
+ *           packet_buffer*     packet     Packet that found the transport full
+ *           exporter_load*     exporter   Exporter the packet came from
+ *
+ * Returns:  None
+ */
+static void send_evicting(overload_shedder* shedder, packet_buffer* packet,
+                          exporter_load* exporter) {
+    packet_buffer oldest;
+    int tries;
+
+    for (tries = 0; tries < OVERLOAD_EVICT_TRIES; tries++) {
+        if (transport_receive(shedder->transport, &oldest) < 0) {
+            break;
+        }
+        find_exporter(shedder, inet_addr(oldest.sender))->shed++;
+        if (transport_try_send(shedder->transport, packet) == 0) {
+            return;
+        }
+    }
+    exporter->shed++;
+}
+
+/*
+ * Function: send_sampled
+ *
+ * Pass on one in every 'interval' packets from an exporter, and back the
+ * exporter off further if even that one finds the transport full.
+ *
+ * Inputs:   overload_shedder*  shedder    Shedder handling the packet
+ *           packet_buffer*     packet     Packet to send
+ *           exporter_load*     exporter   Exporter the packet came from
+ *
+ * Returns:  None
+ */
+static void send_sampled(overload_shedder* shedder, packet_buffer* packet,
+                         exporter_load* exporter) {
+    if (exporter->interval > 1 && ++exporter->skipped < exporter->interval) {
+        exporter->shed++;
+        return;
+    }
+    exporter->skipped = 0;
+
+    if (transport_try_send(shedder->transport, packet) < 0) {
+        exporter->shed++;
+        exporter->full = 1;
+        if (exporter->interval < OVERLOAD_MAX_INTERVAL) {
+            exporter->interval *= 2;
+        }
+    }
+}
+
+/*
+ * Function: summarize_packet
+ *
+ * Fold the records of a packet that found the transport full into the
+ * summaries, to be sent once there is room.  Packets that aren't sane
+ * NetFlow v5, or that there is no room left to summarize, are dropped.
+ *
+ * Inputs:   overload_shedder*  shedder    Shedder handling the packet
+ *           packet_buffer*     packet     Packet to summarize
+ *           exporter_load*     exporter   Exporter the packet came from
+ *
+ * Returns:  None
+ */
+static void summarize_packet(overload_shedder* shedder, packet_buffer* packet,
+                             exporter_load* exporter) {
+    netflow_header* header = (netflow_header*)packet->packet;
+    int i;
+
+    if (exporter == &shedder->others || packet->packet_len < (int)sizeof(netflow_header) ||
+        ntohs(header->version) != 5 || packet->packet_len !=
+            (int)(sizeof(netflow_header) + ntohs(header->count) * sizeof(netflow_record))) {
+        exporter->shed++;
+        return;
+    }
+
+    /* The summaries are only sent once a second, as trying more often
+     * while the transport is full would only slow the receiver down */
+    int count = ntohs(header->count);
+    if (shedder->num_flows + count > OVERLOAD_FLOWS * 3 / 4) {
+        exporter->shed++;
+        return;
+    }
+
+    netflow_record* records = (netflow_record*)(packet->packet + sizeof(netflow_header));
+    for (i = 0; i < count; i++) {
+        fold_record(shedder, exporter, &records[i]);
+    }
+    exporter->header = *header;
+    exporter->summarized++;
+}
+
+/*
+ * Function: fold_record
+ *
+ * Add a record to the summary of its flow, starting a summary if it is
+ * the first record of the flow.
+ *
+ * Inputs:   overload_shedder*  shedder    Shedder holding the summaries
+ *           exporter_load*     exporter   Exporter the record came from
+ *           netflow_record*    record     Record to add
+ *
+ * Returns:  None
+ */
+static void fold_record(overload_shedder* shedder, exporter_load* exporter,
+                        netflow_record* record) {
+    uint32_t hash = (record->srcaddr * 2654435761u) ^ (record->dstaddr * 40503u) ^
+                    record->prot ^ (uint32_t)(uintptr_t)exporter;
+    uint32_t slot = (hash ^ (hash >> 16)) & (OVERLOAD_FLOWS - 1);
+    summary_flow* flow;
+
+    while (1) {
+        flow = &shedder->flows[slot];
+        if (!flow->exporter) {
+            memset(flow, 0, sizeof(summary_flow));
+            flow->exporter = exporter;
+            flow->srcaddr = record->srcaddr;
+            flow->dstaddr = record->dstaddr;
+            flow->prot = record->prot;
+            flow->first = ntohl(record->first);
+            flow->last = ntohl(record->last);
+            shedder->num_flows++;
+            break;
+        }
+        if (flow->exporter == exporter && flow->srcaddr == record->srcaddr &&
+            flow->dstaddr == record->dstaddr && flow->prot == record->prot) {
+            break;
+        }
+        slot = (slot + 1) & (OVERLOAD_FLOWS - 1);
+    }
+
+    uint32_t packets = ntohl(record->packets);
+    uint32_t bytes = ntohl(record->bytes);
+    flow->packets = (flow->packets > UINT32_MAX - packets) ? UINT32_MAX : flow->packets + packets;
+    flow->bytes = (flow->bytes > UINT32_MAX - bytes) ? UINT32_MAX : flow->bytes + bytes;
+    if (ntohl(record->first) < flow->first) {
+        flow->first = ntohl(record->first);
+    }
+    if (ntohl(record->last) > flow->last) {
+        flow->last = ntohl(record->last);
+    }
+    flow->tcp_flags |= record->tcp_flags;
+}
+
+/*
+ * Function: compare_flows
+ *
+ * Order summaries by exporter, for qsort, so each exporter's summaries
+ * can be sent together.
+ *
+ * Inputs:   const void*  a   First summary
+ *           const void*  b   Second summary
+ *
+ * Returns:  <0, 0 or >0 as 'a' sorts before, with, or after 'b'
+ */
+static int compare_flows(const void* a, const void* b) {
+    uintptr_t exporter_a = (uintptr_t)((summary_flow*)a)->exporter;
+    uintptr_t exporter_b = (uintptr_t)((summary_flow*)b)->exporter;
+    return (exporter_a > exporter_b) - (exporter_a < exporter_b);
+}
+
+/*
+ * Function: flush_summaries
+ *
+ * Send the summaries as NetFlow v5 packets from the exporters they
+ * summarize, up to 30 records each, under the header of the exporter's
+ * last summarized packet.  Once the transport is full again, the
+ * summaries not sent are kept for the next flush.
+ *
+ * Inputs:   overload_shedder*  shedder   Shedder holding the summaries
+ *
+ * Returns:  None
+ */
+static void flush_summaries(overload_shedder* shedder) {
+    packet_buffer packet;
+    int sent, i;
+
+    if (shedder->num_flows == 0) {
+        return;
+    }
+
+    /* Pack the summaries to the front of the table, grouped by exporter */
+    int num_flows = 0;
+    for (i = 0; i < OVERLOAD_FLOWS; i++) {
+        if (shedder->flows[i].exporter) {
+            shedder->flows[num_flows++] = shedder->flows[i];
+        }
+    }
+    qsort(shedder->flows, num_flows, sizeof(summary_flow), compare_flows);
+
+    for (sent = 0; sent < num_flows; ) {
+        exporter_load* exporter = shedder->flows[sent].exporter;
+        netflow_header* header = (netflow_header*)packet.packet;
+        netflow_record* records = (netflow_record*)(packet.packet + sizeof(netflow_header));
+        int count = 0;
+
+        *header = exporter->header;
+        memset(records, 0, sizeof(netflow_record) * NETFLOW_V5_MAX_RECORDS);
+        while (sent + count < num_flows && count < NETFLOW_V5_MAX_RECORDS &&
+               shedder->flows[sent + count].exporter == exporter) {
+            summary_flow* flow = &shedder->flows[sent + count];
+            records[count].srcaddr = flow->srcaddr;
+            records[count].dstaddr = flow->dstaddr;
+            records[count].packets = htonl(flow->packets);
+            records[count].bytes = htonl(flow->bytes);
+            records[count].first = htonl(flow->first);
+            records[count].last = htonl(flow->last);
+            records[count].tcp_flags = flow->tcp_flags;
+            records[count].prot = flow->prot;
+            count++;
+        }
+        header->count = htons(count);
+
+        packet.mtype = 2;
+        packet.packet_len = sizeof(netflow_header) + count * sizeof(netflow_record);
+        packet.receive_time = 0;    /* NetFlow v5 carries its own times */
+        inet_ntop(AF_INET, &exporter->addr, packet.sender, IPV4_ADDR_SIZE);
+        if (transport_try_send(shedder->transport, &packet) < 0) {
+            break;
+        }
+        sent += count;
+    }
+
+    /* Put back whatever is left, now that the table is rearranged */
+    summary_flow* unsent = NULL;
+    int num_unsent = num_flows - sent;
+    if (num_unsent > 0) {
+        unsent = malloc(sizeof(summary_flow) * num_unsent);
+        if (unsent) {
+            memcpy(unsent, shedder->flows + sent, sizeof(summary_flow) * num_unsent);
+        }
+    }
+    memset(shedder->flows, 0, sizeof(summary_flow) * OVERLOAD_FLOWS);
+    shedder->num_flows = 0;
+
+    if (unsent) {
+        for (i = 0; i < num_unsent; i++) {
+            netflow_record record;
+            record.srcaddr = unsent[i].srcaddr;
+            record.dstaddr = unsent[i].dstaddr;
+            record.prot = unsent[i].prot;
+            record.tcp_flags = unsent[i].tcp_flags;
+            record.packets = htonl(unsent[i].packets);
+            record.bytes = htonl(unsent[i].bytes);
+            record.first = htonl(unsent[i].first);
+            record.last = htonl(unsent[i].last);
+            fold_record(shedder, unsent[i].exporter, &record);
+        }
+        free(unsent);
+    }
+}
+
+/*
+ * Function: create_shedder
+ *
+ * Set up a receiver's handling of packets that find the transport full,
+ * according to the configured overload policy.
+ *
+ * Inputs:   overload_shedder*  shedder     Shedder to initialize
+ *           freeflow_config*   config      Pointer to configuration object
+ *           packet_transport*  transport   Transport packets are sent on
+ *
+ * Returns:  0    Success
+ *           -1   Couldn't allocate the summaries
+ */
+int create_shedder(overload_shedder* shedder, freeflow_config* config,
+                   packet_transport* transport) {
+    memset(shedder, 0, sizeof(overload_shedder));
+    shedder->policy = config->overload_policy;
+    shedder->transport = transport;
+    shedder->others.interval = 1;
+    shedder->relax_at = monotonic_ms() + OVERLOAD_RELAX_MS;
+    shedder->flush_at = monotonic_ms() + OVERLOAD_FLUSH_MS;
+
+    if (shedder->policy == OVERLOAD_SUMMARIZE) {
+        shedder->flows = calloc(OVERLOAD_FLOWS, sizeof(summary_flow));
+        if (!shedder->flows) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: free_shedder
+ *
+ * Send any summaries the transport has room for, and release the shedder.
+ *
+ * Inputs:   overload_shedder*  shedder   Shedder to free
+ *
+ * Returns:  None
+ */
+void free_shedder(overload_shedder* shedder) {
+    if (shedder->flows) {
+        flush_summaries(shedder);
+        free(shedder->flows);
+        shedder->flows = NULL;
+    }
+}
+
+/*
+ * Function: shed_send
+ *
+ * Hand a packet to the transport.  If the transport is full, the
+ * overload policy decides what gives: the receiver waits for room, the
+ * new packet is dropped, the oldest packets are dropped, the exporter is
+ * sampled, or the packet is folded into summaries.  Whatever is dropped
+ * is counted against the exporter it came from.
+ *
+ * Inputs:   overload_shedder*  shedder   Shedder to handle the packet with
+ *           packet_buffer*     packet    Packet to send
+ *           uint32_t           addr      Address of the exporter, network order
+ *
+ * Returns:  None
+ */
+void shed_send(overload_shedder* shedder, packet_buffer* packet, uint32_t addr) {
+    if (shedder->policy == OVERLOAD_BLOCK) {
+        if (transport_send(shedder->transport, packet) < 0) {
+            find_exporter(shedder, addr)->shed++;
+        }
+        return;
+    }
+
+    exporter_load* exporter = find_exporter(shedder, addr);
+    if (shedder->policy == OVERLOAD_SAMPLE) {
+        send_sampled(shedder, packet, exporter);
+        return;
+    }
+    if (transport_try_send(shedder->transport, packet) == 0) {
+        return;
+    }
+
+    switch (shedder->policy) {
+        case OVERLOAD_DROP_OLDEST:
+            send_evicting(shedder, packet, exporter);
+            break;
+        case OVERLOAD_SUMMARIZE:
+            summarize_packet(shedder, packet, exporter);
+            break;
+        default:
+            exporter->shed++;
+            break;
+    }
+}
+
+/*
+ * Function: shed_tick
+ *
+ * Run the shedder's timers: ease off the sampling of exporters that
+ * haven't found the transport full for a second, and send the summaries
+ * held up.  Called after every receive.
+ *
+ * Inputs:   overload_shedder*  shedder   Shedder to run the timers of
+ *
+ * Returns:  None
+ */
+void shed_tick(overload_shedder* shedder) {
+    long now = monotonic_ms();
+    int i;
+
+    if (shedder->policy == OVERLOAD_SAMPLE && now >= shedder->relax_at) {
+        for (i = 0; i < OVERLOAD_EXPORTERS; i++) {
+            exporter_load* exporter = &shedder->exporters[i];
+            if (!exporter->full && exporter->interval > 1) {
+                exporter->interval /= 2;
+            }
+            exporter->full = 0;
+        }
+        if (!shedder->others.full && shedder->others.interval > 1) {
+            shedder->others.interval /= 2;
+        }
+        shedder->others.full = 0;
+        shedder->relax_at = now + OVERLOAD_RELAX_MS;
+    }
+
+    if (shedder->flows && now >= shedder->flush_at) {
+        flush_summaries(shedder);
+        shedder->flush_at = now + OVERLOAD_FLUSH_MS;
+    }
+}
+
+/*
+ * Function: report_shed_stats
+ *
+ * Log how many packets have been shed from each exporter since the last
+ * report, and reset the counts.  Only the first few exporters are listed
+ * by name.
+ *
+ * Inputs:   overload_shedder*  shedder        Shedder to report on
+ *           int                receiver_num   Id of this receiver process
+ *           int                log_queue      Id of the IPC logging queue
+ *
+ * Returns:  None
+ */
+void report_shed_stats(overload_shedder* shedder, int receiver_num, int log_queue) {
+    char log_message[LOG_MESSAGE_SIZE];
+    char addr[32];
+    int reported = 0, unreported = 0;
+    int i;
+
+    for (i = 0; i <= OVERLOAD_EXPORTERS; i++) {
+        exporter_load* exporter = (i < OVERLOAD_EXPORTERS) ? &shedder->exporters[i]
+                                                           : &shedder->others;
+        if (exporter->shed == 0 && exporter->summarized == 0) {
+            continue;
+        }
+
+        if (reported < OVERLOAD_REPORT_MAX) {
+            if (exporter == &shedder->others) {
+                strcpy(addr, "other exporters");
+            }
+            else {
+                inet_ntop(AF_INET, &exporter->addr, addr, IPV4_ADDR_SIZE);
+            }
+            sprintf(log_message, "Receiver #%d overloaded.  Shed %lu and summarized %lu "
+                                 "packets from %s.", receiver_num, exporter->shed,
+                                 exporter->summarized, addr);
+            log_warning(log_message, log_queue);
+            reported++;
+        }
+        else {
+            unreported++;
+        }
+        exporter->shed = 0;
+        exporter->summarized = 0;
+    }
+
+    if (unreported > 0) {
+        sprintf(log_message, "Receiver #%d overloaded.  Shed packets from %d more exporters.",
+                             receiver_num, unreported);
+        log_warning(log_message, log_queue);
+    }
+}
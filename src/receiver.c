@@ -0,0 +1,265 @@
+#define _GNU_SOURCE              /* Provides: recvmmsg */
+#include <stdio.h>       /* Provides: sprintf */
+#include <stdlib.h>      /* Provides: malloc, free */
+#include <string.h>      /* Provides: strcpy, memset */
+#include <arpa/inet.h>   /* Provides: inet_ntoa */
+#include <signal.h>      /* Provides: signal */
+#include <unistd.h>      /* Provides: close */
+#include <time.h>        /* Provides: clock_gettime */
+#include <poll.h>        /* Provides: poll */
+#include <sys/socket.h>  /* Provides: recvmmsg */
+#include "freeflow.h"
+#include "receiver.h"
+#include "overload.h"
+#include "transport.h"
+#include "logger.h"
+
+static int keep_receiving = 1;
+
+static void handle_receiver_sigterm(int sig);
+static void handle_receiver_sigint(int sig);
+static int fill_batch(int socket_id, struct mmsghdr* headers, int space, int timeout);
+static void record_batch(receive_stats* stats, int received, int batch_size);
+static void report_receive_stats(receive_stats* stats, overload_shedder* shedder,
+                                 int receiver_num, int batch_size, int log_queue);
+
+/*
+ * Function: handle_receiver_sigterm
+ *
+ * Handle SIGTERM signals by toggling the 'keep_receiving' variable.
+ * This variable controls the main receive loop, and will allow the
+ * receiver to end gracefully and report its final statistics.
+ *
+ * Inputs:   int sig        The signal being passed.  Currently unused.
+ *
+ * Returns:  None
+ */
+static void handle_receiver_sigterm(int sig) {
+    keep_receiving = 0;
+}
+
+/*
+ * Function: handle_receiver_sigint
+ *
+ * Do nothing.  Simply catch the SIGINT and take no action, to allow the
+ * main program to orchestrate the cleanup among all processes.
+ *
+ * Inputs:   int sig        The signal being passed.  Currently unused.
+ *
+ * Returns:  None
+ */
+static void handle_receiver_sigint(int sig) {}
+
+/*
+ * Function: fill_batch
+ *
+ * Top up a batch that has started arriving with whatever more datagrams
+ * turn up before the batch timeout runs out, without blocking past it.
+ *
+ * Inputs:   int              socket_id   Bound UDP socket to read from
+ *           struct mmsghdr*  headers     First free receive slot of the batch
+ *           int              space       Number of free receive slots
+ *           int              timeout     Milliseconds to wait, from now
+ *
+ * Returns:  <# of datagrams added to the batch>
+ */
+static int fill_batch(int socket_id, struct mmsghdr* headers, int space, int timeout) {
+    struct timespec start, now;
+    int filled = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (filled < space) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+                      (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed >= timeout) {
+            break;
+        }
+
+        struct pollfd readable = { .fd = socket_id, .events = POLLIN };
+        if (poll(&readable, 1, timeout - elapsed) <= 0) {
+            break;
+        }
+
+        int received = recvmmsg(socket_id, headers + filled, space - filled, MSG_DONTWAIT, NULL);
+        if (received <= 0) {
+            break;
+        }
+        filled += received;
+    }
+    return filled;
+}
+
+/*
+ * Function: record_batch
+ *
+ * Update the receive statistics with the outcome of a single batched
+ * receive call.  Batches are bucketed by how full they were relative to
+ * the configured batch size, in quarters.
+ *
+ * Inputs:  receive_stats*  stats        Receive statistics to update
+ *          int             received     Number of datagrams in the batch
+ *          int             batch_size   Configured maximum batch size
+ *
+ * Return:  None
+ */
+static void record_batch(receive_stats* stats, int received, int batch_size) {
+    int bucket = ((received - 1) * FILL_BUCKETS) / batch_size;
+
+    stats->batches++;
+    stats->packets += received;
+    stats->fill[bucket]++;
+    if (received == batch_size) {
+        stats->full_batches++;
+    }
+}
+
+/*
+ * Function: report_receive_stats
+ *
+ * Log a summary of how well receive batches have been filling since the
+ * last report, and what had to be shed, and reset the counters.
+ *
+ * Inputs:  receive_stats*     stats         Receive statistics to report
+ *          overload_shedder*  shedder       Shedder to report the shed packets of
+ *          int                receiver_num  Id of this receiver process
+ *          int                batch_size    Configured maximum batch size
+ *          int                log_queue     Id of the IPC logging queue
+ *
+ * Return:  None
+ */
+static void report_receive_stats(receive_stats* stats, overload_shedder* shedder,
+                                 int receiver_num, int batch_size, int log_queue) {
+    char log_message[LOG_MESSAGE_SIZE];
+
+    if (stats->batches > 0) {
+        sprintf(log_message, "Receiver #%d received %lu packets in %lu batches (avg fill %.1f/%d, "
+                             "%lu full, fill quartiles %lu/%lu/%lu/%lu).",
+                             receiver_num, stats->packets, stats->batches,
+                             (double)stats->packets / stats->batches, batch_size,
+                             stats->full_batches, stats->fill[0], stats->fill[1],
+                             stats->fill[2], stats->fill[3]);
+        log_info(log_message, log_queue);
+    }
+    report_shed_stats(shedder, receiver_num, log_queue);
+
+    time_t last_report = time(NULL);
+    memset(stats, 0, sizeof(receive_stats));
+    stats->last_report = last_report;
+}
+
+/*
+ * Function: packet_receiver
+ *
+ * The main function of a receiver process.  Continue pulling packets off
+ * the already bound UDP socket until the process is terminated.  Packets
+ * are received in batches of up to 'receive_batch_size' datagrams per
+ * system call, directly into the buffers that are handed to the packet
+ * transport for one of the worker processes to handle.  Unless the
+ * overload policy is to block, the receiver never waits for room in the
+ * transport, and sheds packets instead when the workers fall behind.
+ *
+ * Inputs:  int               receiver_num  Id of this receiver process
+ *          int               socket_id     Bound UDP socket to read from
+ *          freeflow_config*  config        Pointer to the configuration object
+ *          packet_transport* transport     Transport to hand packets to
+ *          int               log_queue     Id of the IPC logging queue
+ *
+ * Return:  0   Success
+ *          -1  Couldn't allocate receive buffers or overload summaries
+ */
+int packet_receiver(int receiver_num, int socket_id, freeflow_config *config,
+                    packet_transport* transport, int log_queue) {
+    signal(SIGTERM, handle_receiver_sigterm);
+    signal(SIGINT, handle_receiver_sigint);
+
+    char log_message[LOG_MESSAGE_SIZE];
+
+    int batch_size = config->receive_batch_size;
+    packet_buffer* messages = malloc(sizeof(packet_buffer) * batch_size);
+    struct mmsghdr* headers = calloc(batch_size, sizeof(struct mmsghdr));
+    struct iovec* iovecs = malloc(sizeof(struct iovec) * batch_size);
+    struct sockaddr_in* senders = malloc(sizeof(struct sockaddr_in) * batch_size);
+    overload_shedder* shedder = malloc(sizeof(overload_shedder));
+    if (!messages || !headers || !iovecs || !senders || !shedder ||
+        create_shedder(shedder, config, transport) < 0) {
+        sprintf(log_message, "Receiver #%d unable to allocate receive buffers.", receiver_num);
+        log_error(log_message, log_queue);
+        kill(getppid(), SIGTERM);
+        return -1;
+    }
+
+    /* Point each receive slot directly at the packet area of the message
+     * that will be handed to the queue, so no intermediate copy is needed */
+    int i;
+    for (i = 0; i < batch_size; i++) {
+        messages[i].mtype = 2;
+        iovecs[i].iov_base = messages[i].packet;
+        iovecs[i].iov_len = PACKET_BUFFER_SIZE;
+        headers[i].msg_hdr.msg_iov = &iovecs[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+        headers[i].msg_hdr.msg_name = &senders[i];
+    }
+
+    receive_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.last_report = time(NULL);
+
+    sprintf(log_message, "Receiver #%d [PID %d] started.", receiver_num, getpid());
+    log_info(log_message, log_queue);
+
+    /* Continue receiving packets until signalled to stop */
+    while(keep_receiving) {
+        for (i = 0; i < batch_size; i++) {
+            headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        /* Return as soon as at least one datagram is available.  recvmmsg
+         * only checks its own timeout as each datagram arrives, so with a
+         * batch timeout the rest of the batch is waited for here. */
+        int received = recvmmsg(socket_id, headers, batch_size, MSG_WAITFORONE, NULL);
+        if (received > 0 && received < batch_size && config->receive_batch_timeout > 0) {
+            received += fill_batch(socket_id, headers + received, batch_size - received,
+                                   config->receive_batch_timeout);
+        }
+        struct timespec now;
+        if (received > 0) {
+            clock_gettime(CLOCK_REALTIME, &now);
+            record_batch(&stats, received, batch_size);
+            if (config->debug) {
+                sprintf(log_message, "Receiver #%d received batch of %d packets.",
+                                     receiver_num, received);
+                log_debug(log_message, log_queue);
+            }
+        }
+
+        for (i = 0; i < received; i++) {
+            packet_buffer* message = &messages[i];
+            message->packet_len = headers[i].msg_len;
+            message->receive_time = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+            strcpy(message->sender, inet_ntoa(senders[i].sin_addr));
+            if (config->debug) {
+                sprintf(log_message, "Netflow packet received from %s.", message->sender);
+                log_debug(log_message, log_queue);
+            }
+
+            shed_send(shedder, message, senders[i].sin_addr.s_addr);
+        }
+        shed_tick(shedder);
+
+        if (config->stats_interval > 0 &&
+            time(NULL) - stats.last_report >= config->stats_interval) {
+            report_receive_stats(&stats, shedder, receiver_num, batch_size, log_queue);
+        }
+    }
+    free_shedder(shedder);
+    report_receive_stats(&stats, shedder, receiver_num, batch_size, log_queue);
+
+    free(messages);
+    free(headers);
+    free(iovecs);
+    free(senders);
+    free(shedder);
+    close(socket_id);
+    return 0;
+}
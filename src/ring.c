@@ -0,0 +1,246 @@
+#include <stdio.h>       /* Provides: sprintf */
+#include <string.h>      /* Provides: memcpy, strerror */
+#include <errno.h>       /* Provides: errno */
+#include <sched.h>       /* Provides: sched_yield */
+#include <sys/mman.h>    /* Provides: mmap, munmap */
+#include "ring.h"
+
+#define RING_RECORD_PAD  1
+#define RING_SPIN_LIMIT  64
+
+/* Every message in the ring is preceded by a record header, and each
+ * record is padded out to a whole number of cache lines.  A record that
+ * would run past the end of the data area is preceded by a pad record
+ * covering the remainder, so messages are always contiguous. */
+typedef struct ring_record {
+    uint32_t length;
+    uint32_t flags;
+} ring_record;
+
+static uint64_t record_size(uint64_t message_len);
+static void wait_for_turn(uint64_t* index, uint64_t turn);
+
+/*
+ * Function: record_size
+ *
+ * Compute the number of bytes a message occupies in the ring, including
+ * its record header, rounded up to a whole number of cache lines.
+ *
+ * Inputs:   uint64_t  message_len   Length of the message
+ *
+ * Returns:  <size of the record>
+ */
+static uint64_t record_size(uint64_t message_len) {
+    uint64_t size = sizeof(ring_record) + message_len;
+    return (size + RING_CACHE_LINE - 1) & ~(uint64_t)(RING_CACHE_LINE - 1);
+}
+
+/*
+ * Function: wait_for_turn
+ *
+ * Wait until an index reaches the position where the calling process
+ * reserved its record.  Reservations complete in the order they were
+ * made, so this only waits on other processes that reserved space
+ * earlier and are still copying.  Spin briefly, then yield the CPU so an
+ * earlier process that was preempted can finish.
+ *
+ * Inputs:   uint64_t* index    Tail index to wait on
+ *           uint64_t  turn     Value the index must reach
+ *
+ * Returns:  None
+ */
+static void wait_for_turn(uint64_t* index, uint64_t turn) {
+    int spins = 0;
+    while (__atomic_load_n(index, __ATOMIC_ACQUIRE) != turn) {
+        if (++spins > RING_SPIN_LIMIT) {
+            sched_yield();
+        }
+    }
+}
+
+/*
+ * Function: create_ring
+ *
+ * Map a shared memory ring buffer which is inherited by every process
+ * forked afterwards.  The size of the data area is rounded up to a power
+ * of two.  If hugepages are requested but none can be mapped, normal
+ * pages are used instead and 'hugepages' is cleared in the ring.
+ *
+ * Inputs:   uint64_t  size        Requested size of the data area in bytes
+ *           int       hugepages   Try to back the ring with hugepages
+ *           char*     error       Error string, if operation fails
+ *
+ * Returns:  <ring buffer>   Success
+ *           NULL            Failure
+ */
+ring_buffer* create_ring(uint64_t size, int hugepages, char* error) {
+    uint64_t ring_size = RING_MIN_SIZE;
+    while (ring_size < size) {
+        ring_size <<= 1;
+    }
+
+    uint64_t mapped_size = sizeof(ring_buffer) + ring_size;
+    void* memory = MAP_FAILED;
+
+    if (hugepages) {
+        uint64_t huge_size = (mapped_size + RING_HUGE_PAGE - 1) & ~(uint64_t)(RING_HUGE_PAGE - 1);
+        memory = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED) {
+            mapped_size = huge_size;
+        }
+        else {
+            hugepages = 0;
+        }
+    }
+
+    if (memory == MAP_FAILED) {
+        memory = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (memory == MAP_FAILED) {
+        sprintf(error, "Unable to map %lu bytes of shared memory: %s",
+                       (unsigned long)mapped_size, strerror(errno));
+        return NULL;
+    }
+
+    ring_buffer* ring = memory;
+    memset(ring, 0, sizeof(ring_buffer));
+    ring->size = ring_size;
+    ring->mask = ring_size - 1;
+    ring->mapped_size = mapped_size;
+    ring->hugepages = hugepages;
+    return ring;
+}
+
+/*
+ * Function: delete_ring
+ *
+ * Unmap a shared memory ring buffer from the calling process.  The memory
+ * is released once every process that inherited it has done the same or
+ * exited.
+ *
+ * Inputs:   ring_buffer*  ring   Ring buffer to unmap
+ *
+ * Returns:  None
+ */
+void delete_ring(ring_buffer* ring) {
+    munmap(ring, ring->mapped_size);
+}
+
+/*
+ * Function: ring_enqueue
+ *
+ * Copy a message into the ring.  Space is reserved by advancing the
+ * producer head with compare-and-swap, so any number of processes can
+ * enqueue at once, and the record is made visible to consumers by
+ * advancing the producer tail once every earlier reservation has been
+ * published.
+ *
+ * Inputs:   ring_buffer*  ring          Ring buffer to add to
+ *           void*         message       Message to copy into the ring
+ *           int           message_len   Length of the message
+ *
+ * Returns:  0    Success
+ *           -1   Ring is full
+ *           -2   Message is too large for the ring
+ */
+int ring_enqueue(ring_buffer* ring, void* message, int message_len) {
+    uint64_t needed = record_size(message_len);
+    uint64_t head, tail, offset, pad;
+
+    if (needed > ring->size / 2) {
+        return -2;
+    }
+
+    head = __atomic_load_n(&ring->prod_head, __ATOMIC_ACQUIRE);
+    do {
+        tail = __atomic_load_n(&ring->cons_tail, __ATOMIC_ACQUIRE);
+        offset = head & ring->mask;
+        pad = (offset + needed > ring->size) ? ring->size - offset : 0;
+        if (head + pad + needed - tail > ring->size) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&ring->prod_head, &head, head + pad + needed,
+                                          1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    if (pad) {
+        ring_record* filler = (ring_record*)(ring->data + offset);
+        filler->length = pad;
+        filler->flags = RING_RECORD_PAD;
+    }
+
+    ring_record* record = (ring_record*)(ring->data + ((head + pad) & ring->mask));
+    record->length = message_len;
+    record->flags = 0;
+    memcpy(record + 1, message, message_len);
+
+    __atomic_add_fetch(&ring->count, 1, __ATOMIC_RELAXED);
+    wait_for_turn(&ring->prod_tail, head);
+    __atomic_store_n(&ring->prod_tail, head + pad + needed, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Function: ring_dequeue
+ *
+ * Copy the oldest message out of the ring.  The record is claimed by
+ * advancing the consumer head with compare-and-swap, so any number of
+ * processes can dequeue at once, and its space is handed back to the
+ * producers by advancing the consumer tail once every earlier claim has
+ * been copied out.
+ *
+ * Inputs:   ring_buffer*  ring          Ring buffer to take from
+ *           void*         message       Buffer to copy the message into
+ *           int           message_len   Size of the buffer
+ *
+ * Returns:  <length of message>   Success
+ *           -1                    Ring is empty
+ */
+int ring_dequeue(ring_buffer* ring, void* message, int message_len) {
+    uint64_t head, tail, skip, length, claimed;
+    ring_record* record;
+
+    head = __atomic_load_n(&ring->cons_head, __ATOMIC_ACQUIRE);
+    do {
+        tail = __atomic_load_n(&ring->prod_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            return -1;
+        }
+
+        skip = 0;
+        record = (ring_record*)(ring->data + (head & ring->mask));
+        if (record->flags & RING_RECORD_PAD) {
+            skip = record->length;
+            record = (ring_record*)(ring->data + ((head + skip) & ring->mask));
+        }
+        length = record->length;
+        claimed = skip + record_size(length);
+    } while (!__atomic_compare_exchange_n(&ring->cons_head, &head, head + claimed,
+                                          1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    if (length > message_len) {
+        length = message_len;
+    }
+    memcpy(message, record + 1, length);
+
+    __atomic_sub_fetch(&ring->count, 1, __ATOMIC_RELAXED);
+    wait_for_turn(&ring->cons_tail, head);
+    __atomic_store_n(&ring->cons_tail, head + claimed, __ATOMIC_RELEASE);
+    return length;
+}
+
+/*
+ * Function: ring_length
+ *
+ * Helper function to return the number of messages currently waiting
+ * in a ring buffer.
+ *
+ * Inputs:   ring_buffer*  ring   Ring buffer to check
+ *
+ * Returns:  <# of messages in the ring>
+ */
+int ring_length(ring_buffer* ring) {
+    return (int)__atomic_load_n(&ring->count, __ATOMIC_RELAXED);
+}
@@ -3,74 +3,221 @@
 #include <string.h>      /* Provides: strcpy, strcat, memcpy */
 #include <netdb.h>       /* Provides: gethostbyname */
 #include <unistd.h>      /* Provides: read, write */
+#include <sys/uio.h>     /* Provides: writev */
 #include <arpa/inet.h>   /* Provides: inet_addr */
 #include <errno.h>
 #include <netinet/tcp.h>
+#include <linux/filter.h> /* Provides: sock_filter, SKF_NET_OFF */
 #include "freeflow.h"
 #include "config.h"
 #include "session.h"
 #include "logger.h"
 
+/* One SSL context for the whole process, created before the workers are
+ * forked, and the session last negotiated with each HEC server, so a
+ * reconnect can resume it instead of doing a full handshake.  Each worker
+ * fills in its own copy of the cache after the fork. */
+static SSL_CTX* ssl_context = NULL;
+static SSL_SESSION** resume_sessions = NULL;
+static int num_resume_sessions = 0;
+
+static int cache_session(SSL* ssl, SSL_SESSION* ssl_session);
 static int ssl_initialize(hec_session* session, int worker_num, freeflow_config* config, int log_queue);
+static int ssl_result(hec_session* session, int result);
 static int enable_keepalives(int socket_id, char* error);
+static int steer_by_exporter(int socket_id, int num_receivers, char* error);
 static int connect_socket(hec_session* session, int worker_num, freeflow_config *config, int log_queue);
 
 /*
- * Function: ssl_initialize
+ * Function: create_ssl_context
  *
- * Initialize an SSL session over an open TCP socket.  Return
- * the session handle if successful, and NULL otherwise.
+ * Create the SSL context every HEC session of the process is made from,
+ * and the cache of sessions to resume.  TLS 1.2 is the oldest version
+ * accepted.  Set 'error' if unsuccessful.
  *
- * Inputs:   int   socket_id    Id of the socket
- *           int   log_queue    Id of IPC queue for logging
+ * Inputs:   freeflow_config* config        Configuration object
+ *           char*            error         Error string, if operation fails
  *
- * Returns:  <SSL object>     Success
- *           NULL             Failure
+ * Returns:  0     Success
+ *           -1    Couldn't create the SSL context
+ *           -2    Couldn't allocate the session cache
  */
-static int ssl_initialize(hec_session* session, int worker_num, freeflow_config* config, int log_queue) {
-    const SSL_METHOD *method;
-    SSL_CTX *ctx;
-    char log_message[LOG_MESSAGE_SIZE];
+int create_ssl_context(freeflow_config* config, char* error) {
     char ssl_error[120];
 
-    session->is_ssl = 1;
- 
     SSL_library_init();
     OpenSSL_add_all_algorithms();
     SSL_load_error_strings();
-    method = TLSv1_2_client_method();
-    ctx = SSL_CTX_new(method);
 
-    if ( ctx == NULL )
-    {
+    ssl_context = SSL_CTX_new(TLS_client_method());
+    if (ssl_context == NULL) {
         ERR_error_string(ERR_get_error(), ssl_error);
-        sprintf(log_message, "Worker #%d SSL Error: ", worker_num);
-        strcat(log_message, ssl_error);
-        log_error(log_message, log_queue);
-        return -1;        
+        sprintf(error, "SSL Error: %s", ssl_error);
+        return -1;
     }
-    else if (config->debug){
-        sprintf(log_message, "Worker #%d SSL initialized using TLS 1.2 method.", worker_num);
-        log_debug(log_message, log_queue);
+    SSL_CTX_set_min_proto_version(ssl_context, TLS1_2_VERSION);
+#ifdef SSL_OP_ENABLE_KTLS
+    if (config->ssl_ktls) {
+        SSL_CTX_set_options(ssl_context, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+
+    /* Sessions are only kept in resume_sessions, by server, as they are
+     * negotiated.  With TLS 1.3 that is after the handshake. */
+    SSL_CTX_set_session_cache_mode(ssl_context, SSL_SESS_CACHE_CLIENT |
+                                                SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_context, cache_session);
+
+    resume_sessions = calloc(config->num_servers, sizeof(SSL_SESSION*));
+    if (resume_sessions == NULL) {
+        sprintf(error, "Unable to allocate the SSL session cache");
+        free_ssl_context();
+        return -2;
     }
+    num_resume_sessions = config->num_servers;
+    return 0;
+}
 
-    session->ssl_session = SSL_new(ctx);
-    SSL_set_fd(session->ssl_session, session->socket_id);
-    if ( SSL_connect(session->ssl_session) == -1 ) {
+/*
+ * Function: free_ssl_context
+ *
+ * Release the SSL context, and any sessions cached for resumption.
+ *
+ * Inputs:   None
+ *
+ * Returns:  None
+ */
+void free_ssl_context() {
+    int i;
+
+    if (resume_sessions) {
+        for (i = 0; i < num_resume_sessions; i++) {
+            if (resume_sessions[i]) {
+                SSL_SESSION_free(resume_sessions[i]);
+            }
+        }
+        free(resume_sessions);
+        resume_sessions = NULL;
+        num_resume_sessions = 0;
+    }
+    if (ssl_context) {
+        SSL_CTX_free(ssl_context);
+        ssl_context = NULL;
+    }
+}
+
+/*
+ * Function: cache_session
+ *
+ * Keep a newly negotiated session as the one to resume with the server
+ * the connection is to, in place of any older one.
+ *
+ * Inputs:   SSL*          ssl           Connection the session is for
+ *           SSL_SESSION*  ssl_session   Session negotiated
+ *
+ * Returns:  1     The session was kept
+ *           0     The session wasn't kept
+ */
+static int cache_session(SSL* ssl, SSL_SESSION* ssl_session) {
+    SSL_SESSION** slot = SSL_get_app_data(ssl);
+
+    if (slot == NULL) {
+        return 0;
+    }
+    if (*slot) {
+        SSL_SESSION_free(*slot);
+    }
+    *slot = ssl_session;
+    return 1;
+}
+
+/*
+ * Function: ssl_initialize
+ *
+ * Create the SSL object for a session, over a TCP socket that may still
+ * be connecting.  The handshake is driven by session_connect once the
+ * socket is connected, so it never blocks.  The last session with the
+ * same server is offered for resumption.
+ *
+ * Inputs:   hec_session*     session       Session to add SSL to
+ *           int              worker_num    Id of the worker process
+ *           freeflow_config* config        Configuration object
+ *           int              log_queue     Id of IPC queue for logging
+ *
+ * Returns:  0     Success
+ *           -1    No SSL context has been created
+ *           -2    Couldn't create the SSL object
+ */
+static int ssl_initialize(hec_session* session, int worker_num, freeflow_config* config, int log_queue) {
+    char log_message[LOG_MESSAGE_SIZE];
+    char ssl_error[120];
+
+    if (ssl_context == NULL) {
+        sprintf(log_message, "Worker #%d SSL Error: no SSL context.", worker_num);
+        log_error(log_message, log_queue);
+        return -1;
+    }
+
+    session->ssl_session = SSL_new(ssl_context);
+    if (session->ssl_session == NULL) {
         ERR_error_string(ERR_get_error(), ssl_error);
         sprintf(log_message, "Worker #%d SSL Error: ", worker_num);
         strcat(log_message, ssl_error);
         log_error(log_message, log_queue);
-        return -2;        
+        return -2;
     }
-    else if (config->debug){
-        sprintf(log_message, "Worker #%d SSL is connected over socket #%d.", worker_num, session->socket_id);
-        log_debug(log_message, log_queue);
+
+    int server = session->hec - config->hec_server;
+    if (server >= 0 && server < num_resume_sessions) {
+        SSL_set_app_data(session->ssl_session, &resume_sessions[server]);
+        if (resume_sessions[server]) {
+            SSL_set_session(session->ssl_session, resume_sessions[server]);
+        }
     }
-    
+
+    /* A write that can't complete is retried later from the same request
+     * buffer, with whatever is left of it. */
+    SSL_set_mode(session->ssl_session, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                       SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_set_fd(session->ssl_session, session->socket_id);
+    SSL_set_connect_state(session->ssl_session);
+    session->is_ssl = 1;
     return 0;
 }
 
+/*
+ * Function: ssl_result
+ *
+ * Translate the result of an SSL operation that didn't transfer any data
+ * into the return values of session_read and session_write.
+ *
+ * Inputs:   hec_session*  session   Session the operation was done on
+ *           int           result    Value returned by the operation
+ *
+ * Returns:  SESSION_WANT_READ    Retry once the socket is readable
+ *           SESSION_WANT_WRITE   Retry once the socket is writable
+ *           0                    The connection was closed
+ *           -1                   Failure, with errno set
+ */
+static int ssl_result(hec_session* session, int result) {
+    int error = SSL_get_error(session->ssl_session, result);
+    ERR_clear_error();
+
+    switch (error) {
+        case SSL_ERROR_WANT_READ:
+            return SESSION_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return SESSION_WANT_WRITE;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            return (result == 0 || errno == 0) ? 0 : -1;
+        default:
+            errno = EPROTO;
+            return -1;
+    }
+}
+
 /*
  * Function: enable_keepalives
  *
@@ -112,23 +259,59 @@ static int enable_keepalives(int socket_id, char* error) {
     return 0;
 }
 
+/*
+ * Function: steer_by_exporter
+ *
+ * Attach a classic BPF program to the SO_REUSEPORT group of a socket which
+ * selects the receiving socket by the IPv4 source address of the datagram,
+ * so every packet from a given exporter lands on the same receiver.  Set
+ * 'error' if unsuccessful.
+ *
+ * Inputs:   int   socket_id      Id of a bound socket in the group
+ *           int   num_receivers  Number of sockets in the group
+ *           char* error          Error string, if operation fails
+ *
+ * Returns:  0     Success
+ *           -1    Couldn't attach the program
+ */
+static int steer_by_exporter(int socket_id, int num_receivers, char* error) {
+    struct sock_filter code[] = {
+        /* A = source address from the IPv4 header */
+        { BPF_LD  | BPF_W   | BPF_ABS, 0, 0, SKF_NET_OFF + 12 },
+        /* A = A % num_receivers */
+        { BPF_ALU | BPF_MOD | BPF_K,   0, 0, num_receivers },
+        /* Use A as the index of the socket in the group */
+        { BPF_RET | BPF_A,             0, 0, 0 },
+    };
+    struct sock_fprog program = { sizeof(code) / sizeof(code[0]), code };
+
+    if (setsockopt(socket_id, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, 
+                   &program, sizeof(program)) < 0) {
+        sprintf(error, "Unable to attach reuseport steering program: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
 /*
  * Function: connect_socket
  *
- * Initialize and establish a TCP connection to a Splunk HTTP Event Collector
- * using information in the configuration object.  Return an error 
- * if unsuccessful.
+ * Start a TCP connection to the Splunk HTTP Event Collector the session is
+ * for.  The socket is non-blocking, so the connection is usually still
+ * being established on return, and is completed by session_connect.
+ * Return an error if unsuccessful.
  *
- * Inputs:   int              worker_num    Id of the worker process
+ * Inputs:   hec_session*     session       Session to connect
+ *           int              worker_num    Id of the worker process
  *           freeflow_config* config*       Configuration object
  *           int              log_queue     Id of IPC queue for logging
  *
- * Returns:  <socket id>    Success
+ * Returns:  0              Success
  *           -1             Couldn't create socket object
  *           -2             Couldn't enable keepalives
  *           -3             Unable to gethostbyname
  *           -4             Couldn't connect to server
- *           -5             Couldn't enable recv timeout
+ *           -5             Couldn't disable Nagle's algorithm
  */
 static int connect_socket(hec_session* session, int worker_num, freeflow_config *config, int log_queue) {
     struct sockaddr_in addr;
@@ -136,7 +319,7 @@ static int connect_socket(hec_session* session, int worker_num, freeflow_config
     char log_message[LOG_MESSAGE_SIZE];
     char error_message[LOG_MESSAGE_SIZE];
 
-    if((session->socket_id = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if((session->socket_id = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
         sprintf(log_message, "Error opening socket: %s", strerror(errno));
         log_error(log_message, log_queue);
         return -1;
@@ -148,22 +331,19 @@ static int connect_socket(hec_session* session, int worker_num, freeflow_config
         return -2;
     }
 
-    /* TODO:  This should be in a separate function */
-    struct timeval timeout;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
-    if (setsockopt(session->socket_id, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout)) < 0) {
-        sprintf(log_message, "Unable to enable keepalives on socket: %s", error_message);
+    /* Requests are pipelined, so each must go out as soon as it's written
+     * rather than wait for the response to the one before it. */
+    int yes = 1;
+    if (setsockopt(session->socket_id, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0) {
+        sprintf(log_message, "Unable to disable Nagle's algorithm on socket: %s", strerror(errno));
         log_error(log_message, log_queue);
         return -5;
     }
 
     addr.sin_family = AF_INET;
 
-    int hec_instance = worker_num % config->num_servers;
-    int   hec_port = config->hec_server[hec_instance].port;
-    char* hec_addr = config->hec_server[hec_instance].addr;
-    session->hec = &config->hec_server[hec_instance];
+    int   hec_port = session->hec->port;
+    char* hec_addr = session->hec->addr;
 
     host = gethostbyname(hec_addr);
     if(host == NULL) {
@@ -174,22 +354,21 @@ static int connect_socket(hec_session* session, int worker_num, freeflow_config
 
     bcopy(host->h_addr, &addr.sin_addr, host->h_length);
     addr.sin_port = htons(hec_port);
-    if (connect(session->socket_id, (struct sockaddr*) &addr, sizeof(struct sockaddr_in)) < 0) {
+    if (connect(session->socket_id, (struct sockaddr*) &addr, sizeof(struct sockaddr_in)) == 0) {
+        session->connected = 1;
+    }
+    else if (errno != EINPROGRESS) {
         sprintf(log_message, "Worker #%d couldn't connect to %s:%d: %s."
                            , worker_num, hec_addr, hec_port, strerror(errno));
         log_error(log_message, log_queue);
         return -4;
     } 
-    else if (config->debug) {
-        sprintf(log_message, "Worker #%d TCP socket [%d] connected to %s:%d."
+
+    if (config->debug) {
+        sprintf(log_message, "Worker #%d TCP socket [%d] connecting to %s:%d."
                            , worker_num, session->socket_id, hec_addr, hec_port);
         log_debug(log_message, log_queue);
     }
-        
-
-    sprintf(log_message, "Worker #%d connected to HEC %s:%d", worker_num, hec_addr, hec_port);
-    log_info(log_message, log_queue);
-
     return 0;
 }
 
@@ -197,19 +376,27 @@ static int connect_socket(hec_session* session, int worker_num, freeflow_config
  * Function: bind_socket
  *
  * Initialize and bind a UDP socket for receiving Netflow using information 
- * passed in the configuration object.  Return an error if unsuccessful.
+ * passed in the configuration object.  Every receiver binds its own socket
+ * to the same address and port with SO_REUSEPORT, and the kernel spreads
+ * datagrams across them.  The sFlow receiver binds the sFlow port instead.
+ * Return an error if unsuccessful.
  *
- * Inputs:   freeflow_config* config*       Configuration object
+ * Inputs:   int              receiver_num  Id of the receiver the socket is for
+ *           int              port          Port to bind to
+ *           freeflow_config* config*       Configuration object
  *           int              log_queue     Id of IPC queue for logging
  *
  * Returns:  <socket id>    Success
  *           -1             Couldn't create socket object
  *           -2             Couldn't enable keepalives
  *           -3             Couldn't bind local socket
+ *           -4             Couldn't enable port reuse
+ *           -5             Couldn't attach steering program
  */
-int bind_socket(freeflow_config *config, int log_queue) {
+int bind_socket(int receiver_num, int port, freeflow_config *config, int log_queue) {
     struct sockaddr_in si_me;
     char log_message[LOG_MESSAGE_SIZE];
+    char error_message[LOG_MESSAGE_SIZE];
     
     int result;
     int socket_id;
@@ -231,34 +418,54 @@ int bind_socket(freeflow_config *config, int log_queue) {
         log_error(log_message, log_queue);
         return -2;
     }
+
+    int yes = 1;
+    result = setsockopt(socket_id, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+    if (result < 0) {
+        sprintf(log_message, "Unable to enable port reuse on socket: %s", strerror(errno));
+        log_error(log_message, log_queue);
+        return -4;
+    }
     
     memset((char *) &si_me, 0, sizeof(si_me));
     si_me.sin_family = AF_INET;
-    si_me.sin_port = htons(config->bind_port);
+    si_me.sin_port = htons(port);
     si_me.sin_addr.s_addr = inet_addr(config->bind_addr);
     
     if (bind(socket_id, (struct sockaddr *)&si_me, sizeof(si_me)) < 0) {
         sprintf(log_message, "Couldn't bind local socket %s:%d: %s", config->bind_addr, 
-                                                                     config->bind_port,
+                                                                     port,
                                                                      strerror(errno));
         log_error(log_message, log_queue);
         return -3;
     }
 
-    sprintf(log_message, "Socket bound and listening on %s:%d.", config->bind_addr,
-                                                                 config->bind_port);
+    /* The program belongs to the whole reuseport group, so it only needs
+     * to be attached once, through the first socket. */
+    if (config->receiver_steering && receiver_num == 0 && port == config->bind_port) {
+        if (steer_by_exporter(socket_id, config->receivers, error_message) < 0) {
+            log_error(error_message, log_queue);
+            return -5;
+        }
+    }
+
+    sprintf(log_message, "Socket #%d bound and listening on %s:%d.", receiver_num,
+                                                                     config->bind_addr,
+                                                                     port);
     log_info(log_message, log_queue);
     return(socket_id);
 }
 
 /*
- * Function: initialize_session
+ * Function: open_session
  *
- * Initialize either a normal TCP or SSL connection to a Splunk HTTP Event Collector
- * based on the information in the configuration object.  Return an error
- * if unsuccessful.
+ * Start either a normal TCP or SSL connection to a Splunk HTTP Event
+ * Collector, based on the information in the configuration object.  The
+ * connection is non-blocking, and must be completed with session_connect.
+ * Return an error if unsuccessful.
  *
  * Inputs:   hec_session*     session       Object to store session information
+ *           hec*             server        HEC server to connect to
  *           int              worker_num    Id of the worker process
  *           freeflow_config* config*       Configuration object
  *           int              log_queue     Id of IPC queue for logging
@@ -267,10 +474,17 @@ int bind_socket(freeflow_config *config, int log_queue) {
  *           -1   Couldn't create socket object
  *           -2   Couldn't initialize SSL
  */
-int initialize_session(hec_session* session, int worker_num, freeflow_config *config, int log_queue) {
+int open_session(hec_session* session, hec* server, int worker_num, freeflow_config *config,
+                 int log_queue) {
     char log_message[LOG_MESSAGE_SIZE];
 
+    session->is_ssl = 0;
+    session->connected = 0;
+    session->ktls_send = 0;
+    session->ssl_session = NULL;
+    session->hec = server;
     if ((connect_socket(session, worker_num, config, log_queue)) < 0) {
+        close_session(session);
         return -1;        
     }
 
@@ -278,6 +492,7 @@ int initialize_session(hec_session* session, int worker_num, freeflow_config *co
         if ((ssl_initialize(session, worker_num, config, log_queue)) < 0) {
             sprintf(log_message, "Worker #%d can't establish SSL connection with Splunk.", worker_num);
             log_error(log_message, log_queue);
+            close_session(session);
             return -2;
         }
     }
@@ -285,29 +500,109 @@ int initialize_session(hec_session* session, int worker_num, freeflow_config *co
 }
 
 /*
- * Function: reestablish_session
+ * Function: session_connect
  *
- * Attempt to reinitialize a Splunk HTTP Event Collector session that failed during
- * the program's operations.  This process will attempt to establish a new connection
- * every 10s indefinitely, effectively blocking the calling process until the condition 
- * clears.
+ * Continue connecting a session opened with open_session, once its socket
+ * is readable or writable.  Completes the TCP connection, then the SSL
+ * handshake if the session uses SSL.  If OpenSSL handed encryption of the
+ * session to the kernel, requests are written straight to the socket
+ * from then on.  Set 'error' if unsuccessful.
  *
- * Inputs:   hec_session*     session       Object to store session information
- *           int              worker_num    Id of the worker process
- *           freeflow_config* config*       Configuration object
- *           int              log_queue     Id of IPC queue for logging
+ * Inputs:   hec_session*  session   Session being connected
+ *           char*         error     Error string, if operation fails
  *
- * Returns:  0    Success
+ * Returns:  0                    The session is ready for requests
+ *           SESSION_WANT_READ    Call again once the socket is readable
+ *           SESSION_WANT_WRITE   Call again once the socket is writable
+ *           -1                   The connection failed
  */
-int reestablish_session(hec_session* session, int worker_num, freeflow_config *config, int log_queue) {
-    int result;
+int session_connect(hec_session* session, char* error) {
+    if (!session->connected) {
+        int status = 0;
+        socklen_t len = sizeof(status);
+        if (getsockopt(session->socket_id, SOL_SOCKET, SO_ERROR, &status, &len) < 0) {
+            status = errno;
+        }
+        if (status != 0) {
+            sprintf(error, "%s", strerror(status));
+            return -1;
+        }
+        session->connected = 1;
+    }
 
-    do {
-        sleep(10);
-        result = initialize_session(session, worker_num, config, log_queue);
-    } while (result != 0);
+    if (!session->is_ssl) {
+        return 0;
+    }
 
-    return 0;
+    int result = SSL_connect(session->ssl_session);
+    if (result == 1) {
+#ifdef BIO_get_ktls_send
+        session->ktls_send = BIO_get_ktls_send(SSL_get_wbio(session->ssl_session));
+#endif
+        return 0;
+    }
+
+    switch (SSL_get_error(session->ssl_session, result)) {
+        case SSL_ERROR_WANT_READ:
+            return SESSION_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return SESSION_WANT_WRITE;
+    }
+
+    unsigned long ssl_error = ERR_get_error();
+    if (ssl_error) {
+        strcpy(error, "SSL Error: ");
+        ERR_error_string_n(ssl_error, error + strlen(error), 120);
+    }
+    else {
+        sprintf(error, "SSL handshake failed: %s", errno ? strerror(errno) : "Connection closed");
+    }
+    ERR_clear_error();
+    return -1;
+}
+
+/*
+ * Function: session_resumed
+ *
+ * Check whether a connected session resumed an earlier SSL session rather
+ * than doing a full handshake.
+ *
+ * Inputs:   hec_session*  session   Session to check
+ *
+ * Returns:  1    The SSL session was resumed
+ *           0    It wasn't, or the session doesn't use SSL
+ */
+int session_resumed(hec_session* session) {
+    return session->is_ssl && SSL_session_reused(session->ssl_session);
+}
+
+/*
+ * Function: close_session
+ *
+ * Close the connection of a session, and release its SSL object.  An
+ * established SSL session is shut down cleanly, as far as that can be done
+ * without blocking, so it stays resumable.
+ *
+ * Inputs:   hec_session*  session   Session to close
+ *
+ * Returns:  None
+ */
+void close_session(hec_session* session) {
+    if (session->ssl_session) {
+        if (SSL_is_init_finished(session->ssl_session)) {
+            SSL_shutdown(session->ssl_session);
+        }
+        ERR_clear_error();
+        SSL_free(session->ssl_session);
+        session->ssl_session = NULL;
+    }
+    if (session->socket_id >= 0) {
+        close(session->socket_id);
+        session->socket_id = -1;
+    }
+    session->connected = 0;
+    session->ktls_send = 0;
+    session->is_ssl = 0;
 }
 
 /*
@@ -315,73 +610,95 @@ int reestablish_session(hec_session* session, int worker_num, freeflow_config *c
  *
  * Wrapper function to call the appropiate socket or SSL read function
  * for this particular session.  Sets the message variable with the
- * message read.
+ * message read.  Never blocks.
  *
  * Inputs:   hec_session*  session       Object to store session information
  *           char*         message       Message read from the session
  *           int           message_len   Size of the message object
  *
  * Returns:  <number of bytes read>   Success
- *           <negative integer>       Failure
+ *           SESSION_WANT_READ        Nothing to read yet
+ *           SESSION_WANT_WRITE       Call again once the socket is writable
+ *           0                        The connection was closed
+ *           -1                       Failure, with errno set
  */
 int session_read(hec_session* session, char* message, int message_len) {
-    memset(message, 0, message_len);
+    int bytes;
 
     if (session->is_ssl) {
-        return SSL_read(session->ssl_session, message, message_len);
+        bytes = SSL_read(session->ssl_session, message, message_len);
+        return (bytes > 0) ? bytes : ssl_result(session, bytes);
     }
-    else {
-        return read(session->socket_id, message, message_len);
+
+    bytes = read(session->socket_id, message, message_len);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return SESSION_WANT_READ;
     }
+    return bytes;
 }
 
 /*
  * Funtion: session_write
  *
  * Wrapper function to call the appropiate socket or SSL write function
- * for this particular session.  Sends the bytes set in the message
- * variable.
+ * for this particular session.  Sends as many of the bytes set in the
+ * message variable as the socket will take without blocking.  With kTLS
+ * the kernel encrypts, so SSL sessions are written like plain sockets.
  *
  * Inputs:   hec_session*  session       Object to store session information
  *           char*         message       Message read from the session
  *           int           message_len   Size of the message object
  *
  * Returns:  <number of bytes sent>   Success
- * Returns:  <negative integer>       Failure
+ *           SESSION_WANT_WRITE       The socket buffer is full
+ *           SESSION_WANT_READ        Call again once the socket is readable
+ *           0                        The connection was closed
+ *           -1                       Failure, with errno set
  */
 int session_write(hec_session* session, char* message, int message_len) {
-    if (session->is_ssl) {
-        return SSL_write(session->ssl_session, message, message_len);
+    int bytes;
+
+    if (session->is_ssl && !session->ktls_send) {
+        bytes = SSL_write(session->ssl_session, message, message_len);
+        return (bytes > 0) ? bytes : ssl_result(session, bytes);
     }
-    else {
-        return write(session->socket_id, message, message_len);
+
+    bytes = write(session->socket_id, message, message_len);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return SESSION_WANT_WRITE;
     }
+    return bytes;
 }
 
 /*
- * Funtion: session_status
+ * Funtion: session_writev
  *
- * Wrapper function to call the appropiate socket or SSL read function
- * for this particular session.
+ * Send as many bytes of a list of segments as the socket will take
+ * without blocking, in one call.  Plain sockets, and SSL sessions the
+ * kernel encrypts, gather the segments with writev.  Otherwise OpenSSL
+ * takes one buffer at a time, so only the first segment is written, and
+ * callers should keep what they send over SSL in one segment.
  *
- * Inputs:   hec_session*  session         Object to store session information
- *           char*         error_message   Error message, if any
+ * Inputs:   hec_session*   session     Object to store session information
+ *           struct iovec*  iov         Segments to send
+ *           int            iov_count   Number of segments
  *
- * Returns:  0                   No error
- * Returns:  <negative integer>  Error code
+ * Returns:  <number of bytes sent>   Success
+ *           SESSION_WANT_WRITE       The socket buffer is full
+ *           SESSION_WANT_READ        Call again once the socket is readable
+ *           0                        The connection was closed
+ *           -1                       Failure, with errno set
  */
-int session_status(hec_session* session, char* error_message) {
-    int error = 0;
-    socklen_t len = sizeof(error);
-    int result = getsockopt (session->socket_id, SOL_SOCKET, SO_ERROR, &error, &len);
-    
-    if (result != 0) {
-        sprintf(error_message, "Unabled to get status of session");
-        return result;
+int session_writev(hec_session* session, struct iovec* iov, int iov_count) {
+    int bytes;
+
+    if (session->is_ssl && !session->ktls_send) {
+        return session_write(session, iov[0].iov_base, iov[0].iov_len);
     }
 
-    if (error != 0) {
-        sprintf(error_message, "%s",  strerror(error));
+    bytes = writev(session->socket_id, iov, iov_count);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return SESSION_WANT_WRITE;
     }
-    return error;
+    return bytes;
 }
@@ -0,0 +1,594 @@
+#include <string.h>      /* Provides: memcpy, memset, strlen */
+#include "sflow.h"
+#include "netflow.h"
+#include "template.h"
+
+/* The part of a datagram still to be read.  Every sample and record is
+ * read through a cursor of its own, bounded by its length, so a bad
+ * length can't take the parser outside the datagram. */
+typedef struct xdr_cursor {
+    unsigned char* pos;
+    unsigned char* end;
+} xdr_cursor;
+
+/* Widths of the generic interface counters, in bytes */
+static const int counter_widths[SFLOW_COUNTERS] = {
+    4, 4, 8, 4, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4
+};
+
+static int xdr_uint32(xdr_cursor* xdr, uint32_t* value);
+static int xdr_uint64(xdr_cursor* xdr, uint64_t* value);
+static int xdr_opaque(xdr_cursor* xdr, uint32_t length, xdr_cursor* opaque);
+static int xdr_element(xdr_cursor* xdr, uint32_t* format, xdr_cursor* element);
+static int xdr_address(xdr_cursor* xdr, uint32_t* addr);
+static int decode_header(xdr_cursor* record, uint64_t* flow);
+static int decode_ipv4_data(xdr_cursor* record, uint64_t* flow);
+static int decode_gateway(xdr_cursor* record, uint64_t* flow);
+static int decode_flow_sample(xdr_cursor* sample, int expanded, uint64_t* flow);
+static int decode_counter_sample(xdr_cursor* sample, int expanded, uint64_t* counters);
+static char* format_counters(char* cursor, record_format* format, char* sender,
+                             int sender_len, uint64_t* counters, int64_t time);
+static int read_datagram(packet_buffer* packet, record_format* format, char** cursor,
+                         int num_records);
+
+/*
+ * Function: xdr_uint32
+ *
+ * Read a 32 bit unsigned integer.
+ *
+ * Inputs:   xdr_cursor*  xdr     Cursor to read from
+ *           uint32_t*    value   Where to store the value, in host order
+ *
+ * Returns:  0    Success
+ *           -1   Not enough left to read
+ */
+static int xdr_uint32(xdr_cursor* xdr, uint32_t* value) {
+    unsigned char* p = xdr->pos;
+    if (xdr->end - p < 4) {
+        return -1;
+    }
+    *value = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    xdr->pos += 4;
+    return 0;
+}
+
+/*
+ * Function: xdr_uint64
+ *
+ * Read a 64 bit unsigned integer.
+ *
+ * Inputs:   xdr_cursor*  xdr     Cursor to read from
+ *           uint64_t*    value   Where to store the value, in host order
+ *
+ * Returns:  0    Success
+ *           -1   Not enough left to read
+ */
+static int xdr_uint64(xdr_cursor* xdr, uint64_t* value) {
+    uint32_t high, low;
+    if (xdr_uint32(xdr, &high) < 0 || xdr_uint32(xdr, &low) < 0) {
+        return -1;
+    }
+    *value = (uint64_t)high << 32 | low;
+    return 0;
+}
+
+/*
+ * Function: xdr_opaque
+ *
+ * Take the next 'length' bytes as a cursor of their own, and skip them
+ * along with the padding to the next 32 bit boundary.
+ *
+ * Inputs:   xdr_cursor*  xdr      Cursor to read from
+ *           uint32_t     length   Number of bytes to take
+ *           xdr_cursor*  opaque   Cursor over the bytes taken
+ *
+ * Returns:  0    Success
+ *           -1   Not enough left to read
+ */
+static int xdr_opaque(xdr_cursor* xdr, uint32_t length, xdr_cursor* opaque) {
+    uint32_t left = xdr->end - xdr->pos;
+    if (length > left) {
+        return -1;
+    }
+
+    opaque->pos = xdr->pos;
+    opaque->end = xdr->pos + length;
+    length = (length + 3) & ~3u;
+    xdr->pos += length < left ? length : left;
+    return 0;
+}
+
+/*
+ * Function: xdr_element
+ *
+ * Read the data format and length a sample or record starts with, and
+ * take its data as a cursor of its own.
+ *
+ * Inputs:   xdr_cursor*  xdr       Cursor to read from
+ *           uint32_t*    format    Where to store the data format
+ *           xdr_cursor*  element   Cursor over the data
+ *
+ * Returns:  0    Success
+ *           -1   Not enough left to read
+ */
+static int xdr_element(xdr_cursor* xdr, uint32_t* format, xdr_cursor* element) {
+    uint32_t length;
+    if (xdr_uint32(xdr, format) < 0 || xdr_uint32(xdr, &length) < 0) {
+        return -1;
+    }
+    return xdr_opaque(xdr, length, element);
+}
+
+/*
+ * Function: xdr_address
+ *
+ * Read an address, which is an IPv4 or IPv6 address after its type.
+ *
+ * Inputs:   xdr_cursor*  xdr    Cursor to read from
+ *           uint32_t*    addr   Where to store an IPv4 address, in host
+ *                               order, or 0 for an IPv6 address
+ *
+ * Returns:  0    Success
+ *           -1   Not enough left to read, or an unknown type
+ */
+static int xdr_address(xdr_cursor* xdr, uint32_t* addr) {
+    xdr_cursor ipv6;
+    uint32_t type;
+
+    if (xdr_uint32(xdr, &type) < 0) {
+        return -1;
+    }
+    *addr = 0;
+    switch (type) {
+        case SFLOW_ADDRESS_IPV4:
+            return xdr_uint32(xdr, addr);
+        case SFLOW_ADDRESS_IPV6:
+            return xdr_opaque(xdr, 16, &ipv6);
+    }
+    return -1;
+}
+
+/*
+ * Function: decode_header
+ *
+ * Decode the addresses, ports and flags of a sampled packet from the
+ * headers it starts with, which may be of an Ethernet frame, with or
+ * without VLAN tags, or of an IPv4 packet.  Packets that aren't IPv4
+ * aren't decoded.
+ *
+ * Inputs:   xdr_cursor*  record   Raw packet header record
+ *           uint64_t*    flow     Flow fields to fill in
+ *
+ * Returns:  1    The sampled packet is IPv4
+ *           0    It isn't
+ *           -1   The record is malformed
+ */
+static int decode_header(xdr_cursor* record, uint64_t* flow) {
+    uint32_t protocol, frame_length, stripped, header_length;
+    xdr_cursor header;
+
+    if (xdr_uint32(record, &protocol) < 0 || xdr_uint32(record, &frame_length) < 0 ||
+        xdr_uint32(record, &stripped) < 0 || xdr_uint32(record, &header_length) < 0 ||
+        xdr_opaque(record, header_length, &header) < 0) {
+        return -1;
+    }
+
+    unsigned char* p = header.pos;
+    int length = header.end - header.pos;
+    int offset = 0;
+
+    if (protocol == SFLOW_HEADER_ETHERNET) {
+        if (length < 14) {
+            return 0;
+        }
+        int type = p[12] << 8 | p[13];
+        offset = 14;
+        while ((type == 0x8100 || type == 0x88a8) && offset + 4 <= length) {
+            type = p[offset + 2] << 8 | p[offset + 3];
+            offset += 4;
+        }
+        if (type != 0x0800) {
+            return 0;
+        }
+    }
+    else if (protocol != SFLOW_HEADER_IPV4) {
+        return 0;
+    }
+
+    unsigned char* ip = p + offset;
+    if (offset + 20 > length || (ip[0] >> 4) != 4 || (ip[0] & 0x0f) < 5) {
+        return 0;
+    }
+    int ip_header_len = (ip[0] & 0x0f) * 4;
+
+    flow[FLOW_TOS] = ip[1];
+    flow[FLOW_BYTES] = ip[2] << 8 | ip[3];
+    flow[FLOW_PROT] = ip[9];
+    flow[FLOW_SRCADDR] = (uint32_t)ip[12] << 24 | ip[13] << 16 | ip[14] << 8 | ip[15];
+    flow[FLOW_DSTADDR] = (uint32_t)ip[16] << 24 | ip[17] << 16 | ip[18] << 8 | ip[19];
+
+    /* Only the first fragment has the ports */
+    unsigned char* l4 = ip + ip_header_len;
+    int l4_len = length - offset - ip_header_len;
+    if (((ip[6] & 0x1f) << 8 | ip[7]) != 0 || (ip[9] != 6 && ip[9] != 17) || l4_len < 4) {
+        return 1;
+    }
+    flow[FLOW_SRCPORT] = l4[0] << 8 | l4[1];
+    flow[FLOW_DSTPORT] = l4[2] << 8 | l4[3];
+    if (ip[9] == 6 && l4_len >= 14) {
+        flow[FLOW_TCP_FLAGS] = l4[13];
+    }
+    return 1;
+}
+
+/*
+ * Function: decode_ipv4_data
+ *
+ * Decode a sampled IPv4 packet, as the agent already decoded it.
+ *
+ * Inputs:   xdr_cursor*  record   IPv4 data record
+ *           uint64_t*    flow     Flow fields to fill in
+ *
+ * Returns:  1    Success
+ *           -1   The record is malformed
+ */
+static int decode_ipv4_data(xdr_cursor* record, uint64_t* flow) {
+    uint32_t values[8];
+    int i;
+
+    /* Length, protocol, addresses, ports, TCP flags and ToS */
+    for (i = 0; i < 8; i++) {
+        if (xdr_uint32(record, &values[i]) < 0) {
+            return -1;
+        }
+    }
+    flow[FLOW_BYTES] = values[0];
+    flow[FLOW_PROT] = values[1];
+    flow[FLOW_SRCADDR] = values[2];
+    flow[FLOW_DSTADDR] = values[3];
+    flow[FLOW_SRCPORT] = values[4];
+    flow[FLOW_DSTPORT] = values[5];
+    flow[FLOW_TCP_FLAGS] = values[6];
+    flow[FLOW_TOS] = values[7];
+    return 1;
+}
+
+/*
+ * Function: decode_gateway
+ *
+ * Decode the AS numbers of an extended gateway record.  The destination
+ * AS is the last one in the AS path.
+ *
+ * Inputs:   xdr_cursor*  record   Extended gateway record
+ *           uint64_t*    flow     Flow fields to fill in
+ *
+ * Returns:  0    Success
+ *           -1   The record is malformed
+ */
+static int decode_gateway(xdr_cursor* record, uint64_t* flow) {
+    uint32_t nexthop, as, src_as, src_peer_as, segments, type, count, dst_as = 0;
+    xdr_cursor path;
+
+    if (xdr_address(record, &nexthop) < 0 || xdr_uint32(record, &as) < 0 ||
+        xdr_uint32(record, &src_as) < 0 || xdr_uint32(record, &src_peer_as) < 0 ||
+        xdr_uint32(record, &segments) < 0) {
+        return -1;
+    }
+
+    while (segments-- > 0) {
+        if (xdr_uint32(record, &type) < 0 || xdr_uint32(record, &count) < 0 ||
+            count > (uint32_t)(record->end - record->pos) / 4 ||
+            xdr_opaque(record, count * 4, &path) < 0) {
+            return -1;
+        }
+        if (count > 0) {
+            path.pos += (count - 1) * 4;
+            xdr_uint32(&path, &dst_as);
+        }
+    }
+    flow[FLOW_SRC_AS] = src_as;
+    flow[FLOW_DST_AS] = dst_as;
+    return 0;
+}
+
+/*
+ * Function: decode_flow_sample
+ *
+ * Decode a flow sample into flow fields.  Each sample is of a single
+ * packet, so it stands for as many packets, and as many times the bytes,
+ * as the sampling rate.  The time fields are left at 0, as the packet
+ * was seen at a single moment that sFlow doesn't give.
+ *
+ * Inputs:   xdr_cursor*  sample     Flow sample
+ *           int          expanded   Whether the sample is an expanded one
+ *           uint64_t*    flow       FLOW_FIELDS values to fill in
+ *
+ * Returns:  1    Success
+ *           0    The sampled packet isn't IPv4
+ *           -1   The sample is malformed
+ */
+static int decode_flow_sample(xdr_cursor* sample, int expanded, uint64_t* flow) {
+    uint32_t values[10];
+    uint32_t rate, input, output, num_records, format, nexthop, mask;
+    int header_values = expanded ? 10 : 7;
+    int ipv4 = 0;
+    int i;
+
+    memset(flow, 0, sizeof(uint64_t) * FLOW_FIELDS);
+    for (i = 0; i < header_values; i++) {
+        if (xdr_uint32(sample, &values[i]) < 0) {
+            return -1;
+        }
+    }
+
+    /* Interfaces are given as an ifIndex in the low 30 bits, unless their
+     * format, in the high 2 bits, says they are something else */
+    rate = values[expanded ? 3 : 2];
+    if (expanded) {
+        input = values[6] == 0 ? values[7] : 0;
+        output = values[8] == 0 ? values[9] : 0;
+    }
+    else {
+        input = values[5] >> 30 == 0 ? values[5] : 0;
+        output = values[6] >> 30 == 0 ? values[6] : 0;
+    }
+
+    if (xdr_uint32(sample, &num_records) < 0) {
+        return -1;
+    }
+    while (num_records-- > 0) {
+        xdr_cursor record;
+        int result = 0;
+
+        if (xdr_element(sample, &format, &record) < 0) {
+            return -1;
+        }
+        switch (format) {
+            case SFLOW_RAW_HEADER:
+                result = decode_header(&record, flow);
+                break;
+            case SFLOW_IPV4_DATA:
+                result = decode_ipv4_data(&record, flow);
+                break;
+            case SFLOW_EXTENDED_ROUTER:
+                if (xdr_address(&record, &nexthop) < 0 || xdr_uint32(&record, &mask) < 0) {
+                    return -1;
+                }
+                flow[FLOW_NEXTHOP] = nexthop;
+                flow[FLOW_SRC_MASK] = mask;
+                result = xdr_uint32(&record, &mask);
+                flow[FLOW_DST_MASK] = mask;
+                break;
+            case SFLOW_EXTENDED_GATEWAY:
+                result = decode_gateway(&record, flow);
+                break;
+        }
+        if (result < 0) {
+            return -1;
+        }
+        ipv4 |= result;
+    }
+
+    flow[FLOW_INPUT] = input;
+    flow[FLOW_OUTPUT] = output;
+    flow[FLOW_PACKETS] = rate > 1 ? rate : 1;
+    flow[FLOW_BYTES] *= flow[FLOW_PACKETS];
+    return ipv4;
+}
+
+/*
+ * Function: decode_counter_sample
+ *
+ * Decode the generic interface counters of a counter sample.  Samples of
+ * other counters, such as a host's, have none.
+ *
+ * Inputs:   xdr_cursor*  sample     Counter sample
+ *           int          expanded   Whether the sample is an expanded one
+ *           uint64_t*    counters   SFLOW_COUNTERS values to fill in
+ *
+ * Returns:  1    Success
+ *           0    The sample has no generic interface counters
+ *           -1   The sample is malformed
+ */
+static int decode_counter_sample(xdr_cursor* sample, int expanded, uint64_t* counters) {
+    uint32_t value, num_records, format;
+    int header_values = expanded ? 3 : 2;
+    int found = 0;
+    int i;
+
+    for (i = 0; i < header_values; i++) {
+        if (xdr_uint32(sample, &value) < 0) {
+            return -1;
+        }
+    }
+
+    if (xdr_uint32(sample, &num_records) < 0) {
+        return -1;
+    }
+    while (num_records-- > 0) {
+        xdr_cursor record;
+        if (xdr_element(sample, &format, &record) < 0) {
+            return -1;
+        }
+        if (format != SFLOW_GENERIC_INTERFACE) {
+            continue;
+        }
+
+        for (i = 0; i < SFLOW_COUNTERS; i++) {
+            if (counter_widths[i] == 8) {
+                if (xdr_uint64(&record, &counters[i]) < 0) {
+                    return -1;
+                }
+            }
+            else {
+                if (xdr_uint32(&record, &value) < 0) {
+                    return -1;
+                }
+                counters[i] = value;
+            }
+        }
+        found = 1;
+    }
+    return found;
+}
+
+/*
+ * Function: format_counters
+ *
+ * Write a HEC event for the generic interface counters of a counter
+ * sample, with the exporter's address first, then the counters in the
+ * order they are in the record.
+ *
+ * Inputs:   char*           cursor       Position in the output buffer to write to
+ *           record_format*  format       Constant record fragments
+ *           char*           sender       Address of the exporter
+ *           int             sender_len   Length of the address
+ *           uint64_t*       counters     SFLOW_COUNTERS decoded values
+ *           int64_t         time         Time of the sample, in microseconds
+ *
+ * Returns:  <position after the last character written>
+ */
+static char* format_counters(char* cursor, record_format* format, char* sender,
+                             int sender_len, uint64_t* counters, int64_t time) {
+    int i;
+
+    memcpy(cursor, format->head, format->head_len);
+    cursor += format->head_len;
+    memcpy(cursor, sender, sender_len);
+    cursor += sender_len;
+
+    for (i = 0; i < SFLOW_COUNTERS; i++) {
+        *cursor++ = ',';
+        cursor = format_uint(cursor, counters[i]);
+    }
+
+    memcpy(cursor, format->counter_tail, format->counter_tail_len);
+    cursor += format->counter_tail_len;
+    cursor = format_time(cursor, time);
+    memcpy(cursor, format->close, format->close_len);
+    return cursor + format->close_len;
+}
+
+/*
+ * Function: read_datagram
+ *
+ * Walk the samples of an sFlow datagram in order, counting those that
+ * make an event, and writing the events if 'cursor' is given.  Flow
+ * samples of IPv4 packets make a flow event, and counter samples with
+ * generic interface counters make a counter event if counter events are
+ * sent.  Nothing is allocated: each sample is decoded onto the stack and
+ * written out before the next is read.  Datagrams carry no time, so
+ * events are given the time the datagram was received, which stays the
+ * same however late it is formatted.
+ *
+ * Inputs:   packet_buffer*  packet        Datagram to read
+ *           record_format*  format        Constant record fragments
+ *           char**          cursor        Position in the output buffer to
+ *                                         write to, advanced past the events,
+ *                                         or NULL to only count them
+ *           int             num_records   Most events to write
+ *
+ * Returns:  <# of events>   Success
+ *           -1              Invalid datagram
+ */
+static int read_datagram(packet_buffer* packet, record_format* format, char** cursor,
+                         int num_records) {
+    xdr_cursor datagram = { (unsigned char*)packet->packet,
+                            (unsigned char*)packet->packet + packet->packet_len };
+    uint32_t version, agent, value, num_samples, sample_format;
+    uint64_t flow[FLOW_FIELDS];
+    uint64_t counters[SFLOW_COUNTERS];
+    int sender_len = strlen(packet->sender);
+    int64_t time = packet->receive_time;
+    int events = 0;
+    int i;
+
+    /* Version, agent address, sub-agent ID, sequence number and uptime */
+    if (xdr_uint32(&datagram, &version) < 0 || version != SFLOW_VERSION ||
+        xdr_address(&datagram, &agent) < 0) {
+        return -1;
+    }
+    for (i = 0; i < 3; i++) {
+        if (xdr_uint32(&datagram, &value) < 0) {
+            return -1;
+        }
+    }
+
+    if (xdr_uint32(&datagram, &num_samples) < 0) {
+        return -1;
+    }
+    while (num_samples-- > 0 && (!cursor || events < num_records)) {
+        xdr_cursor sample;
+        int result = 0;
+
+        if (xdr_element(&datagram, &sample_format, &sample) < 0) {
+            return -1;
+        }
+        switch (sample_format) {
+            case SFLOW_FLOW_SAMPLE:
+            case SFLOW_EXPANDED_FLOW_SAMPLE:
+                result = decode_flow_sample(&sample, sample_format == SFLOW_EXPANDED_FLOW_SAMPLE,
+                                            flow);
+                if (result > 0 && cursor) {
+                    *cursor = format_flow(*cursor, format, packet->sender, sender_len, NULL,
+                                          flow, time);
+                }
+                break;
+            case SFLOW_COUNTER_SAMPLE:
+            case SFLOW_EXPANDED_COUNTER_SAMPLE:
+                if (format->counter_tail_len == 0) {
+                    break;
+                }
+                result = decode_counter_sample(&sample,
+                                               sample_format == SFLOW_EXPANDED_COUNTER_SAMPLE,
+                                               counters);
+                if (result > 0 && cursor) {
+                    *cursor = format_counters(*cursor, format, packet->sender, sender_len,
+                                              counters, time);
+                }
+                break;
+        }
+        if (result < 0) {
+            return -1;
+        }
+        events += result;
+    }
+    return events;
+}
+
+/*
+ * Function: sflow_prepare
+ *
+ * Check that an sFlow v5 datagram is sane, and count the events its
+ * samples make.
+ *
+ * Inputs:   packet_buffer*  packet      Datagram to prepare
+ *           record_format*  format      Constant record fragments
+ *
+ * Returns:  <# of events in the datagram>   Success
+ *           -1                              Invalid datagram
+ */
+int sflow_prepare(packet_buffer* packet, record_format* format) {
+    return read_datagram(packet, format, NULL, 0);
+}
+
+/*
+ * Function: format_sflow_records
+ *
+ * Write a HEC event for each sample of a prepared sFlow v5 datagram that
+ * makes one.  Flow samples are written the same as NetFlow records, and
+ * counter samples with the counter sourcetype.  The output buffer must
+ * have room for 'record_max' bytes per event.
+ *
+ * Inputs:   char*           cursor        Position in the output buffer to write to
+ *           record_format*  format        Constant record fragments
+ *           packet_buffer*  packet        Datagram containing the samples
+ *           int             num_records   Number of events in the datagram
+ *
+ * Returns:  <position after the last character written>
+ */
+char* format_sflow_records(char* cursor, record_format* format, packet_buffer* packet,
+                           int num_records) {
+    read_datagram(packet, format, &cursor, num_records);
+    return cursor;
+}
@@ -1,35 +1,92 @@
 #include <stdio.h>       /* Provides: sprintf */
-#include <string.h>      /* Provides: strcpy, strcat, memcpy */
+#include <stdlib.h>      /* Provides: strtol */
+#include <string.h>      /* Provides: memcpy, memset, strcpy, strcat, strchr, strncmp, strstr */
 #include "freeflow.h"
 #include "config.h"
-#include "session.h"
-#include "logger.h"
 #include "splunk.h"
 
-static int empty_hec_payload(char* header, hec* server);
+static char* skip_space(char* json);
 
 /*
- * Function: response_code
+ * Function: hec_header_prefix
  *
- * Pull the HTTP response code from an HTTP response and return it as an integer.
+ * Create the part of the HTTP POST header for sending to Splunk HTTP Event
+ * Collector that is the same for every request: everything but the
+ * Content-Length line and the blank line that ends the header.
  *
- * Inputs:   char*      response_code  HTTP response message
+ * Inputs:   hec*       server          Splunk HEC server object
+ *           char*      path            Path and query to post to
+ *           int        compressed      Whether the message is gzip encoded
+ *           char*      channel         Channel to track acknowledgements
+ *                                      on, or NULL for none
+ *           char*      prefix          Header prefix string
  *
- * Returns:  <response code>  Success
- *           -1               Failure to parse
+ * Returns:  <length of the prefix>
  */
-int response_code(char* response) {
-    char* token;
-    char delim[2] = " ";
-    char token_str[PACKET_BUFFER_SIZE];
-
-    strcpy(token_str, response);
-    token = strtok(token_str, delim);
-    token = strtok(NULL, delim);
-    if (!token) {
-        return -1;
+int hec_header_prefix(hec* server, char* path, int compressed, char* channel, char* prefix) {
+    char h[500];
+
+    strcpy(h, "POST %s HTTP/1.1\r\n");
+    strcat(h, "Host: %s:%d\r\n");
+    strcat(h, "User-Agent: freeflow\r\n");
+    strcat(h, "Connection: keep-alive\r\n");
+    strcat(h, "Authorization: Splunk %s\r\n");
+    if (compressed) {
+        strcat(h, "Content-Encoding: gzip\r\n");
+    }
+    if (channel) {
+        strcat(h, "X-Splunk-Request-Channel: ");
+        strcat(h, channel);
+        strcat(h, "\r\n");
+    }
+
+    return sprintf(prefix, h, path, server->addr, server->port, server->token);
+}
+
+/*
+ * Function: hec_length_line
+ *
+ * Create the Content-Length line that ends an HTTP header, along with the
+ * blank line after it.  The line is always CONTENT_LENGTH_LINE bytes, and
+ * can be reused for other lengths with hec_patch_length.
+ *
+ * Inputs:   char*      line            Buffer of CONTENT_LENGTH_LINE bytes
+ *           int        content_length  length of the message being sent
+ *
+ * Returns:  <length of the line>
+ */
+int hec_length_line(char* line, int content_length) {
+    int field_len = sizeof(CONTENT_LENGTH_FIELD) - 1;
+
+    memcpy(line, CONTENT_LENGTH_FIELD, field_len);
+    memset(line + field_len, ' ', CONTENT_LENGTH_WIDTH);
+    memcpy(line + field_len + CONTENT_LENGTH_WIDTH, "\r\n\r\n", 4);
+    hec_patch_length(line, content_length);
+    return CONTENT_LENGTH_LINE;
+}
+
+/*
+ * Function: hec_patch_length
+ *
+ * Write a new length into the slot of a line made by hec_length_line.
+ *
+ * Inputs:   char*      line            Content-Length line to patch
+ *           int        content_length  length of the message being sent
+ *
+ * Returns:  None
+ */
+void hec_patch_length(char* line, int content_length) {
+    char* slot = line + sizeof(CONTENT_LENGTH_FIELD) - 1;
+    char* digit = slot + CONTENT_LENGTH_WIDTH;
+
+    do {
+        *--digit = '0' + content_length % 10;
+        content_length /= 10;
+    } while (content_length > 0 && digit > slot);
+
+    while (digit > slot) {
+        *--digit = ' ';
     }
-    return(atoi(token));
 }
 
 /*
@@ -39,104 +96,101 @@ int response_code(char* response) {
  * Collector.
  *
  * Inputs:   hec*       server          Splunk HEC server object
+ *           char*      path            Path and query to post to
+ *           int        compressed      Whether the message is gzip encoded
  *           int        content_length  length of the message being sent
+ *           char*      channel         Channel to track acknowledgements
+ *                                      on, or NULL for none
  *           char*      header          Header string
  *
- * Returns:  0          Success
+ * Returns:  <length of the header>
  */
-int hec_header(hec* server, int content_length, char* header) {
-    char h[500];
-
-    strcpy(h, "POST /services/collector HTTP/1.1\r\n");
-    strcat(h, "Host: %s:%d\r\n");
-    strcat(h, "User-Agent: freeflow\r\n");
-    strcat(h, "Connection: keep-alive\r\n");
-    strcat(h, "Authorization: Splunk %s\r\n");
-    strcat(h, "Content-Length: %d\r\n\r\n");
-
-    sprintf(header, h, server->addr, server->port, server->token, content_length);
-    return 0;
+int hec_header(hec* server, char* path, int compressed, int content_length, char* channel,
+               char* header) {
+    int len = hec_header_prefix(server, path, compressed, channel, header);
+    return len + hec_length_line(header + len, content_length);
 }
 
 /*
- * Function: empty_hec_payload
+ * Function: skip_space
  *
- * Wrapper to create a 0 length, no payload  HTTP POST header for sending to
- * to start Splunk HTTP Event Collector connection.
+ * Skip over any whitespace in a JSON document.
  *
- * Inputs:   hec*       server          Splunk HEC server object
- *           char*      header          Header string
+ * Inputs:   char*      json            Position in the document
  *
- * Returns:  <length of header>  Success
+ * Returns:  <position of the next non-whitespace character>
  */
-static int empty_hec_payload(char* header, hec* server) {
-    hec_header(server, 0, header);
-    return strlen(header);
+static char* skip_space(char* json) {
+    while (*json == ' ' || *json == '\t' || *json == '\r' || *json == '\n') {
+        json++;
+    }
+    return json;
 }
 
 /*
- * Function: test_connectivity
- *
- * Called after a session has been established, to verify connectivity to the
- * Splunk HTTP Event Collector.  Send an empty message to verify the expected
- * response code is received.   This serves the purpose of validating that the
- * authentication token is valid, and preventing Splunk from tearing down the
- * session prematurely if no data is sent immediately.
- *
- * Inputs:   hec_session*      session       Object to store session information
- *           int               worker_num    Id of the worker process
- *           freeflow_config*  config        Pointer to configuration object
- *           int               log_queue     Id of IPC queue for logging
- *
- * Returns:  0   Success
- *           -1  Incomplete transmission
- *           -2  Error received when sending transmissionk
- *           -3  Unexpected response code received from Splunk
- *           -4  Authentication failure
- */    
-int test_connectivity(hec_session* session, int worker_num, freeflow_config *config, int log_queue) {
-    char payload[PAYLOAD_BUFFER_SIZE];
-    char log_message[LOG_MESSAGE_SIZE];
-    char recv_buffer_header[PACKET_BUFFER_SIZE];
-    char recv_buffer_payload[PACKET_BUFFER_SIZE];
-    
-    /* Send an empty HEC message to prevent Splunk from closing the connection
-     * within 40s.  Use the opportunity to validate the authentication token.
-     *
-     * Responses are sometimes received in 2 parts where the first part is the HTML 
-     * response header and the second is JSON encoded payload from Splunk. Sometimes
-     * the response is returned in one message.
-     */
-    int payload_len = empty_hec_payload(payload, session->hec);
-    int bytes_written = session_write(session, payload, payload_len);
-    int header_bytes_read = session_read(session, recv_buffer_header, PACKET_BUFFER_SIZE);
-    session_read(session, recv_buffer_payload, PACKET_BUFFER_SIZE);
-
-    if (payload_len != bytes_written) {
-        sprintf(log_message, "Worker #%d failed to write all bytes to Splunk HEC during test."
-                           , worker_num);
-        log_error(log_message, log_queue);
+ * Function: hec_ack_id
+ *
+ * Find the ackId HEC gives a request in its response, when indexer
+ * acknowledgement is enabled for the token, e.g.
+ *   {"text":"Success","code":0,"ackId":7}
+ *
+ * Inputs:   char*      body            Body of the response
+ *           long*      ack_id          Set to the ackId
+ *
+ * Returns:  0          Success
+ *           -1         The response has no ackId
+ */
+int hec_ack_id(char* body, long* ack_id) {
+    char* end;
+    char* value = strstr(body, "\"ackId\"");
+
+    if (!value) {
         return -1;
     }
-    
-    if (header_bytes_read < 0) {
-        sprintf(log_message, 
-                "Worker #%d received error response from Splunk HEC during test (SSL mismatch?)",
-                worker_num);
-        log_error(log_message, log_queue);
-        return -2;
+    value = skip_space(value + 7);
+    if (*value != ':') {
+        return -1;
     }
+    value = skip_space(value + 1);
+
+    *ack_id = strtol(value, &end, 10);
+    return (end == value) ? -1 : 0;
+}
+
+/*
+ * Function: hec_ack_status
+ *
+ * Look up an ackId in HEC's response to an acknowledgement poll, e.g.
+ *   {"acks":{"5":true,"6":false}}
+ *
+ * Inputs:   char*      body            Body of the response
+ *           long       ack_id          ackId to look up
+ *
+ * Returns:  1          The request has been indexed
+ *           0          It hasn't, or HEC didn't report on it
+ */
+int hec_ack_status(char* body, long ack_id) {
+    char* entry = strstr(body, "\"acks\"");
 
-    int code = response_code(recv_buffer_header);
-    if (code < 0) {
-        sprintf(log_message, "Worker #%d received invalid response from Splunk HEC.", worker_num);
-        log_error(log_message, log_queue);
-        return -3;
+    if (!entry || !(entry = strchr(entry + 6, '{'))) {
+        return 0;
     }
-    if (code == 403) {
-        sprintf(log_message, "Worker #%d unable to authenticate with Splunk.", worker_num);
-        log_error(log_message, log_queue);
-        return -4;
+
+    while ((entry = strchr(entry, '"'))) {
+        char* end;
+        long id = strtol(entry + 1, &end, 10);
+        if (end == entry + 1 || *end != '"') {
+            return 0;
+        }
+
+        entry = skip_space(end + 1);
+        if (*entry != ':') {
+            return 0;
+        }
+        entry = skip_space(entry + 1);
+        if (id == ack_id) {
+            return !strncmp(entry, "true", 4);
+        }
     }
     return 0;
 }
@@ -0,0 +1,621 @@
+#include <stdio.h>       /* Provides: sprintf, snprintf, sscanf */
+#include <stdlib.h>      /* Provides: malloc, realloc, free, qsort */
+#include <string.h>      /* Provides: memcpy, strcpy, strerror */
+#include <errno.h>       /* Provides: errno */
+#include <fcntl.h>       /* Provides: open */
+#include <unistd.h>      /* Provides: write, close, unlink */
+#include <dirent.h>      /* Provides: opendir, readdir, closedir */
+#include <sys/mman.h>    /* Provides: mmap, munmap, madvise */
+#include <sys/stat.h>    /* Provides: mkdir, fstat */
+#include "spool.h"
+#include "logger.h"
+
+/* Bytes of a spooled packet ahead of its data, as passed between processes */
+#define SPOOL_RECORD_HEADER  (offsetof(packet_buffer, packet) - offsetof(packet_buffer, packet_len))
+#define SPOOL_PATH_SIZE      (SPOOL_DIR_SIZE + 64)
+
+static void segment_path(packet_spool* spool, unsigned long seq, char* path);
+static int add_segment(packet_spool* spool, unsigned long seq, long size);
+static int compare_segments(const void* a, const void* b);
+static int recover_segments(packet_spool* spool);
+static int count_packets(packet_spool* spool, spool_segment* segment);
+static int open_segment(packet_spool* spool);
+static int flush_segment(packet_spool* spool);
+static int finish_segment(packet_spool* spool);
+static int map_oldest(packet_spool* spool);
+static void remove_oldest(packet_spool* spool);
+static void drop_oldest(packet_spool* spool);
+static void refill_credit(packet_spool* spool);
+
+/*
+ * Function: segment_path
+ *
+ * Build the file name of a segment.  Each worker has its own segments,
+ * numbered in the order they were started.
+ *
+ * Inputs:   packet_spool*  spool   Spool the segment belongs to
+ *           unsigned long  seq     Number of the segment
+ *           char*          path    Buffer of SPOOL_PATH_SIZE for the name
+ *
+ * Returns:  None
+ */
+static void segment_path(packet_spool* spool, unsigned long seq, char* path) {
+    snprintf(path, SPOOL_PATH_SIZE, "%s/freeflow-%d-%010lu.spool", spool->dir,
+                                    spool->worker_num, seq);
+}
+
+/*
+ * Function: add_segment
+ *
+ * Add a segment to the newest end of the spool.
+ *
+ * Inputs:   packet_spool*  spool   Spool to add to
+ *           unsigned long  seq     Number of the segment
+ *           long           size    Bytes already in the segment
+ *
+ * Returns:  0    Success
+ *           -1   Couldn't grow the list of segments
+ */
+static int add_segment(packet_spool* spool, unsigned long seq, long size) {
+    if (spool->num_segments == spool->segments_size) {
+        spool_segment* segments = realloc(spool->segments,
+                                          sizeof(spool_segment) * spool->segments_size * 2);
+        if (!segments) {
+            return -1;
+        }
+        spool->segments = segments;
+        spool->segments_size *= 2;
+    }
+
+    spool_segment* segment = &spool->segments[spool->num_segments++];
+    segment->seq = seq;
+    segment->size = size;
+    segment->packets = 0;
+    spool->size += size;
+    if (seq >= spool->next_seq) {
+        spool->next_seq = seq + 1;
+    }
+    return 0;
+}
+
+/*
+ * Function: compare_segments
+ *
+ * Order segments oldest first, for qsort.
+ *
+ * Inputs:   const void*  a   First segment
+ *           const void*  b   Second segment
+ *
+ * Returns:  <0, 0 or >0 as 'a' is older than, the same as, or newer than 'b'
+ */
+static int compare_segments(const void* a, const void* b) {
+    unsigned long seq_a = ((spool_segment*)a)->seq;
+    unsigned long seq_b = ((spool_segment*)b)->seq;
+    return (seq_a > seq_b) - (seq_a < seq_b);
+}
+
+/*
+ * Function: recover_segments
+ *
+ * Pick up the segments the worker left behind the last time it ran, so
+ * they are replayed before anything spooled since.
+ *
+ * Inputs:   packet_spool*  spool   Spool to recover the segments of
+ *
+ * Returns:  0    Success
+ *           -1   Couldn't read the spool directory
+ */
+static int recover_segments(packet_spool* spool) {
+    char log_message[LOG_MESSAGE_SIZE];
+    char path[SPOOL_PATH_SIZE];
+    struct dirent* entry;
+    struct stat info;
+    int i;
+
+    DIR* dir = opendir(spool->dir);
+    if (!dir) {
+        return -1;
+    }
+
+    while ((entry = readdir(dir))) {
+        int worker_num, end = 0;
+        unsigned long seq;
+
+        if (sscanf(entry->d_name, "freeflow-%d-%lu.spool%n", &worker_num, &seq, &end) != 2 ||
+            entry->d_name[end] != '\0' || end == 0 || worker_num != spool->worker_num) {
+            continue;
+        }
+        segment_path(spool, seq, path);
+        if (stat(path, &info) < 0 || add_segment(spool, seq, info.st_size) < 0) {
+            continue;
+        }
+    }
+    closedir(dir);
+
+    qsort(spool->segments, spool->num_segments, sizeof(spool_segment), compare_segments);
+    for (i = 0; i < spool->num_segments; i++) {
+        spool->packets += count_packets(spool, &spool->segments[i]);
+    }
+
+    if (spool->packets > 0) {
+        sprintf(log_message, "Worker #%d recovered %ld spooled packets from %d segments.",
+                             spool->worker_num, spool->packets, spool->num_segments);
+        log_info(log_message, spool->log_queue);
+    }
+    return 0;
+}
+
+/*
+ * Function: count_packets
+ *
+ * Count the packets in a segment left from an earlier run.  A packet cut
+ * short when the worker stopped is not counted, and is skipped on replay.
+ *
+ * Inputs:   packet_spool*   spool     Spool the segment belongs to
+ *           spool_segment*  segment   Segment to count the packets of
+ *
+ * Returns:  <# of packets>
+ */
+static int count_packets(packet_spool* spool, spool_segment* segment) {
+    char path[SPOOL_PATH_SIZE];
+    long offset = 0;
+
+    if (segment->size == 0) {
+        return 0;
+    }
+
+    segment_path(spool, segment->seq, path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    char* map = mmap(NULL, segment->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    while (offset + (long)SPOOL_RECORD_HEADER <= segment->size) {
+        int packet_len;
+        memcpy(&packet_len, map + offset, sizeof(int));
+        if (packet_len < 0 || packet_len > PACKET_BUFFER_SIZE ||
+            offset + (long)SPOOL_RECORD_HEADER + packet_len > segment->size) {
+            break;
+        }
+        offset += SPOOL_RECORD_HEADER + packet_len;
+        segment->packets++;
+    }
+    munmap(map, segment->size);
+    return segment->packets;
+}
+
+/*
+ * Function: open_segment
+ *
+ * Start a new segment for packets to be appended to.
+ *
+ * Inputs:   packet_spool*  spool   Spool to start the segment in
+ *
+ * Returns:  0    Success
+ *           -1   Couldn't create the segment
+ */
+static int open_segment(packet_spool* spool) {
+    char log_message[LOG_MESSAGE_SIZE];
+    char path[SPOOL_PATH_SIZE];
+
+    segment_path(spool, spool->next_seq, path);
+    spool->write_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0640);
+    if (spool->write_fd < 0) {
+        sprintf(log_message, "Worker #%d unable to create spool segment: %.150s",
+                             spool->worker_num, strerror(errno));
+        log_error(log_message, spool->log_queue);
+        return -1;
+    }
+    if (add_segment(spool, spool->next_seq, 0) < 0) {
+        close(spool->write_fd);
+        spool->write_fd = -1;
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function: flush_segment
+ *
+ * Write the packets buffered for the newest segment to its file.  If the
+ * write fails, the buffered packets are lost, and the segment is
+ * finished so the next packet starts a new one.
+ *
+ * Inputs:   packet_spool*  spool   Spool to flush
+ *
+ * Returns:  0    Success
+ *           -1   The write failed
+ */
+static int flush_segment(packet_spool* spool) {
+    char log_message[LOG_MESSAGE_SIZE];
+    int written = 0;
+
+    while (written < spool->write_len) {
+        int bytes = write(spool->write_fd, spool->write_buffer + written,
+                          spool->write_len - written);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            sprintf(log_message, "Worker #%d unable to write to spool: %.150s",
+                                 spool->worker_num, strerror(errno));
+            log_error(log_message, spool->log_queue);
+            spool->write_len = 0;
+            close(spool->write_fd);
+            spool->write_fd = -1;
+            return -1;
+        }
+        written += bytes;
+    }
+    spool->write_len = 0;
+    return 0;
+}
+
+/*
+ * Function: finish_segment
+ *
+ * Write out and close the newest segment.  Nothing more is appended to
+ * it, so it can be replayed.
+ *
+ * Inputs:   packet_spool*  spool   Spool to finish the newest segment of
+ *
+ * Returns:  0    Success
+ *           -1   The write failed
+ */
+static int finish_segment(packet_spool* spool) {
+    if (spool->write_fd < 0) {
+        return 0;
+    }
+    if (flush_segment(spool) < 0) {
+        return -1;
+    }
+    close(spool->write_fd);
+    spool->write_fd = -1;
+    return 0;
+}
+
+/*
+ * Function: map_oldest
+ *
+ * Map the oldest segment to replay it, finishing it first if packets are
+ * still being appended to it.  A segment that can't be read is dropped.
+ *
+ * Inputs:   packet_spool*  spool   Spool to map the oldest segment of
+ *
+ * Returns:  0    Success
+ *           -1   The segment was dropped
+ */
+static int map_oldest(packet_spool* spool) {
+    char log_message[LOG_MESSAGE_SIZE];
+    char path[SPOOL_PATH_SIZE];
+    struct stat info;
+
+    if (spool->num_segments == 1) {
+        finish_segment(spool);
+    }
+
+    segment_path(spool, spool->segments[0].seq, path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &info) < 0 || info.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        remove_oldest(spool);
+        return -1;
+    }
+
+    spool->map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (spool->map == MAP_FAILED) {
+        sprintf(log_message, "Worker #%d unable to map spool segment: %.150s",
+                             spool->worker_num, strerror(errno));
+        log_error(log_message, spool->log_queue);
+        spool->map = NULL;
+        drop_oldest(spool);
+        return -1;
+    }
+    madvise(spool->map, info.st_size, MADV_SEQUENTIAL);
+    spool->map_len = info.st_size;
+    spool->read_offset = 0;
+    return 0;
+}
+
+/*
+ * Function: remove_oldest
+ *
+ * Delete the oldest segment, along with any of its packets not yet
+ * replayed.
+ *
+ * Inputs:   packet_spool*  spool   Spool to remove the oldest segment of
+ *
+ * Returns:  None
+ */
+static void remove_oldest(packet_spool* spool) {
+    char path[SPOOL_PATH_SIZE];
+    spool_segment* oldest = &spool->segments[0];
+
+    if (spool->map) {
+        munmap(spool->map, spool->map_len);
+        spool->map = NULL;
+    }
+    if (spool->num_segments == 1 && spool->write_fd >= 0) {
+        close(spool->write_fd);
+        spool->write_fd = -1;
+        spool->write_len = 0;
+    }
+
+    segment_path(spool, oldest->seq, path);
+    unlink(path);
+    spool->size -= oldest->size;
+    spool->packets -= oldest->packets;
+
+    spool->num_segments--;
+    memmove(spool->segments, spool->segments + 1, sizeof(spool_segment) * spool->num_segments);
+}
+
+/*
+ * Function: drop_oldest
+ *
+ * Make room in a full spool by giving up on its oldest packets.
+ *
+ * Inputs:   packet_spool*  spool   Spool to drop the oldest segment of
+ *
+ * Returns:  None
+ */
+static void drop_oldest(packet_spool* spool) {
+    char log_message[LOG_MESSAGE_SIZE];
+
+    sprintf(log_message, "Worker #%d spool full.  Dropping %d of the oldest packets.",
+                         spool->worker_num, spool->segments[0].packets);
+    log_warning(log_message, spool->log_queue);
+    remove_oldest(spool);
+}
+
+/*
+ * Function: refill_credit
+ *
+ * Allow as many more packets to be replayed as the replay rate allows for
+ * the time since the credit was last refilled.  No more than a second's
+ * worth is saved up.
+ *
+ * Inputs:   packet_spool*  spool   Spool to refill the credit of
+ *
+ * Returns:  None
+ */
+static void refill_credit(packet_spool* spool) {
+    long now = monotonic_ms();
+    long earned = (now - spool->refilled_at) * spool->replay_rate / 1000;
+
+    if (earned <= 0) {
+        return;
+    }
+    spool->credit += earned;
+    spool->refilled_at += earned * 1000 / spool->replay_rate;
+    if (spool->credit >= spool->replay_rate) {
+        spool->credit = spool->replay_rate;
+        spool->refilled_at = now;
+    }
+}
+
+/*
+ * Function: create_spool
+ *
+ * Set up a worker's spool in the configured directory, creating the
+ * directory if need be, and pick up any segments left from the last run.
+ *
+ * Inputs:   packet_spool*     spool        Spool to initialize
+ *           int               worker_num   Id of the worker the spool is for
+ *           freeflow_config*  config       Configuration object
+ *           int               log_queue    Id of IPC queue for logging
+ *
+ * Returns:  0    Success
+ *           -1   Couldn't create or read the directory
+ */
+int create_spool(packet_spool* spool, int worker_num, freeflow_config* config, int log_queue) {
+    memset(spool, 0, sizeof(packet_spool));
+    strcpy(spool->dir, config->spool_dir);
+    spool->worker_num = worker_num;
+    spool->log_queue = log_queue;
+    spool->max_size = (long)config->spool_max_size * 1024 * 1024;
+    spool->replay_rate = config->spool_replay_rate;
+    spool->refilled_at = monotonic_ms();
+    spool->write_fd = -1;
+
+    spool->segments_size = SPOOL_INITIAL_SEGMENTS;
+    spool->segments = malloc(sizeof(spool_segment) * spool->segments_size);
+    if (!spool->segments) {
+        return -1;
+    }
+
+    if ((mkdir(spool->dir, 0750) < 0 && errno != EEXIST) || recover_segments(spool) < 0) {
+        free(spool->segments);
+        spool->segments = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function: free_spool
+ *
+ * Write out anything buffered and release the spool.  Packets not yet
+ * replayed stay on disk for the next run.
+ *
+ * Inputs:   packet_spool*  spool   Spool to free
+ *
+ * Returns:  None
+ */
+void free_spool(packet_spool* spool) {
+    finish_segment(spool);
+    if (spool->map) {
+        munmap(spool->map, spool->map_len);
+        spool->map = NULL;
+    }
+    free(spool->segments);
+    spool->segments = NULL;
+}
+
+/*
+ * Function: spool_write
+ *
+ * Append a packet to the spool, dropping the oldest segment first if the
+ * spool is full.
+ *
+ * Inputs:   packet_spool*   spool    Spool to append to
+ *           packet_buffer*  packet   Packet to spool
+ *
+ * Returns:  0    Success
+ *           -1   The packet couldn't be written
+ */
+int spool_write(packet_spool* spool, packet_buffer* packet) {
+    char log_message[LOG_MESSAGE_SIZE];
+    int len = PACKET_MESSAGE_SIZE(packet);
+
+    while (spool->num_segments > 0 && spool->size + len > spool->max_size) {
+        drop_oldest(spool);
+    }
+
+    spool_segment* newest = spool->num_segments ? &spool->segments[spool->num_segments - 1] : NULL;
+    if (spool->write_fd < 0 || newest->size + len > SPOOL_SEGMENT_SIZE) {
+        if (finish_segment(spool) < 0 || open_segment(spool) < 0) {
+            return -1;
+        }
+        newest = &spool->segments[spool->num_segments - 1];
+    }
+    if (spool->write_len + len > SPOOL_WRITE_BUFFER && flush_segment(spool) < 0) {
+        return -1;
+    }
+
+    memcpy(spool->write_buffer + spool->write_len, &packet->packet_len, len);
+    spool->write_len += len;
+    newest->size += len;
+    newest->packets++;
+    spool->size += len;
+
+    if (spool->packets++ == 0) {
+        sprintf(log_message, "Worker #%d spooling undelivered packets to %.150s.",
+                             spool->worker_num, spool->dir);
+        log_warning(log_message, spool->log_queue);
+    }
+    return 0;
+}
+
+/*
+ * Function: spool_batch
+ *
+ * Spool every packet of a batch that couldn't be delivered, and empty it.
+ * Packets that couldn't be written are kept at the front of the batch,
+ * with their events discarded, for the caller to deal with.
+ *
+ * Inputs:   packet_spool*  spool   Spool to append to
+ *           hec_batch*     batch   Batch to spool
+ *
+ * Returns:  <# of packets kept>
+ */
+int spool_batch(packet_spool* spool, hec_batch* batch) {
+    int kept = 0;
+    int i;
+
+    for (i = 0; i < batch->num_packets; i++) {
+        packet_buffer* packet = &batch->packets[i];
+        if (spool_write(spool, packet) < 0) {
+            if (kept != i) {
+                memcpy(&batch->packets[kept], packet,
+                       offsetof(packet_buffer, packet) + packet->packet_len);
+            }
+            kept++;
+        }
+    }
+    reset_batch(batch);
+    return kept;
+}
+
+/*
+ * Function: spool_read
+ *
+ * Take the oldest packet from the spool, if the replay rate allows one
+ * now.  A segment is deleted once all of it has been replayed.
+ *
+ * Inputs:   packet_spool*   spool    Spool to read from
+ *           packet_buffer*  packet   Buffer to copy the packet to
+ *
+ * Returns:  <length of the packet>   Success
+ *           -1                       The spool is empty, or the replay
+ *                                    rate has been reached
+ */
+int spool_read(packet_spool* spool, packet_buffer* packet) {
+    char log_message[LOG_MESSAGE_SIZE];
+
+    if (spool->packets == 0) {
+        return -1;
+    }
+    if (spool->replay_rate > 0) {
+        refill_credit(spool);
+        if (spool->credit < 1) {
+            return -1;
+        }
+    }
+
+    while (spool->num_segments > 0) {
+        if (!spool->map && map_oldest(spool) < 0) {
+            continue;
+        }
+
+        long left = spool->map_len - spool->read_offset;
+        char* record = spool->map + spool->read_offset;
+        if (left >= (long)SPOOL_RECORD_HEADER) {
+            memcpy(&packet->packet_len, record, SPOOL_RECORD_HEADER);
+            if (packet->packet_len >= 0 && packet->packet_len <= PACKET_BUFFER_SIZE &&
+                left >= (long)SPOOL_RECORD_HEADER + packet->packet_len) {
+                memcpy(packet->packet, record + SPOOL_RECORD_HEADER, packet->packet_len);
+                spool->read_offset += SPOOL_RECORD_HEADER + packet->packet_len;
+                spool->segments[0].packets--;
+                spool->packets--;
+                spool->credit--;
+
+                if (spool->read_offset == spool->map_len) {
+                    remove_oldest(spool);
+                }
+                if (spool->packets == 0) {
+                    sprintf(log_message, "Worker #%d finished replaying spooled packets.",
+                                         spool->worker_num);
+                    log_info(log_message, spool->log_queue);
+                }
+                return packet->packet_len;
+            }
+        }
+
+        /* The rest of the segment was cut short when it was written */
+        remove_oldest(spool);
+    }
+    return -1;
+}
+
+/*
+ * Function: spool_timeout
+ *
+ * Find how long until the replay rate allows another packet to be read.
+ *
+ * Inputs:   packet_spool*  spool   Spool to check
+ *
+ * Returns:  <ms until a packet can be read>
+ *           -1                         The spool is empty
+ */
+int spool_timeout(packet_spool* spool) {
+    if (spool->packets == 0) {
+        return -1;
+    }
+    if (spool->replay_rate == 0 || spool->credit >= 1) {
+        return 0;
+    }
+
+    long due = spool->refilled_at + (1000 + spool->replay_rate - 1) / spool->replay_rate -
+               monotonic_ms();
+    return (due > 0) ? (int)due : 0;
+}
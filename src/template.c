@@ -0,0 +1,1096 @@
+#include <stdio.h>       /* Provides: sprintf */
+#include <string.h>      /* Provides: memcpy, memmove, memcmp, memset, strlen, strerror */
+#include <errno.h>       /* Provides: errno */
+#include <sched.h>       /* Provides: sched_yield */
+#include <sys/mman.h>    /* Provides: mmap, munmap */
+#include <arpa/inet.h>   /* Provides: ntohs, ntohl */
+#include "template.h"
+#include "netflow.h"
+#include "logger.h"
+
+/* Information elements with a flow field to go to.  NetFlow v9 and IPFIX
+ * number these the same. */
+#define FIELD_IN_BYTES         1
+#define FIELD_IN_PKTS          2
+#define FIELD_PROTOCOL         4
+#define FIELD_SRC_TOS          5
+#define FIELD_TCP_FLAGS        6
+#define FIELD_L4_SRC_PORT      7
+#define FIELD_IPV4_SRC_ADDR    8
+#define FIELD_SRC_MASK         9
+#define FIELD_INPUT_SNMP       10
+#define FIELD_L4_DST_PORT      11
+#define FIELD_IPV4_DST_ADDR    12
+#define FIELD_DST_MASK         13
+#define FIELD_OUTPUT_SNMP      14
+#define FIELD_IPV4_NEXT_HOP    15
+#define FIELD_SRC_AS           16
+#define FIELD_DST_AS           17
+#define FIELD_LAST_SWITCHED    21
+#define FIELD_FIRST_SWITCHED   22
+#define FIELD_OUT_BYTES        23
+#define FIELD_OUT_PKTS         24
+#define FIELD_SAMPLING_INTERVAL 34
+#define FIELD_SAMPLER_INTERVAL 50
+#define FIELD_IF_NAME          82
+#define FIELD_START_SECONDS    150
+#define FIELD_END_SECONDS      151
+#define FIELD_START_MILLIS     152
+#define FIELD_END_MILLIS       153
+#define FIELD_SYSTEM_INIT      160
+#define FIELD_PACKET_INTERVAL  305
+#define FIELD_PACKET_SPACE     306
+
+/* NetFlow v9 options scope field type for an interface */
+#define SCOPE_INTERFACE        2
+
+/* Mapped before the workers are forked, so every worker shares it */
+static template_cache* cache = NULL;
+
+/* Each worker's compiled copy of every slot */
+static template_program programs[TEMPLATE_SLOTS];
+
+/* Data sets that arrived before their template, each held as a packet of
+ * its own with the header of the packet it came in.  Once the template
+ * turns up, they are handed back to the worker like any other packet.
+ * When there is no room for another, the oldest is dropped. */
+typedef struct held_set {
+    uint32_t exporter;
+    uint32_t domain;
+    uint16_t id;
+    uint16_t protocol;
+    unsigned long seq;
+} held_set;
+
+static packet_buffer held[TEMPLATE_HELD];
+static held_set held_sets[TEMPLATE_HELD];
+static int num_held = 0;
+static unsigned long next_seq = 0;
+static uint32_t held_generation = 0;    /* Of the cache when last found none ready */
+static unsigned long held_dropped = 0;
+
+static uint32_t template_hash(uint32_t exporter, uint32_t domain, uint32_t id, int protocol);
+static void lock_cache();
+static void unlock_cache();
+static void read_entry(void* entry, void* copy, size_t size);
+static void write_entry(void* entry, void* source, size_t size);
+static int flow_field(template_slot* slot, int index, int* width, int has_in_bytes,
+                      int has_in_pkts);
+static int time_field(template_field* field, int time_unit, int* width);
+static void compile_template(template_slot* slot, template_program* program);
+static void store_exporter_options(uint32_t exporter, uint32_t domain, int protocol,
+                                   uint32_t sampling, uint64_t system_init);
+static void store_interface_name(uint32_t exporter, uint32_t domain, int protocol,
+                                 uint32_t ifindex, unsigned char* name, int name_len);
+static void template_hold(packet_buffer* packet, int header_len, int offset, int length,
+                          uint32_t exporter, uint32_t domain, uint16_t id, int protocol);
+
+/*
+ * Function: create_template_cache
+ *
+ * Map the shared memory the templates and options of every exporter are
+ * kept in.  Set 'error' if unsuccessful.
+ *
+ * Inputs:   char*   error   Error string, if operation fails
+ *
+ * Returns:  0     Success
+ *           -1    Couldn't map the memory
+ */
+int create_template_cache(char* error) {
+    void* memory = mmap(NULL, sizeof(template_cache), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        sprintf(error, "Unable to map %lu bytes of shared memory: %s",
+                       (unsigned long)sizeof(template_cache), strerror(errno));
+        return -1;
+    }
+    cache = memory;
+    return 0;
+}
+
+/*
+ * Function: free_template_cache
+ *
+ * Unmap the template cache.
+ *
+ * Inputs:   None
+ *
+ * Returns:  None
+ */
+void free_template_cache() {
+    if (cache) {
+        munmap(cache, sizeof(template_cache));
+        cache = NULL;
+    }
+}
+
+/*
+ * Function: template_hash
+ *
+ * Hash a key to the first entry of a table it may be found in.  The
+ * tables are powers of two no larger than TEMPLATE_INTERFACES, so the
+ * caller masks the result to the size of its table.
+ *
+ * Inputs:   uint32_t  exporter   Exporter address, in network order
+ *           uint32_t  domain     Source ID or observation domain
+ *           uint32_t  id         Template ID or interface index
+ *           int       protocol   NetFlow version
+ *
+ * Returns:  <hash of the key>
+ */
+static uint32_t template_hash(uint32_t exporter, uint32_t domain, uint32_t id, int protocol) {
+    uint32_t hash = exporter * 0x9e3779b1;
+    hash = (hash ^ domain) * 0x85ebca6b;
+    hash = (hash ^ id) * 0xc2b2ae35;
+    hash = (hash ^ protocol) * 0x9e3779b1;
+    return hash ^ (hash >> 16);
+}
+
+/*
+ * Function: lock_cache
+ *
+ * Take the lock every writer of the cache holds.  Writes are rare, as
+ * exporters only send their templates and options every so often.
+ *
+ * Inputs:   None
+ *
+ * Returns:  None
+ */
+static void lock_cache() {
+    while (__atomic_exchange_n(&cache->lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+/*
+ * Function: unlock_cache
+ *
+ * Release the lock taken by lock_cache.
+ *
+ * Inputs:   None
+ *
+ * Returns:  None
+ */
+static void unlock_cache() {
+    __atomic_store_n(&cache->lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function: read_entry
+ *
+ * Copy an entry of one of the cache's tables, retrying until it isn't
+ * written meanwhile.  Every entry starts with its version.
+ *
+ * Inputs:   void*    entry   Entry to copy
+ *           void*    copy    Where to copy it to
+ *           size_t   size    Size of the entry
+ *
+ * Returns:  None
+ */
+static void read_entry(void* entry, void* copy, size_t size) {
+    uint32_t* version = entry;
+    uint32_t before;
+
+    do {
+        before = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+        memcpy(copy, entry, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((before & 1) || before != __atomic_load_n(version, __ATOMIC_RELAXED));
+    *(uint32_t*)copy = before;
+}
+
+/*
+ * Function: write_entry
+ *
+ * Overwrite an entry of one of the cache's tables, all but its version,
+ * making its version odd meanwhile.  The cache must be locked.
+ *
+ * Inputs:   void*    entry    Entry to write
+ *           void*    source   What to write to it
+ *           size_t   size     Size of the entry
+ *
+ * Returns:  None
+ */
+static void write_entry(void* entry, void* source, size_t size) {
+    uint32_t* version = entry;
+    uint32_t before = *version;
+
+    __atomic_store_n(version, before + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char*)entry + sizeof(uint32_t), (char*)source + sizeof(uint32_t),
+           size - sizeof(uint32_t));
+    __atomic_store_n(version, before + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function: template_store
+ *
+ * Add a template to the cache, or replace the one with the same key.
+ * Exporters send their templates again every so often, so a template
+ * that hasn't changed is left alone, and workers keep the program they
+ * compiled from it.  If every slot the template could go in is taken, the
+ * first is given to it.
+ *
+ * Inputs:   uint32_t         exporter       Exporter address, in network order
+ *           uint32_t         domain         Source ID or observation domain
+ *           uint16_t         id             Template ID
+ *           int              protocol       NetFlow version the template came in
+ *           template_field*  fields         Fields of the template
+ *           int              num_fields     Number of fields
+ *           int              scope_fields   Scope fields, for an options template
+ *
+ * Returns:  1     The template was added or changed
+ *           0     The template was already known
+ *           -1    The template has too many fields
+ */
+int template_store(uint32_t exporter, uint32_t domain, uint16_t id, int protocol,
+                   template_field* fields, int num_fields, int scope_fields) {
+    if (num_fields > TEMPLATE_MAX_FIELDS) {
+        return -1;
+    }
+
+    template_slot update;
+    memset(&update, 0, sizeof(update));
+    update.exporter = exporter;
+    update.domain = domain;
+    update.id = id;
+    update.protocol = protocol;
+    update.scope_fields = scope_fields;
+    update.num_fields = num_fields;
+    memcpy(update.fields, fields, sizeof(template_field) * num_fields);
+
+    lock_cache();
+
+    uint32_t home = template_hash(exporter, domain, id, protocol);
+    template_slot* slot = &cache->slots[home & (TEMPLATE_SLOTS - 1)];
+    int probe;
+    for (probe = 0; probe < TEMPLATE_PROBES; probe++) {
+        template_slot* candidate = &cache->slots[(home + probe) & (TEMPLATE_SLOTS - 1)];
+        if (candidate->exporter == 0 ||
+            (candidate->exporter == exporter && candidate->domain == domain &&
+             candidate->id == id && candidate->protocol == protocol)) {
+            slot = candidate;
+            break;
+        }
+    }
+
+    int result = 0;
+    if (memcmp((char*)slot + sizeof(uint32_t), (char*)&update + sizeof(uint32_t),
+               offsetof(template_slot, fields) - sizeof(uint32_t) +
+               sizeof(template_field) * num_fields)) {
+        write_entry(slot, &update, sizeof(template_slot));
+        __atomic_add_fetch(&cache->generation, 1, __ATOMIC_RELEASE);
+        result = 1;
+    }
+
+    unlock_cache();
+    return result;
+}
+
+/*
+ * Function: template_lookup
+ *
+ * Find the program for decoding the data records of a template, compiling
+ * it if the template is new to this worker or has changed.
+ *
+ * Inputs:   uint32_t  exporter   Exporter address, in network order
+ *           uint32_t  domain     Source ID or observation domain
+ *           uint16_t  id         Template ID
+ *           int       protocol   NetFlow version the template came in
+ *
+ * Returns:  <program for the template>   Success
+ *           NULL                         The template isn't known
+ */
+template_program* template_lookup(uint32_t exporter, uint32_t domain, uint16_t id,
+                                  int protocol) {
+    uint32_t home = template_hash(exporter, domain, id, protocol);
+    int probe;
+
+    for (probe = 0; probe < TEMPLATE_PROBES; probe++) {
+        int index = (home + probe) & (TEMPLATE_SLOTS - 1);
+        template_slot* slot = &cache->slots[index];
+        uint32_t version;
+        uint32_t slot_exporter, slot_domain;
+        uint16_t slot_id, slot_protocol;
+
+        /* Only the key is read here, the fields only when compiling */
+        do {
+            version = __atomic_load_n(&slot->version, __ATOMIC_ACQUIRE);
+            slot_exporter = slot->exporter;
+            slot_domain = slot->domain;
+            slot_id = slot->id;
+            slot_protocol = slot->protocol;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((version & 1) || version != __atomic_load_n(&slot->version, __ATOMIC_RELAXED));
+
+        if (slot_exporter == 0) {
+            return NULL;
+        }
+        if (slot_exporter != exporter || slot_domain != domain || slot_id != id ||
+            slot_protocol != protocol) {
+            continue;
+        }
+
+        template_program* program = &programs[index];
+        if (program->version != version) {
+            template_slot copy;
+            read_entry(slot, &copy, sizeof(template_slot));
+            if (copy.exporter != exporter || copy.domain != domain || copy.id != id ||
+                copy.protocol != protocol) {
+                return NULL;
+            }
+            compile_template(&copy, program);
+        }
+        return program;
+    }
+    return NULL;
+}
+
+/*
+ * Function: template_generation
+ *
+ * Return a number that changes whenever any worker adds or changes a
+ * template, so a worker can tell when records waiting for their template
+ * are worth another look.
+ *
+ * Inputs:   None
+ *
+ * Returns:  <generation of the cache>
+ */
+uint32_t template_generation() {
+    return __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Function: flow_field
+ *
+ * Find the flow field a template field is decoded into, and the most
+ * bytes of it that are kept.  Fields wider than that have only their low
+ * order bytes kept.  Outbound counters are only used when the template
+ * has no inbound counters.  Enterprise elements are never decoded.
+ *
+ * Inputs:   template_slot*  slot           Copy of the template's slot
+ *           int             index          Index of the field in the template
+ *           int*            width          Set to the most bytes kept
+ *           int             has_in_bytes   Whether the template has IN_BYTES
+ *           int             has_in_pkts    Whether the template has IN_PKTS
+ *
+ * Returns:  <flow field>   Success
+ *           -1             The field isn't decoded
+ */
+static int flow_field(template_slot* slot, int index, int* width, int has_in_bytes,
+                      int has_in_pkts) {
+    template_field* field = &slot->fields[index];
+    if (field->enterprise) {
+        return -1;
+    }
+
+    /* Options records describe the exporter, not flows */
+    if (slot->scope_fields) {
+        *width = 4;
+        if (slot->protocol == NETFLOW9_VERSION && index < slot->scope_fields) {
+            return field->type == SCOPE_INTERFACE ? FLOW_IFINDEX : -1;
+        }
+        switch (field->type) {
+            case FIELD_INPUT_SNMP:        return FLOW_IFINDEX;
+            case FIELD_OUTPUT_SNMP:       return FLOW_IFINDEX;
+            case FIELD_SAMPLING_INTERVAL: return FLOW_SAMPLING;
+            case FIELD_SAMPLER_INTERVAL:  return FLOW_SAMPLING;
+            case FIELD_PACKET_INTERVAL:   return FLOW_SAMPLING;
+            case FIELD_PACKET_SPACE:      return FLOW_SAMPLE_SPACE;
+            case FIELD_IF_NAME:           *width = field->length; return FLOW_IFNAME;
+            case FIELD_SYSTEM_INIT:       *width = 8; return FLOW_SYSTEM_INIT;
+        }
+        return -1;
+    }
+
+    *width = 4;
+    switch (field->type) {
+        case FIELD_IPV4_SRC_ADDR:     return field->length == 4 ? FLOW_SRCADDR : -1;
+        case FIELD_IPV4_DST_ADDR:     return field->length == 4 ? FLOW_DSTADDR : -1;
+        case FIELD_IPV4_NEXT_HOP:     return field->length == 4 ? FLOW_NEXTHOP : -1;
+        case FIELD_INPUT_SNMP:        return FLOW_INPUT;
+        case FIELD_OUTPUT_SNMP:       return FLOW_OUTPUT;
+        case FIELD_SRC_AS:            return FLOW_SRC_AS;
+        case FIELD_DST_AS:            return FLOW_DST_AS;
+        case FIELD_SAMPLING_INTERVAL: return FLOW_SAMPLING;
+        case FIELD_SAMPLER_INTERVAL:  return FLOW_SAMPLING;
+        case FIELD_PACKET_INTERVAL:   return FLOW_SAMPLING;
+        case FIELD_PACKET_SPACE:      return FLOW_SAMPLE_SPACE;
+    }
+
+    *width = 8;
+    switch (field->type) {
+        case FIELD_IN_BYTES:          return FLOW_BYTES;
+        case FIELD_IN_PKTS:           return FLOW_PACKETS;
+        case FIELD_OUT_BYTES:         return has_in_bytes ? -1 : FLOW_BYTES;
+        case FIELD_OUT_PKTS:          return has_in_pkts ? -1 : FLOW_PACKETS;
+    }
+
+    *width = 2;
+    switch (field->type) {
+        case FIELD_L4_SRC_PORT:       return FLOW_SRCPORT;
+        case FIELD_L4_DST_PORT:       return FLOW_DSTPORT;
+    }
+
+    *width = 1;
+    switch (field->type) {
+        case FIELD_TCP_FLAGS:         return FLOW_TCP_FLAGS;
+        case FIELD_PROTOCOL:          return FLOW_PROT;
+        case FIELD_SRC_TOS:           return FLOW_TOS;
+        case FIELD_SRC_MASK:          return FLOW_SRC_MASK;
+        case FIELD_DST_MASK:          return FLOW_DST_MASK;
+    }
+    return -1;
+}
+
+/*
+ * Function: time_field
+ *
+ * Find whether a template field is the start or end time of a flow, in
+ * the unit the template gives its start time in.
+ *
+ * Inputs:   template_field*  field       Template field
+ *           int              time_unit   TEMPLATE_TIME_* of the start time
+ *           int*             width       Set to the most bytes kept
+ *
+ * Returns:  FLOW_FIRST or FLOW_LAST   The field is a time
+ *           -1                        It isn't, or is in another unit
+ */
+static int time_field(template_field* field, int time_unit, int* width) {
+    if (field->enterprise) {
+        return -1;
+    }
+
+    *width = 4;
+    switch (time_unit) {
+        case TEMPLATE_TIME_UPTIME:
+            return field->type == FIELD_FIRST_SWITCHED ? FLOW_FIRST :
+                   field->type == FIELD_LAST_SWITCHED ? FLOW_LAST : -1;
+        case TEMPLATE_TIME_SECONDS:
+            return field->type == FIELD_START_SECONDS ? FLOW_FIRST :
+                   field->type == FIELD_END_SECONDS ? FLOW_LAST : -1;
+        case TEMPLATE_TIME_MILLIS:
+            *width = 8;
+            return field->type == FIELD_START_MILLIS ? FLOW_FIRST :
+                   field->type == FIELD_END_MILLIS ? FLOW_LAST : -1;
+    }
+    return -1;
+}
+
+/*
+ * Function: compile_template
+ *
+ * Compile a template into the ops that decode its data records.  A
+ * template whose records couldn't fit in a packet is compiled with a
+ * record length of 0, so its records are skipped.
+ *
+ * Inputs:   template_slot*     slot      Copy of the template's slot
+ *           template_program*  program   Program to compile into
+ *
+ * Returns:  None
+ */
+static void compile_template(template_slot* slot, template_program* program) {
+    int has_in_bytes = 0;
+    int has_in_pkts = 0;
+    int time_unit = TEMPLATE_TIME_NONE;
+    int i;
+
+    for (i = 0; i < slot->num_fields; i++) {
+        template_field* field = &slot->fields[i];
+        if (field->enterprise || slot->scope_fields) {
+            continue;
+        }
+        has_in_bytes |= field->type == FIELD_IN_BYTES;
+        has_in_pkts |= field->type == FIELD_IN_PKTS;
+        if (time_unit == TEMPLATE_TIME_NONE) {
+            time_unit = field->type == FIELD_FIRST_SWITCHED ? TEMPLATE_TIME_UPTIME :
+                        field->type == FIELD_START_MILLIS ? TEMPLATE_TIME_MILLIS :
+                        field->type == FIELD_START_SECONDS ? TEMPLATE_TIME_SECONDS :
+                        TEMPLATE_TIME_NONE;
+        }
+    }
+
+    int offset = 0;
+    int record_len = 0;
+    program->num_ops = 0;
+    program->variable = 0;
+    for (i = 0; i < slot->num_fields; i++) {
+        template_field* field = &slot->fields[i];
+        int width;
+        int target = time_field(field, time_unit, &width);
+        if (target < 0) {
+            target = flow_field(slot, i, &width, has_in_bytes, has_in_pkts);
+        }
+
+        if (slot->protocol == IPFIX_VERSION && field->length == TEMPLATE_VARIABLE_LENGTH) {
+            template_op* op = &program->ops[program->num_ops++];
+            op->offset = offset;
+            op->width = 0;
+            op->field = target == FLOW_IFNAME ? FLOW_IFNAME : FLOW_NONE;
+            op->kind = TEMPLATE_OP_VARIABLE;
+            record_len += offset + 1;
+            offset = 0;
+            program->variable = 1;
+            continue;
+        }
+
+        if (target >= 0 && field->length > 0) {
+            template_op* op = &program->ops[program->num_ops++];
+            if (width > field->length) {
+                width = field->length;
+            }
+            op->offset = offset + field->length - width;
+            op->width = width;
+            op->field = target;
+            op->kind = target == FLOW_IFNAME ? TEMPLATE_OP_STRING : TEMPLATE_OP_NUMBER;
+        }
+        offset += field->length;
+        if (offset > PACKET_BUFFER_SIZE) {
+            break;
+        }
+    }
+
+    record_len += offset;
+    program->record_len = record_len > PACKET_BUFFER_SIZE ? 0 : record_len;
+    program->tail_len = offset;
+    program->options = slot->scope_fields > 0;
+    program->time_unit = time_unit;
+    program->version = slot->version;
+}
+
+/*
+ * Function: template_record_length
+ *
+ * Find the length of a data record, which for a template with variable
+ * length fields means reading the length of each of them.
+ *
+ * Inputs:   template_program*  program   Program compiled from the record's template
+ *           unsigned char*     record    Data record
+ *           unsigned char*     end       End of the data set
+ *
+ * Returns:  <length of the record>   Success
+ *           -1                       The record runs past the end of the set
+ */
+int template_record_length(template_program* program, unsigned char* record,
+                           unsigned char* end) {
+    if (!program->variable) {
+        return end - record >= program->record_len ? program->record_len : -1;
+    }
+
+    unsigned char* base = record;
+    template_op* op;
+    for (op = program->ops; op < program->ops + program->num_ops; op++) {
+        if (op->kind != TEMPLATE_OP_VARIABLE) {
+            continue;
+        }
+        unsigned char* bytes = base + op->offset;
+        if (bytes >= end) {
+            return -1;
+        }
+        int length = bytes[0];
+        int prefix = 1;
+        if (length == 255) {
+            if (bytes + 3 > end) {
+                return -1;
+            }
+            length = (bytes[1] << 8) | bytes[2];
+            prefix = 3;
+        }
+        base = bytes + prefix + length;
+        if (base > end) {
+            return -1;
+        }
+    }
+    return base + program->tail_len <= end ? base + program->tail_len - record : -1;
+}
+
+/*
+ * Function: template_count_records
+ *
+ * Count the data records of a data set.  Any padding at the end of the
+ * set is shorter than a record, so is never counted as one.
+ *
+ * Inputs:   template_program*  program   Program compiled from the set's template
+ *           unsigned char*     records   First record of the set
+ *           unsigned char*     end       End of the set
+ *
+ * Returns:  <# of records>
+ */
+int template_count_records(template_program* program, unsigned char* records,
+                           unsigned char* end) {
+    if (program->record_len == 0) {
+        return 0;
+    }
+    if (!program->variable) {
+        return (end - records) / program->record_len;
+    }
+
+    int num_records = 0;
+    int length;
+    while (end - records >= program->record_len &&
+           (length = template_record_length(program, records, end)) > 0) {
+        num_records++;
+        records += length;
+    }
+    return num_records;
+}
+
+/*
+ * Function: template_decode
+ *
+ * Decode a data record into its flow fields.  Fields the template doesn't
+ * have are left at 0.  The record must be known to fit in its set.
+ *
+ * Inputs:   template_program*  program   Program compiled from the record's template
+ *           unsigned char*     record    Data record to decode
+ *           uint64_t*          flow      FLOW_FIELDS values to decode into
+ *
+ * Returns:  None
+ */
+void template_decode(template_program* program, unsigned char* record, uint64_t* flow) {
+    template_op* op = program->ops;
+    template_op* end = op + program->num_ops;
+    unsigned char* base = record;
+
+    memset(flow, 0, sizeof(uint64_t) * FLOW_FIELDS);
+    for (; op < end; op++) {
+        unsigned char* bytes = base + op->offset;
+        uint64_t value;
+        uint32_t word;
+        int length;
+        int i;
+
+        if (op->kind != TEMPLATE_OP_NUMBER) {
+            length = op->width;
+            if (op->kind == TEMPLATE_OP_VARIABLE) {
+                length = *bytes++;
+                if (length == 255) {
+                    length = (bytes[0] << 8) | bytes[1];
+                    bytes += 2;
+                }
+                base = bytes + length;
+            }
+            if (op->field != FLOW_NONE) {
+                flow[op->field] = ((uint64_t)(bytes - record) << 16) | length;
+            }
+            continue;
+        }
+
+        switch (op->width) {
+            case 1:
+                value = bytes[0];
+                break;
+            case 2:
+                value = (bytes[0] << 8) | bytes[1];
+                break;
+            case 4:
+                memcpy(&word, bytes, 4);
+                value = ntohl(word);
+                break;
+            default:
+                value = 0;
+                for (i = 0; i < op->width; i++) {
+                    value = (value << 8) | bytes[i];
+                }
+        }
+        flow[op->field] = value;
+    }
+
+    if (program->time_unit == TEMPLATE_TIME_SECONDS) {
+        flow[FLOW_FIRST] *= 1000;
+        flow[FLOW_LAST] *= 1000;
+    }
+}
+
+/*
+ * Function: store_exporter_options
+ *
+ * Keep what an options record said about all of an exporter's flows.
+ * Anything not given, as 0, is left as it was.
+ *
+ * Inputs:   uint32_t  exporter      Exporter address, in network order
+ *           uint32_t  domain        Source ID or observation domain
+ *           int       protocol      NetFlow version the options came in
+ *           uint32_t  sampling      Packets per packet sampled
+ *           uint64_t  system_init   ms since the epoch the exporter's uptime starts at
+ *
+ * Returns:  None
+ */
+static void store_exporter_options(uint32_t exporter, uint32_t domain, int protocol,
+                                   uint32_t sampling, uint64_t system_init) {
+    uint32_t home = template_hash(exporter, domain, 0, protocol);
+    int probe;
+
+    lock_cache();
+    exporter_options* entry = &cache->exporters[home & (TEMPLATE_EXPORTERS - 1)];
+    for (probe = 0; probe < TEMPLATE_PROBES; probe++) {
+        exporter_options* candidate = &cache->exporters[(home + probe) & (TEMPLATE_EXPORTERS - 1)];
+        if (candidate->exporter == 0 || (candidate->exporter == exporter &&
+            candidate->domain == domain && candidate->protocol == protocol)) {
+            entry = candidate;
+            break;
+        }
+    }
+
+    exporter_options update;
+    memset(&update, 0, sizeof(update));
+    if (entry->exporter == exporter && entry->domain == domain && entry->protocol == protocol) {
+        update = *entry;
+    }
+    update.exporter = exporter;
+    update.domain = domain;
+    update.protocol = protocol;
+    update.sampling = sampling ? sampling : update.sampling;
+    update.system_init = system_init ? system_init : update.system_init;
+
+    if (memcmp((char*)entry + sizeof(uint32_t), (char*)&update + sizeof(uint32_t),
+               sizeof(update) - sizeof(uint32_t))) {
+        write_entry(entry, &update, sizeof(update));
+    }
+    unlock_cache();
+}
+
+/*
+ * Function: store_interface_name
+ *
+ * Keep the name an options record gave one of an exporter's interfaces.
+ * Names are cut short at the first NUL, or to fit.  Characters that
+ * can't be written into an event as they are, quotes, backslashes,
+ * commas and anything unprintable, are replaced with underscores.
+ *
+ * Inputs:   uint32_t        exporter   Exporter address, in network order
+ *           uint32_t        domain     Source ID or observation domain
+ *           int             protocol   NetFlow version the options came in
+ *           uint32_t        ifindex    Index of the interface
+ *           unsigned char*  name       Name, as given in the record
+ *           int             name_len   Length of the name in the record
+ *
+ * Returns:  None
+ */
+static void store_interface_name(uint32_t exporter, uint32_t domain, int protocol,
+                                 uint32_t ifindex, unsigned char* name, int name_len) {
+    interface_name update;
+    memset(&update, 0, sizeof(update));
+    update.exporter = exporter;
+    update.domain = domain;
+    update.protocol = protocol;
+    update.ifindex = ifindex;
+
+    int i;
+    for (i = 0; i < name_len && i < INTERFACE_NAME_SIZE - 1 && name[i]; i++) {
+        int printable = name[i] >= ' ' && name[i] < 0x7f;
+        if (!printable || name[i] == '"' || name[i] == '\\' || name[i] == ',') {
+            update.name[i] = '_';
+        }
+        else {
+            update.name[i] = name[i];
+        }
+    }
+
+    uint32_t home = template_hash(exporter, domain, ifindex, protocol);
+    int probe;
+
+    lock_cache();
+    interface_name* entry = &cache->interfaces[home & (TEMPLATE_INTERFACES - 1)];
+    for (probe = 0; probe < TEMPLATE_PROBES; probe++) {
+        interface_name* candidate = &cache->interfaces[(home + probe) & (TEMPLATE_INTERFACES - 1)];
+        if (candidate->exporter == 0 || (candidate->exporter == exporter &&
+            candidate->domain == domain && candidate->protocol == protocol &&
+            candidate->ifindex == ifindex)) {
+            entry = candidate;
+            break;
+        }
+    }
+
+    if (memcmp((char*)entry + sizeof(uint32_t), (char*)&update + sizeof(uint32_t),
+               sizeof(update) - sizeof(uint32_t))) {
+        write_entry(entry, &update, sizeof(update));
+    }
+    unlock_cache();
+}
+
+/*
+ * Function: template_apply_options
+ *
+ * Take what the records of an options data set say about an exporter:
+ * the rate its flows are sampled at, when its uptime started, and the
+ * names of its interfaces.
+ *
+ * Inputs:   template_program*  program    Program compiled from the options template
+ *           unsigned char*     records    First record of the set
+ *           unsigned char*     end        End of the set
+ *           uint32_t           exporter   Exporter address, in network order
+ *           uint32_t           domain     Source ID or observation domain
+ *           int                protocol   NetFlow version the set came in
+ *
+ * Returns:  None
+ */
+void template_apply_options(template_program* program, unsigned char* records,
+                            unsigned char* end, uint32_t exporter, uint32_t domain,
+                            int protocol) {
+    uint64_t flow[FLOW_FIELDS];
+    int length;
+
+    if (!program->options || program->record_len == 0) {
+        return;
+    }
+
+    while (end - records >= program->record_len &&
+           (length = template_record_length(program, records, end)) > 0) {
+        template_decode(program, records, flow);
+
+        /* A sampler taking 'interval' packets in a row, then skipping
+         * 'space', samples one packet in (interval + space) / interval */
+        uint64_t sampling = flow[FLOW_SAMPLING];
+        if (sampling && flow[FLOW_SAMPLE_SPACE]) {
+            sampling = (sampling + flow[FLOW_SAMPLE_SPACE]) / sampling;
+        }
+        if (sampling || flow[FLOW_SYSTEM_INIT]) {
+            store_exporter_options(exporter, domain, protocol, sampling, flow[FLOW_SYSTEM_INIT]);
+        }
+        if ((flow[FLOW_IFNAME] & 0xffff) && flow[FLOW_IFINDEX]) {
+            store_interface_name(exporter, domain, protocol, flow[FLOW_IFINDEX],
+                                 records + (flow[FLOW_IFNAME] >> 16), flow[FLOW_IFNAME] & 0xffff);
+        }
+        records += length;
+    }
+}
+
+/*
+ * Function: template_export_info
+ *
+ * Fill in what is known of an exporter from its options: the rate its
+ * flows are sampled at, and, if the packet didn't say, when its uptime
+ * started.  The exporter is kept in the info, so the names of its
+ * interfaces can be looked up as its records are formatted.
+ *
+ * Inputs:   uint32_t      exporter   Exporter address, in network order
+ *           uint32_t      domain     Source ID or observation domain
+ *           int           protocol   NetFlow version of the packet
+ *           export_info*  info       Export info, with the times the packet gave
+ *
+ * Returns:  None
+ */
+void template_export_info(uint32_t exporter, uint32_t domain, int protocol, export_info* info) {
+    uint32_t home = template_hash(exporter, domain, 0, protocol);
+    int probe;
+
+    info->exporter = exporter;
+    info->domain = domain;
+    info->protocol = protocol;
+    info->sampling = 1;
+    for (probe = 0; probe < TEMPLATE_PROBES; probe++) {
+        exporter_options entry;
+        read_entry(&cache->exporters[(home + probe) & (TEMPLATE_EXPORTERS - 1)], &entry,
+                   sizeof(entry));
+        if (entry.exporter == 0) {
+            return;
+        }
+        if (entry.exporter == exporter && entry.domain == domain && entry.protocol == protocol) {
+            if (entry.sampling > 1) {
+                info->sampling = entry.sampling;
+            }
+            if (info->boot_time < 0 && entry.system_init) {
+                info->boot_time = (int64_t)entry.system_init * 1000;
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * Function: template_interface_name
+ *
+ * Write the name an exporter's options records gave one of its
+ * interfaces, if they have.
+ *
+ * Inputs:   uint32_t  exporter   Exporter address, in network order
+ *           uint32_t  domain     Source ID or observation domain
+ *           int       protocol   NetFlow version
+ *           uint32_t  ifindex    Index of the interface
+ *           char*     name       Where to write the name, with room for
+ *                                INTERFACE_NAME_SIZE - 1 characters
+ *
+ * Returns:  <length of the name written, 0 if it isn't known>
+ */
+int template_interface_name(uint32_t exporter, uint32_t domain, int protocol, uint32_t ifindex,
+                            char* name) {
+    uint32_t home = template_hash(exporter, domain, ifindex, protocol);
+    int probe;
+
+    for (probe = 0; probe < TEMPLATE_PROBES; probe++) {
+        interface_name entry;
+        read_entry(&cache->interfaces[(home + probe) & (TEMPLATE_INTERFACES - 1)], &entry,
+                   sizeof(entry));
+        if (entry.exporter == 0) {
+            return 0;
+        }
+        if (entry.exporter == exporter && entry.domain == domain &&
+            entry.protocol == protocol && entry.ifindex == ifindex) {
+            int length = strlen(entry.name);
+            memcpy(name, entry.name, length);
+            return length;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: template_hold
+ *
+ * Keep a data set whose template isn't known yet, until it is.
+ *
+ * Inputs:   packet_buffer*  packet       Packet the set came in
+ *           int             header_len   Length of the packet's header
+ *           int             offset       Position of the set in the packet
+ *           int             length       Length of the set
+ *           uint32_t        exporter     Exporter address, in network order
+ *           uint32_t        domain       Source ID or observation domain
+ *           uint16_t        id           Template ID of the set
+ *           int             protocol     NetFlow version of the packet
+ *
+ * Returns:  None
+ */
+static void template_hold(packet_buffer* packet, int header_len, int offset, int length,
+                          uint32_t exporter, uint32_t domain, uint16_t id, int protocol) {
+    int slot = num_held;
+    int i;
+
+    if (num_held == TEMPLATE_HELD) {
+        slot = 0;
+        for (i = 1; i < num_held; i++) {
+            if (held_sets[i].seq < held_sets[slot].seq) {
+                slot = i;
+            }
+        }
+        held_dropped++;
+    }
+    else {
+        num_held++;
+    }
+
+    packet_buffer* copy = &held[slot];
+    copy->mtype = packet->mtype;
+    copy->receive_time = packet->receive_time;
+    memcpy(copy->sender, packet->sender, IPV4_ADDR_SIZE);
+    memcpy(copy->packet, packet->packet, header_len);
+    memcpy(copy->packet + header_len, packet->packet + offset, length);
+    copy->packet_len = header_len + length;
+
+    held_sets[slot].exporter = exporter;
+    held_sets[slot].domain = domain;
+    held_sets[slot].id = id;
+    held_sets[slot].protocol = protocol;
+    held_sets[slot].seq = next_seq++;
+}
+
+/*
+ * Function: template_prepare_set
+ *
+ * Prepare a data set of a packet for formatting.  A set whose template
+ * isn't known yet is moved out of the packet and held until it is.  The
+ * records of an options set are taken in, and aren't formatted.
+ *
+ * Inputs:   packet_buffer*  packet       Packet the set is in
+ *           int             header_len   Length of the packet's header
+ *           int             offset       Position of the set in the packet
+ *           uint32_t        exporter     Exporter address, in network order
+ *           uint32_t        domain       Source ID or observation domain
+ *           int             protocol     NetFlow version of the packet
+ *
+ * Returns:  <# of records to format>   Success
+ *           -1                         The set was held, and is no longer in the packet
+ */
+int template_prepare_set(packet_buffer* packet, int header_len, int offset,
+                         uint32_t exporter, uint32_t domain, int protocol) {
+    flowset_header* set = (flowset_header*)(packet->packet + offset);
+    int id = ntohs(set->id);
+    int length = ntohs(set->length);
+    unsigned char* records = (unsigned char*)set + sizeof(flowset_header);
+    unsigned char* end = (unsigned char*)set + length;
+
+    template_program* program = template_lookup(exporter, domain, id, protocol);
+    if (!program) {
+        template_hold(packet, header_len, offset, length, exporter, domain, id, protocol);
+        memmove(packet->packet + offset, packet->packet + offset + length,
+                packet->packet_len - offset - length);
+        packet->packet_len -= length;
+        return -1;
+    }
+
+    if (program->options) {
+        template_apply_options(program, records, end, exporter, domain, protocol);
+        return 0;
+    }
+    return template_count_records(program, records, end);
+}
+
+/*
+ * Function: template_take_held
+ *
+ * Take the oldest held data set whose template has since become known.
+ * The held sets are only looked at again once a template has been added
+ * or changed by some worker.
+ *
+ * Inputs:   packet_buffer*  packet   Packet buffer to fill
+ *
+ * Returns:  <length of the packet>   A set was taken
+ *           0                        None is ready
+ */
+int template_take_held(packet_buffer* packet) {
+    if (num_held == 0) {
+        return 0;
+    }
+
+    uint32_t generation = template_generation();
+    if (generation == held_generation) {
+        return 0;
+    }
+
+    int ready = -1;
+    int i;
+    for (i = 0; i < num_held; i++) {
+        held_set* set = &held_sets[i];
+        if ((ready < 0 || set->seq < held_sets[ready].seq) &&
+            template_lookup(set->exporter, set->domain, set->id, set->protocol)) {
+            ready = i;
+        }
+    }
+
+    if (ready < 0) {
+        held_generation = generation;
+        return 0;
+    }
+
+    memcpy(packet, &held[ready], offsetof(packet_buffer, packet) + held[ready].packet_len);
+    num_held--;
+    if (ready != num_held) {
+        memcpy(&held[ready], &held[num_held],
+               offsetof(packet_buffer, packet) + held[num_held].packet_len);
+        held_sets[ready] = held_sets[num_held];
+    }
+    return packet->packet_len;
+}
+
+/*
+ * Function: report_template_stats
+ *
+ * Log how many held data sets had to be dropped since the last report
+ * because their templates didn't arrive in time, then reset the count.
+ *
+ * Inputs:   int   worker_num   Id of this worker process
+ *           int   log_queue    Id of IPC queue for logging
+ *
+ * Returns:  None
+ */
+void report_template_stats(int worker_num, int log_queue) {
+    char log_message[LOG_MESSAGE_SIZE];
+
+    if (held_dropped > 0) {
+        sprintf(log_message, "Worker #%d dropped %lu NetFlow v9 or IPFIX data sets that were "
+                             "waiting for their templates.", worker_num, held_dropped);
+        log_warning(log_message, log_queue);
+    }
+    held_dropped = 0;
+}
@@ -0,0 +1,413 @@
+#include <stdio.h>       /* Provides: sprintf */
+#include <string.h>      /* Provides: strerror */
+#include <errno.h>       /* Provides: errno */
+#include <time.h>        /* Provides: nanosleep */
+#include <poll.h>        /* Provides: poll */
+#include <unistd.h>      /* Provides: read, write, close */
+#include <stdint.h>      /* Provides: uint64_t */
+#include <sys/msg.h>     /* Provides: msgsnd, msgrcv */
+#include <sys/mman.h>    /* Provides: mmap, munmap */
+#include <sys/eventfd.h> /* Provides: eventfd */
+#include "freeflow.h"
+#include "transport.h"
+#include "queue.h"
+
+#define RING_RETRY_NSECS  50000
+
+static int sysv_send(packet_transport* transport, packet_buffer* packet);
+static int sysv_try_send(packet_transport* transport, packet_buffer* packet);
+static int sysv_receive(packet_transport* transport, packet_buffer* packet);
+static int sysv_length(packet_transport* transport);
+static void sysv_destroy(packet_transport* transport);
+
+static int ring_send(packet_transport* transport, packet_buffer* packet);
+static int ring_try_send(packet_transport* transport, packet_buffer* packet);
+static int ring_receive(packet_transport* transport, packet_buffer* packet);
+static int ring_transport_length(packet_transport* transport);
+static void ring_destroy(packet_transport* transport);
+
+static int create_doorbell(packet_transport* transport, char* error);
+static void ring_doorbell(packet_transport* transport);
+
+static const transport_ops sysv_transport = {
+    "SysV message queue", sysv_send, sysv_try_send, sysv_receive, sysv_length, sysv_destroy
+};
+
+static const transport_ops ring_transport = {
+    "shared memory ring", ring_send, ring_try_send, ring_receive, ring_transport_length, ring_destroy
+};
+
+/*
+ * Function: sysv_send
+ *
+ * Place a packet on the SysV message queue, blocking while the queue is
+ * full.
+ *
+ * Inputs:   packet_transport*  transport   Transport to send on
+ *           packet_buffer*     packet      Packet to send
+ *
+ * Returns:  0    Success
+ *           -1   Failure, or interrupted by a signal
+ */
+static int sysv_send(packet_transport* transport, packet_buffer* packet) {
+    return msgsnd(transport->queue_id, packet, PACKET_MESSAGE_SIZE(packet), 0);
+}
+
+/*
+ * Function: sysv_try_send
+ *
+ * Place a packet on the SysV message queue, unless the queue is full.
+ *
+ * Inputs:   packet_transport*  transport   Transport to send on
+ *           packet_buffer*     packet      Packet to send
+ *
+ * Returns:  0    Success
+ *           -1   Queue is full, or failure
+ */
+static int sysv_try_send(packet_transport* transport, packet_buffer* packet) {
+    return msgsnd(transport->queue_id, packet, PACKET_MESSAGE_SIZE(packet), IPC_NOWAIT);
+}
+
+/*
+ * Function: sysv_receive
+ *
+ * Take the next packet off the SysV message queue, if there is one.
+ *
+ * Inputs:   packet_transport*  transport   Transport to receive from
+ *           packet_buffer*     packet      Buffer to store the packet
+ *
+ * Returns:  <# of bytes received>   Success
+ *           -1                      Queue is empty, or failure
+ */
+static int sysv_receive(packet_transport* transport, packet_buffer* packet) {
+    return msgrcv(transport->queue_id, packet, PACKET_MESSAGE_MAX, 2, IPC_NOWAIT);
+}
+
+/*
+ * Function: sysv_length
+ *
+ * Return the number of packets waiting on the SysV message queue.
+ *
+ * Inputs:   packet_transport*  transport   Transport to check
+ *
+ * Returns:  <# of packets waiting>
+ */
+static int sysv_length(packet_transport* transport) {
+    return queue_length(transport->queue_id);
+}
+
+/*
+ * Function: sysv_destroy
+ *
+ * Remove the SysV message queue from the system.
+ *
+ * Inputs:   packet_transport*  transport   Transport to remove
+ *
+ * Returns:  None
+ */
+static void sysv_destroy(packet_transport* transport) {
+    delete_queue(transport->queue_id);
+}
+
+/*
+ * Function: ring_send
+ *
+ * Place a packet in the shared memory ring.  While the ring is full, keep
+ * retrying at short intervals, the way msgsnd blocks on a full queue.  A
+ * signal interrupts the wait.
+ *
+ * Inputs:   packet_transport*  transport   Transport to send on
+ *           packet_buffer*     packet      Packet to send
+ *
+ * Returns:  0    Success
+ *           -1   Packet too large, or interrupted by a signal
+ */
+static int ring_send(packet_transport* transport, packet_buffer* packet) {
+    struct timespec retry = { 0, RING_RETRY_NSECS };
+    int rc;
+
+    while ((rc = ring_enqueue(transport->ring, &packet->packet_len,
+                              PACKET_MESSAGE_SIZE(packet))) == -1) {
+        if (nanosleep(&retry, NULL) < 0) {
+            return -1;
+        }
+    }
+    return rc;
+}
+
+/*
+ * Function: ring_try_send
+ *
+ * Place a packet in the shared memory ring, unless the ring is full.
+ *
+ * Inputs:   packet_transport*  transport   Transport to send on
+ *           packet_buffer*     packet      Packet to send
+ *
+ * Returns:  0    Success
+ *           -1   Ring is full, or packet too large
+ */
+static int ring_try_send(packet_transport* transport, packet_buffer* packet) {
+    return (ring_enqueue(transport->ring, &packet->packet_len,
+                         PACKET_MESSAGE_SIZE(packet)) == 0) ? 0 : -1;
+}
+
+/*
+ * Function: ring_receive
+ *
+ * Take the next packet out of the shared memory ring, if there is one.
+ *
+ * Inputs:   packet_transport*  transport   Transport to receive from
+ *           packet_buffer*     packet      Buffer to store the packet
+ *
+ * Returns:  <# of bytes received>   Success
+ *           -1                      Ring is empty
+ */
+static int ring_receive(packet_transport* transport, packet_buffer* packet) {
+    packet->mtype = 2;
+    return ring_dequeue(transport->ring, &packet->packet_len, PACKET_MESSAGE_MAX);
+}
+
+/*
+ * Function: ring_transport_length
+ *
+ * Return the number of packets waiting in the shared memory ring.
+ *
+ * Inputs:   packet_transport*  transport   Transport to check
+ *
+ * Returns:  <# of packets waiting>
+ */
+static int ring_transport_length(packet_transport* transport) {
+    return ring_length(transport->ring);
+}
+
+/*
+ * Function: ring_destroy
+ *
+ * Unmap the shared memory ring from this process.
+ *
+ * Inputs:   packet_transport*  transport   Transport to remove
+ *
+ * Returns:  None
+ */
+static void ring_destroy(packet_transport* transport) {
+    delete_ring(transport->ring);
+}
+
+/*
+ * Function: create_doorbell
+ *
+ * Create the eventfd used to wake processes waiting on the transport, and
+ * map the shared counter of how many processes are waiting.
+ *
+ * Inputs:   packet_transport*  transport   Transport to add the doorbell to
+ *           char*              error       Error string, if operation fails
+ *
+ * Returns:  0    Success
+ *           -1   Failure
+ */
+static int create_doorbell(packet_transport* transport, char* error) {
+    transport->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (transport->wakeup_fd < 0) {
+        sprintf(error, "Unable to create transport wakeup event: %s", strerror(errno));
+        return -1;
+    }
+
+    void* memory = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        sprintf(error, "Unable to map transport wakeup counter: %s", strerror(errno));
+        close(transport->wakeup_fd);
+        return -1;
+    }
+    transport->waiters = memory;
+    *transport->waiters = 0;
+    return 0;
+}
+
+/*
+ * Function: ring_doorbell
+ *
+ * Wake any processes waiting on the transport after a packet was sent.
+ * The full barrier pairs with the one in transport_wait: either the
+ * sender sees the waiter registered, or the waiter sees the packet.
+ *
+ * Inputs:   packet_transport*  transport   Transport a packet was sent on
+ *
+ * Returns:  None
+ */
+static void ring_doorbell(packet_transport* transport) {
+    uint64_t one = 1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(transport->waiters, __ATOMIC_RELAXED) > 0) {
+        if (write(transport->wakeup_fd, &one, sizeof(one)) < 0) {
+            /* The counter is already saturated, so waiters will wake anyway */
+        }
+    }
+}
+
+/*
+ * Function: create_transport
+ *
+ * Create the transport used to hand packets from the receivers to the
+ * workers, of the type selected in the configuration.  This must be done
+ * before the receiver and worker processes are forked, so they all share
+ * it.
+ *
+ * Inputs:   packet_transport*  transport   Transport object to initialize
+ *           freeflow_config*   config      Pointer to configuration object
+ *           char*              error       Error string, if operation fails
+ *
+ * Returns:  0    Success
+ *           -1   Failure
+ */
+int create_transport(packet_transport* transport, freeflow_config* config, char* error) {
+    transport->queue_id = -1;
+    transport->ring = NULL;
+
+    if (create_doorbell(transport, error) < 0) {
+        return -1;
+    }
+
+    if (config->queue_type == TRANSPORT_SYSV) {
+        transport->ops = &sysv_transport;
+        transport->queue_id = create_queue(config->config_file, PACKET_QUEUE, error,
+                                           config->queue_size);
+        return (transport->queue_id < 0) ? -1 : 0;
+    }
+
+    transport->ops = &ring_transport;
+    transport->ring = create_ring(config->queue_size, config->queue_hugepages, error);
+    return (transport->ring == NULL) ? -1 : 0;
+}
+
+/*
+ * Function: delete_transport
+ *
+ * Release the resources held by a packet transport.
+ *
+ * Inputs:   packet_transport*  transport   Transport to delete
+ *
+ * Returns:  None
+ */
+void delete_transport(packet_transport* transport) {
+    transport->ops->destroy(transport);
+    munmap(transport->waiters, sizeof(int));
+    close(transport->wakeup_fd);
+}
+
+/*
+ * Function: transport_send
+ *
+ * Hand a packet to the transport, blocking while the transport is full,
+ * and wake a waiting process to take it.
+ *
+ * Inputs:   packet_transport*  transport   Transport to send on
+ *           packet_buffer*     packet      Packet to send
+ *
+ * Returns:  0    Success
+ *           -1   Failure, or interrupted by a signal
+ */
+int transport_send(packet_transport* transport, packet_buffer* packet) {
+    int rc = transport->ops->send(transport, packet);
+    if (rc == 0) {
+        ring_doorbell(transport);
+    }
+    return rc;
+}
+
+/*
+ * Function: transport_try_send
+ *
+ * Hand a packet to the transport if there is room for it, and wake a
+ * waiting process to take it.  Used by processes that also consume from
+ * the transport, which would otherwise risk waiting on each other.
+ *
+ * Inputs:   packet_transport*  transport   Transport to send on
+ *           packet_buffer*     packet      Packet to send
+ *
+ * Returns:  0    Success
+ *           -1   Transport is full, or failure
+ */
+int transport_try_send(packet_transport* transport, packet_buffer* packet) {
+    int rc = transport->ops->try_send(transport, packet);
+    if (rc == 0) {
+        ring_doorbell(transport);
+    }
+    return rc;
+}
+
+/*
+ * Function: transport_receive
+ *
+ * Take the next packet from the transport without waiting.
+ *
+ * Inputs:   packet_transport*  transport   Transport to receive from
+ *           packet_buffer*     packet      Buffer to store the packet
+ *
+ * Returns:  <# of bytes received>   Success
+ *           -1                      Nothing waiting, or failure
+ */
+int transport_receive(packet_transport* transport, packet_buffer* packet) {
+    return transport->ops->receive(transport, packet);
+}
+
+/*
+ * Function: transport_length
+ *
+ * Return the number of packets waiting in the transport.
+ *
+ * Inputs:   packet_transport*  transport   Transport to check
+ *
+ * Returns:  <# of packets waiting>
+ */
+int transport_length(packet_transport* transport) {
+    return transport->ops->length(transport);
+}
+
+/*
+ * Function: transport_wait
+ *
+ * Sleep until a packet may be waiting in the transport, one of 'wake_fds'
+ * becomes readable, or the timeout expires.  'wake_fds' let the caller
+ * wait for its own events at the same time, such as a pipe written from a
+ * signal handler.  Returns immediately if the transport isn't empty.
+ * Wakeups can be spurious, so the caller should always be prepared to find
+ * the transport empty.
+ *
+ * Inputs:   packet_transport*  transport   Transport to wait on
+ *           int*               wake_fds    Additional descriptors to wait on
+ *           int                num_fds     Number of additional descriptors,
+ *                                          up to TRANSPORT_WAIT_FDS
+ *           int                timeout     Maximum wait in ms, or -1 to
+ *                                          wait indefinitely
+ *
+ * Returns:  1    The transport may have packets waiting
+ *           0    Woken by one of 'wake_fds', or timed out
+ */
+int transport_wait(packet_transport* transport, int* wake_fds, int num_fds, int timeout) {
+    struct pollfd fds[1 + TRANSPORT_WAIT_FDS];
+    uint64_t events;
+    int ready = 1;
+    int i;
+
+    __atomic_add_fetch(transport->waiters, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (transport_length(transport) == 0) {
+        fds[0].fd = transport->wakeup_fd;
+        fds[0].events = POLLIN;
+        for (i = 0; i < num_fds && i < TRANSPORT_WAIT_FDS; i++) {
+            fds[i + 1].fd = wake_fds[i];
+            fds[i + 1].events = POLLIN;
+        }
+
+        ready = (poll(fds, i + 1, timeout) > 0) && (fds[0].revents & POLLIN);
+        if (ready && read(transport->wakeup_fd, &events, sizeof(events)) < 0) {
+            /* Another waiter already reset the event */
+        }
+    }
+
+    __atomic_sub_fetch(transport->waiters, 1, __ATOMIC_RELAXED);
+    return ready;
+}
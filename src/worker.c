@@ -2,141 +2,229 @@
 #include <stdlib.h>      /* Provides: malloc, free, exit */
 #include <string.h>      /* Provides: strcpy, strcat, memcpy */
 #include <netdb.h>       /* Provides: gethostbyname */
-#include <unistd.h>      /* Provides: close */
+#include <unistd.h>      /* Provides: close, pipe, write */
+#include <fcntl.h>       /* Provides: fcntl */
 #include <arpa/inet.h>   /* Provides: inet_ntoa */
-#include <sys/msg.h>     /* Provides: IPC_NOWAIT */
 #include <signal.h>
+#include <time.h>        /* Provides: time */
+#include <poll.h>        /* Provides: poll */
 #include "freeflow.h"
 #include "worker.h"
 #include "netflow.h"
-#include "session.h"
-#include "queue.h"
+#include "netflow9.h"
+#include "ipfix.h"
+#include "sflow.h"
+#include "template.h"
+#include "format.h"
+#include "batch.h"
+#include "compress.h"
+#include "client.h"
+#include "spool.h"
+#include "transport.h"
 #include "logger.h"
-#include "splunk.h"
+
+/* How long a stopping worker waits for the requests it has in flight */
+#define WORKER_DRAIN_TIMEOUT  5000
 
 int keep_working = 1;
 int sigpipe_caught = 0;
 
+/* Self-pipe written by the SIGTERM handler, to wake a worker waiting
+ * on an empty transport. */
+static int shutdown_pipe[2] = { -1, -1 };
+
 static void handle_worker_sigterm(int sig);
 static void handle_worker_sigpipe(int sig);
 static void handle_worker_sigint(int sig);
-static int parse_packet(packet_buffer* packet, char* payload, freeflow_config* config, 
-                 hec_session* session, int log_queue);
+static int create_shutdown_pipe();
+static int validate_packet(packet_buffer* packet, freeflow_config* config,
+                           record_format* format, int log_queue);
+static int batch_has_room(hec_batch* batch, int num_records, freeflow_config* config,
+                          record_format* format);
+static int batch_is_full(hec_batch* batch, freeflow_config* config);
+static void report_compression_stats(payload_compressor* compressor, int worker_num,
+                                     int log_queue);
+static void submit_batch(hec_batch* batch, hec_client* client);
+static void wait_for_client(int* fds, int num_fds, int timeout);
 
 /*
- * Function: parse_packet
+ * Function: validate_packet
  *
- * Receive an IP packet containing netflow records, parse them, and create an
- * HTTP POST message suitable for sending to a Splunk HEC server. 
+ * Make sure a packet received from an exporter is a sane NetFlow v5, v9
+ * or IPFIX packet, or sFlow v5 datagram, before any of its records are
+ * read.  The templates in a v9 or IPFIX packet are learned, and any of
+ * its records whose template isn't known yet are held back until it is.
+ * The records of an sFlow datagram are the samples that make an event.
  *
- * Inputs:   packet_buffer*    server           Packet containing netflow record(s)
- *           char*             payload          String to store HEC payload
- *           freeflow_config*  config           Pointer to configuration object
- *           int               server_instance  Instance # of HEC server to send to
- *           int               log_queue        Id of IPC queue for logging
+ * Inputs:   packet_buffer*    packet      Packet containing netflow record(s)
+ *           freeflow_config*  config      Pointer to configuration object
+ *           record_format*    format      Constant record fragments
+ *           int               log_queue   Id of IPC queue for logging
  *
- * Returns:  0                 Success
+ * Returns:  <# of records in the packet>   Success
+ *           -1                             Invalid packet
  */
-static int parse_packet(packet_buffer* packet, char* payload, freeflow_config* config, 
-                 hec_session* session, int log_queue) {
+static int validate_packet(packet_buffer* packet, freeflow_config* config,
+                           record_format* format, int log_queue) {
 
     char log_message[LOG_MESSAGE_SIZE];
-
-    // Make sure the size of the packet is sane for netflow.
-    if ( (packet->packet_len - 24) % 48 > 0 ){
-        log_warning("Invalid netflow packet length", log_queue);
-        return 1;
-    }
-
     netflow_header *h = (netflow_header*)packet->packet;
+    short num_records;
 
-    // Make sure the version field is correct
-    if (ntohs(h->version) != 5){
-        sprintf(log_message, "Packet received with invalid version: %d", ntohs(h->version));
-        log_warning(log_message, log_queue);
-        return 1;
+    if (ntohs(h->version) == NETFLOW9_VERSION) {
+        if ((num_records = netflow9_prepare(packet, log_queue)) < 0) {
+            log_warning("Invalid NetFlow v9 packet", log_queue);
+            return -1;
+        }
+    }
+    else if (ntohs(h->version) == IPFIX_VERSION) {
+        if ((num_records = ipfix_prepare(packet, log_queue)) < 0) {
+            log_warning("Invalid IPFIX packet", log_queue);
+            return -1;
+        }
     }
+    else if (ntohs(h->version) == SFLOW_PREFIX) {
+        if ((num_records = sflow_prepare(packet, format)) < 0) {
+            log_warning("Invalid sFlow datagram", log_queue);
+            return -1;
+        }
+    }
+    else {
+        // Make sure the size of the packet is sane for netflow.
+        if ( (packet->packet_len - 24) % 48 > 0 ){
+            log_warning("Invalid netflow packet length", log_queue);
+            return -1;
+        }
+
+        // Make sure the version field is correct
+        if (ntohs(h->version) != 5){
+            sprintf(log_message, "Packet received with invalid version: %d", ntohs(h->version));
+            log_warning(log_message, log_queue);
+            return -1;
+        }
 
-    short num_records = ntohs(h->count);
+        num_records = ntohs(h->count);
 
-    // Make sure the number of records is sane
-    if (num_records != (packet->packet_len - 24) / 48){
-        sprintf(log_message, "Invalid number of records: %d", num_records);
-        log_warning(log_message, log_queue);
-        return 1;
+        // Make sure the number of records is sane
+        if (num_records != (packet->packet_len - 24) / 48){
+            sprintf(log_message, "Invalid number of records: %d", num_records);
+            log_warning(log_message, log_queue);
+            return -1;
+        }
     }
      
     if (config->debug) {
         sprintf(log_message, "Packet contains %d records", num_records);
         log_debug(log_message, log_queue);
     } 
+    return num_records;
+}
+
+/*
+ * Function: batch_has_room
+ *
+ * Check whether the records of a packet are certain to fit in a batch
+ * without taking it past the configured limits.  The size of the events
+ * isn't known until they are formatted, so the largest possible size is
+ * assumed.
+ *
+ * Inputs:   hec_batch*        batch         Batch to add the events to
+ *           int               num_records   Number of records in the packet
+ *           freeflow_config*  config        Pointer to configuration object
+ *           record_format*    format        Constant record fragments
+ *
+ * Returns:  1                 The records fit
+ *           0                 The batch should be sent first
+ */
+static int batch_has_room(hec_batch* batch, int num_records, freeflow_config* config,
+                          record_format* format) {
+    return (batch->events + num_records <= config->hec_batch_events) &&
+           (batch->payload_len + format->record_max * num_records <= config->hec_batch_size);
+}
+
+/*
+ * Function: batch_is_full
+ *
+ * Check whether a batch has reached the configured limits, and should be
+ * sent without waiting for more packets.
+ *
+ * Inputs:   hec_batch*        batch         Batch to check
+ *           freeflow_config*  config        Pointer to configuration object
+ *
+ * Returns:  1                 The batch is full
+ *           0                 More events can be added
+ */
+static int batch_is_full(hec_batch* batch, freeflow_config* config) {
+    return (batch->events >= config->hec_batch_events) ||
+           (batch->payload_len >= config->hec_batch_size);
+}
+
+/*
+ * Function: report_compression_stats
+ *
+ * Log how well batches have compressed since the last report, and how
+ * much CPU time compressing them took, then reset the counters.
+ *
+ * Inputs:   payload_compressor* compressor Compressor to report on
+ *           int               worker_num   Id of this worker process
+ *           int               log_queue    Id of IPC queue for logging
+ *
+ * Returns:  None
+ */
+static void report_compression_stats(payload_compressor* compressor, int worker_num,
+                                     int log_queue) {
+    char log_message[LOG_MESSAGE_SIZE];
 
-    long sys_uptime = ntohl(h->sys_uptime);
-    long unix_secs = ntohl(h->unix_secs);
-    long unix_nsecs = ntohl(h->unix_nsecs);
-
-    // The maximum size of a record minus the variable sourcetype is 233 bytes.
-    // 250 bytes provides a reasonable safety buffer.
-    int record_size = (250 + strlen(config->sourcetype));
-
-    char splunk_payload[record_size * num_records];
-    splunk_payload[0] = '\0';
-
-    int record_count;
-    netflow_record *r;
-    for ( record_count = 0; record_count < num_records; record_count++){
-        r = (netflow_record*)((char*)h + 24 + 48 * record_count);
-        struct in_addr s = {r->srcaddr};
-        struct in_addr d = {r->dstaddr};
-        struct in_addr n = {r->nexthop};
-
-        char srcaddr[IPV4_ADDR_SIZE];
-        strcpy(srcaddr, inet_ntoa(s));
-
-        char dstaddr[IPV4_ADDR_SIZE];
-        strcpy(dstaddr, inet_ntoa(d));
-
-        char nexthop[IPV4_ADDR_SIZE];
-        strcpy(nexthop, inet_ntoa(n));
-
-        short input = ntohs(r->input);
-        short output = ntohs(r->output);
-        long packets = ntohl(r->packets);
-        long bytes = ntohl(r->bytes);
-        long first = ntohl(r->first);
-        long last = ntohl(r->last);
-        long duration = last - first;
-        short sport = ntohs(r->srcport);
-        short dport = ntohs(r->dstport);
-        int flags = r->tcp_flags;
-        int prot = r->prot;
-        int tos = r->tos;
-        short srcas = ntohs(r->src_as);
-        short dstas = ntohs(r->dst_as);
-        int srcmask = r->src_mask;
-        int dstmask = r->dst_mask;
-
-        char record[record_size];
-        sprintf(record, "{\"event\": \"%s,%s,%s,%s,%u,%u,%lu,%lu,%lu,%u,%u,%u,%u,%u,%u,%u,%u,%u\", \"sourcetype\": \"%s\", \"time\": \"%.6f\"}",
-            packet->sender, srcaddr, dstaddr, nexthop,
-            input, output, packets, bytes, duration,
-            sport, dport, flags, prot, tos, srcas, dstas,
-            srcmask, dstmask, config->sourcetype,
-            (  (double)unix_secs 
-             + (double)unix_nsecs / 1000000000 
-             - (double)sys_uptime/1000 
-             + (double)first/1000)
-        );
-        strcat(splunk_payload, record);
+    if (compressor->batches > 0) {
+        sprintf(log_message, "Worker #%d compressed %lu batches from %lu to %lu bytes "
+                             "(ratio %.1f:1) using %.3fs CPU.",
+                             worker_num, compressor->batches, compressor->bytes_in,
+                             compressor->bytes_out,
+                             (double)compressor->bytes_in / compressor->bytes_out,
+                             compressor->cpu_usecs / 1000000.0);
+        log_info(log_message, log_queue);
     }
+    reset_compression_stats(compressor);
+}
 
-    hec_header(session->hec, (int)strlen(splunk_payload), payload);
-    strcat(payload, splunk_payload);
-    if (config->debug) {
-        sprintf(log_message, "HTTP message of length %d assembled to send to HEC.", (int)strlen(payload));
-        log_debug(log_message, log_queue);
-    } 
-    return 0;
+/*
+ * Function: submit_batch
+ *
+ * Hand a batch to the HEC client to be sent, and pick up any responses
+ * that have arrived meanwhile.  The client must have room for it.  The
+ * batch is empty on return.
+ *
+ * Inputs:   hec_batch*        batch        Batch of events to send
+ *           hec_client*       client       Client sending the batches
+ *
+ * Returns:  None
+ */
+static void submit_batch(hec_batch* batch, hec_client* client) {
+    client_submit(client, batch);
+    client_poll(client, 0);
+}
+
+/*
+ * Function: wait_for_client
+ *
+ * Sleep until the HEC client needs attention, the worker is signalled to
+ * stop, or the timeout expires, without waking for new packets.
+ *
+ * Inputs:   int*   fds        Descriptors to wait on
+ *           int    num_fds    Number of descriptors
+ *           int    timeout    Maximum wait in ms, or -1 to wait indefinitely
+ *
+ * Returns:  None
+ */
+static void wait_for_client(int* fds, int num_fds, int timeout) {
+    struct pollfd pollfds[TRANSPORT_WAIT_FDS];
+    int i;
+
+    for (i = 0; i < num_fds && i < TRANSPORT_WAIT_FDS; i++) {
+        pollfds[i].fd = fds[i];
+        pollfds[i].events = POLLIN;
+    }
+    poll(pollfds, i, timeout);
 }
 
 /*
@@ -145,6 +233,8 @@ static int parse_packet(packet_buffer* packet, char* payload, freeflow_config* c
  * Handle SIGTERM signals by toggling the 'keep_listening' variable.  
  * This variable controls the main while loop, and will allow the
  * program to end gracefully and ensure everything is cleaned up properly.
+ * A byte is also written to the shutdown pipe, in case the worker is
+ * waiting for a packet.
  *
  * Inputs:   int sig        The signal being passed.  Currently unused.
  *
@@ -152,6 +242,11 @@ static int parse_packet(packet_buffer* packet, char* payload, freeflow_config* c
  */
 static void handle_worker_sigterm(int sig) {
     keep_working = 0;
+    if (shutdown_pipe[1] >= 0) {
+        if (write(shutdown_pipe[1], "", 1) < 0) {
+            /* The pipe is already full, so the worker will wake anyway */
+        }
+    }
 }
 
 /*
@@ -180,152 +275,251 @@ static void handle_worker_sigpipe(int sig) {
  */
 static void handle_worker_sigint(int sig) {}
 
+/*
+ * Function: create_shutdown_pipe
+ *
+ * Create the non-blocking self-pipe the SIGTERM handler uses to wake the
+ * worker while it waits for packets.
+ *
+ * Inputs:   None
+ *
+ * Returns:  0    Success
+ *           -1   Failure
+ */
+static int create_shutdown_pipe() {
+    if (pipe(shutdown_pipe) < 0) {
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < 2; i++) {
+        fcntl(shutdown_pipe[i], F_SETFL, fcntl(shutdown_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(shutdown_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+}
+
 /*
  * Function: splunk_worker
  *
- * The main function of a worker process.  This routine tests connectivity
- * to Splunk HEC, and validates the authentication credentials.  If
- * successful, it will continually poll an IPC message queue looking for
- * new netflow packets, parse them, and then send to HEC.  This process
- * continues indefinitely until receiving a SIGTERM.
+ * The main function of a worker process.  This routine connects to Splunk
+ * HEC, and validates the authentication credentials.  If successful, it
+ * will continually take new netflow packets from the packet transport and
+ * parse them into a batch of events, sleeping while the transport is
+ * empty.  A batch is handed to the HEC client once it is full, or once it
+ * has lingered for the configured time, and the worker carries on with the
+ * next one while the client sends it.  Packets are only taken while the
+ * client has room for another batch, unless HEC is out of reach and a
+ * spool is configured, in which case they are written to disk, and
+ * replayed at a limited rate alongside new packets once HEC is back.
+ * NetFlow v9 and IPFIX records held back for want of a template are
+ * taken first, once their template has been learned by any worker.
+ * This process continues indefinitely until receiving a SIGTERM.
  *
  * Inputs:   int               worker_num  Id of this worker process
  *           freeflow_config*  config      Configuration object
+ *           packet_transport* transport   Transport to take packets from
  *           int               log_queue   Id of the IPC message queue to
  *                                         send logs to.
  *
  * Returns:  0          Success
+ *           -1         Couldn't create the shutdown pipe, batch buffers,
+ *                      spool or HEC client
  */
-int splunk_worker(int worker_num, freeflow_config *config, int log_queue) {
-    signal(SIGTERM, handle_worker_sigterm);
-    signal(SIGINT, handle_worker_sigint);
-    signal(SIGPIPE, handle_worker_sigpipe);
-
+int splunk_worker(int worker_num, freeflow_config *config, packet_transport* transport,
+                  int log_queue) {
     char log_message[LOG_MESSAGE_SIZE];
-    char error_message[LOG_MESSAGE_SIZE];
-    char recv_buffer_header[PACKET_BUFFER_SIZE];
-    char recv_buffer_payload[PACKET_BUFFER_SIZE];
-    char payload[PAYLOAD_BUFFER_SIZE];
 
-    hec_session session;
-
-    if ((initialize_session(&session, worker_num, config, log_queue)) < 0 ) {;
+    if (create_shutdown_pipe() < 0) {
+        sprintf(log_message, "Worker #%d unable to create shutdown pipe.", worker_num);
+        log_error(log_message, log_queue);
         kill(getppid(), SIGTERM);
+        return -1;
     }
 
-    if ((test_connectivity(&session, worker_num, config, log_queue)) < 0 ) {
+    hec_batch batch;
+    if (create_batch(&batch) < 0) {
+        sprintf(log_message, "Worker #%d unable to allocate batch buffers.", worker_num);
+        log_error(log_message, log_queue);
         kill(getppid(), SIGTERM);
+        return -1;
     }
 
-    sprintf(log_message, "Splunk worker #%d [PID %d] started.", worker_num, getpid());
-    log_info(log_message, log_queue);
+    payload_compressor gzip;
+    payload_compressor* compressor = NULL;
+    if (config->hec_gzip_level > 0) {
+        if (create_compressor(&gzip, config->hec_gzip_level) < 0) {
+            sprintf(log_message, "Worker #%d unable to initialize gzip compression.", worker_num);
+            log_error(log_message, log_queue);
+            kill(getppid(), SIGTERM);
+            return -1;
+        }
+        compressor = &gzip;
+    }
+
+    record_format format;
+    init_record_format(&format, config);
+
+    packet_spool disk;
+    packet_spool* spool = NULL;
+    if (strcmp(config->spool_dir, "")) {
+        if (create_spool(&disk, worker_num, config, log_queue) < 0) {
+            sprintf(log_message, "Worker #%d unable to use spool directory %.150s.",
+                                 worker_num, config->spool_dir);
+            log_error(log_message, log_queue);
+            kill(getppid(), SIGTERM);
+            return -1;
+        }
+        spool = &disk;
+    }
 
-    int packet_queue = create_queue(config->config_file, PACKET_QUEUE, error_message, config->queue_size);
-    if (packet_queue < 0) {
-        sprintf(log_message, 
-                "Splunk worker #%d [PID %d] unable to open packet queue: %s.", 
-                worker_num, getpid(), error_message);        
+    hec_client client;
+    if (create_client(&client, worker_num, config, &format, transport, spool, compressor,
+                      log_queue) < 0) {
+        sprintf(log_message, "Worker #%d unable to allocate HEC client.", worker_num);
         log_error(log_message, log_queue);
         kill(getppid(), SIGTERM);
+        return -1;
+    }
+
+    signal(SIGTERM, handle_worker_sigterm);
+    signal(SIGINT, handle_worker_sigint);
+    signal(SIGPIPE, handle_worker_sigpipe);
+
+    if (client_start(&client) < 0) {
+        kill(getppid(), SIGTERM);
     }
 
+    sprintf(log_message, "Splunk worker #%d [PID %d] started.", worker_num, getpid());
+    log_info(log_message, log_queue);
+
+    int wake_fds[2] = { shutdown_pipe[0], client.epoll_fd };
+    time_t last_report = time(NULL);
     packet_buffer packet;
     while(keep_working) {
-        /* If there are no messages in the queue, don't wait for one to
-         * arrive.  This is to give an opportunity for the loop to be 
-         * broken by a SIGTERM.  If the queue was empty, sleep for 0.01s
-         * to prevent the CPU from saturating. */  
-        int bytes = msgrcv(packet_queue, &packet, sizeof(packet), 2, IPC_NOWAIT);
-        if (bytes <= 0) {
-            usleep(1000);
-            continue;
+        if (config->stats_interval > 0 && time(NULL) - last_report >= config->stats_interval) {
+            if (compressor) {
+                report_compression_stats(compressor, worker_num, log_queue);
+            }
+            report_template_stats(worker_num, log_queue);
+            last_report = time(NULL);
         }
 
-        if (config->debug){
-            sprintf(log_message, "Worker #%d accepted packet from queue", worker_num);
-            log_debug(log_message, log_queue);
+        int room = client_has_room(&client);
+        int available = client_available(&client);
+        int spooling = !room && spool && !available;
+        int bytes = 0;
+        if (room && !batch_is_full(&batch, config)) {
+            bytes = template_take_held(&packet);
+            if (bytes <= 0 && spool && available) {
+                bytes = spool_read(spool, &packet);
+            }
+            if (bytes <= 0) {
+                bytes = transport_receive(transport, &packet);
+            }
+        }
+        else if (spooling && transport_receive(transport, &packet) > 0) {
+            /* Keep the transport moving while HEC can't be reached */
+            spool_write(spool, &packet);
+            continue;
         }
-        parse_packet(&packet, payload, config, &session, log_queue);
 
-        int bytes_sent = session_write(&session, payload, strlen(payload));
+        /* If no more packets can be added to the batch, send it if it's
+         * full or has lingered long enough.  Otherwise sleep until a
+         * receiver signals that a packet has arrived, the client needs
+         * attention, or the batch is due.  Packets are left alone while
+         * the client has no room, unless they are being spooled.  Spooled
+         * packets are replayed as the replay rate allows.  A SIGTERM also
+         * ends the wait, through the shutdown pipe. */
+        if (bytes <= 0) {
+            int timeout = client_timeout(&client);
+            if (room && batch.events > 0) {
+                long linger = batch.started + config->hec_batch_linger - monotonic_ms();
+                if (linger <= 0 || batch_is_full(&batch, config)) {
+                    submit_batch(&batch, &client);
+                    continue;
+                }
+                if (timeout < 0 || linger < timeout) {
+                    timeout = (int)linger;
+                }
+            }
+            if (room && spool && available) {
+                int replay = spool_timeout(spool);
+                if (replay >= 0 && (timeout < 0 || replay < timeout)) {
+                    timeout = replay;
+                }
+            }
 
-        if (bytes_sent < strlen(payload)) {
-            log_warning("Worker #%d Incomplete packet delivery.", log_queue);
+            if (room || spooling) {
+                transport_wait(transport, wake_fds, 2, timeout);
+            }
+            else {
+                wait_for_client(wake_fds, 2, timeout);
+            }
+            client_poll(&client, 0);
+            continue;
         }
-        else if (config->debug) {
-            sprintf(log_message,"Worker #%d delivered packet to HEC [%s]."
-                               , worker_num, session.hec->addr);
+
+        if (config->debug){
+            sprintf(log_message, "Worker #%d accepted packet from queue", worker_num);
             log_debug(log_message, log_queue);
         }
 
-        int bytes_read_header = session_read(&session, recv_buffer_header, PACKET_BUFFER_SIZE);
-
-        /* If a SIGPIPE was signalled, or no bytes were read, we may have a problem . */
-        if ((bytes_read_header <= 0) || (sigpipe_caught)) {
-            int retry_count = 1;
-            while (keep_working && ((bytes_read_header <= 0) || (sigpipe_caught))) {
-                int status = session_status(&session, error_message);
-
-                /* If the session is still up, keep trying */
-                if ((status == 0) && !(sigpipe_caught)) {
-                    sprintf(log_message, "Worker #%d received no response from HEC.  Retrying [#%d]."
-                                       , worker_num, retry_count);
-                    log_warning(log_message, log_queue);
-
-                    sleep(1);
-                    bytes_read_header = session_read(&session, recv_buffer_header, PACKET_BUFFER_SIZE);
-                    retry_count++;
-                }
-                
-                /* If it isn't, requeue the packet so it may be delivered by another worker */
-                else {
-                    if (sigpipe_caught) {
-                        strcpy(error_message, "Not connected");
-                    }
-                    sprintf(log_message, "Worker #%d HEC socket error: %s.", worker_num, error_message);
-                    log_warning(log_message, log_queue);                
-
-                    sprintf(log_message, "Worker #%d requeuing undelivered packet.", worker_num);
-                    log_info(log_message, log_queue); 
-                    msgsnd(packet_queue, &packet, sizeof(packet_buffer), 0);
-
-                    sprintf(log_message, "Worker #%d attempting to reestablish connection to HEC.", worker_num);
-                    log_info(log_message, log_queue); 
-                    reestablish_session(&session, worker_num, config, log_queue);
-
-                    sprintf(log_message, "Worker #%d reestablished connection to HEC.  Reentering service."
-                                       , worker_num);
-                    log_info(log_message, log_queue); 
-                    break;
-                }
-            }
-            sigpipe_caught = 0;
+        int num_records = validate_packet(&packet, config, &format, log_queue);
+        if (num_records <= 0) {
             continue;
         }
 
-        int code = response_code(recv_buffer_header);
+        if (batch.events > 0 && !batch_has_room(&batch, num_records, config, &format)) {
+            submit_batch(&batch, &client);
+        }
 
-        /* If Splunk returns an error, requeue the packet for future delivery and take this worker
-         * out of service for 10s to see if the problem clears.
-         */
-        if (code != 200) {
-            sprintf(log_message, "Worker #%d received error writing to HEC [%d]."
-                               , worker_num, code);
+        if (batch_add_records(&batch, &packet, num_records, &format) < 0) {
+            if (transport_try_send(transport, &packet) < 0) {
+                sprintf(log_message, "Worker #%d unable to grow batch.  Packet dropped.", worker_num);
+            }
+            else {
+                sprintf(log_message, "Worker #%d unable to grow batch.  Packet requeued.", worker_num);
+            }
             log_warning(log_message, log_queue);
+            if (batch.events > 0 && client_has_room(&client)) {
+                submit_batch(&batch, &client);
+            }
+        }
+    }
 
-            sprintf(log_message, "Worker #%d requeuing undelivered packet.", worker_num);
-            log_info(log_message, log_queue); 
-            msgsnd(packet_queue, &packet, sizeof(packet_buffer), 0);
-            
-            sleep(10);
-            sprintf(log_message, "Worker #%d reentering service.", worker_num);
-            log_info(log_message, log_queue);
+    /* Deliver whatever was collected before the SIGTERM arrived, and give
+     * the requests in flight a while to complete */
+    long deadline = monotonic_ms() + WORKER_DRAIN_TIMEOUT;
+    while ((batch.events > 0 || client_outstanding(&client) > 0) && monotonic_ms() < deadline) {
+        if (batch.events > 0 && client_has_room(&client)) {
+            client_submit(&client, &batch);
+        }
+        client_poll(&client, (int)(deadline - monotonic_ms()));
+    }
+    client_abandon(&client);
+    if (batch.events > 0) {
+        if (spool) {
+            spool_batch(spool, &batch);
+        }
+        else {
+            batch_requeue(&batch, transport);
         }
+    }
 
-        session_read(&session, recv_buffer_payload, PACKET_BUFFER_SIZE);
+    if (compressor) {
+        report_compression_stats(compressor, worker_num, log_queue);
+        free_compressor(compressor);
+    }
+    report_template_stats(worker_num, log_queue);
+    free_client(&client);
+    if (spool) {
+        free_spool(spool);
     }
-    
-    close(session.socket_id);
+    free_ssl_context();
+    free_batch(&batch);
+    close(shutdown_pipe[0]);
+    close(shutdown_pipe[1]);
 
     return 0;
 }